@@ -0,0 +1,68 @@
+#ifndef INCLUDE_BINARY_H
+#define INCLUDE_BINARY_H
+
+#include "String.h"
+
+#include <stdint.h>
+#include <string.h>
+
+//  Fixed-width fields and length-prefixed strings, in the machine's own
+//  byte order, for the files the interpreter writes for itself to read
+//  back: form caches and images.
+class BinaryWriter {
+public:
+    void put(const void* data, size_t size) {
+        m_out.append(static_cast<const char*>(data), size);
+    }
+    void put8(uint8_t value)   { put(&value, sizeof(value)); }
+    void put32(uint32_t value) { put(&value, sizeof(value)); }
+    void put64(uint64_t value) { put(&value, sizeof(value)); }
+    void putString(const String& value) {
+        put32(value.size());
+        put(value.data(), value.size());
+    }
+
+    const String& data() const { return m_out; }
+
+private:
+    String m_out;
+};
+
+class BinaryReader {
+public:
+    //  Thrown on reading past the end.
+    struct Truncated { };
+
+    BinaryReader(const char* begin, const char* end)
+        : m_next(begin), m_end(end) { }
+
+    const char* get(size_t size) {
+        if (size > remaining()) {
+            throw Truncated();
+        }
+        const char* data = m_next;
+        m_next += size;
+        return data;
+    }
+    uint8_t  get8()  { uint8_t value;  read(value); return value; }
+    uint32_t get32() { uint32_t value; read(value); return value; }
+    uint64_t get64() { uint64_t value; read(value); return value; }
+    String getString() {
+        uint32_t size = get32();
+        return String(get(size), size);
+    }
+
+    size_t remaining() const { return m_end - m_next; }
+    bool atEnd() const { return m_next == m_end; }
+
+private:
+    template<typename T>
+    void read(T& value) {
+        memcpy(&value, get(sizeof(value)), sizeof(value));
+    }
+
+    const char* m_next;
+    const char* const m_end;
+};
+
+#endif // INCLUDE_BINARY_H
@@ -0,0 +1,176 @@
+#ifndef INCLUDE_BUILTINS_H
+#define INCLUDE_BUILTINS_H
+
+#include "MAL.h"
+#include "StaticList.h"
+#include "Types.h"
+
+#include <iterator>
+#include <typeinfo>
+
+//  Builtins register themselves into this list during static
+//  initialisation; installCore() binds every entry into an environment.
+extern StaticList<malBuiltIn*>& builtinHandlers();
+
+#define CHECK_ARGS_IS(expected) \
+    checkArgsIs(name.c_str(), expected, \
+                  std::distance(argsBegin, argsEnd))
+
+#define CHECK_ARGS_BETWEEN(min, max) \
+    checkArgsBetween(name.c_str(), min, max, \
+                       std::distance(argsBegin, argsEnd))
+
+#define CHECK_ARGS_AT_LEAST(expected) \
+    checkArgsAtLeast(name.c_str(), expected, \
+                        std::distance(argsBegin, argsEnd))
+
+#define ARG(type, name) type* name = VALUE_CAST(type, *argsBegin++)
+
+#define FUNCNAME(uniq) builtIn ## uniq
+#define HRECNAME(uniq) handler ## uniq
+
+//  An untyped builtin receives the raw argument iterators and does its own
+//  arity and type checking. The arguments are its own: it may clear a slot
+//  once it has finished with the argument, as reduce does, so that a lazy
+//  seq which nothing else refers to is freed as it is walked. Callers of
+//  APPLY which reuse an argument vector fill it in again before each call.
+#define BUILTIN_DEF(uniq, symbol) \
+    static malBuiltIn::ApplyFunc FUNCNAME(uniq); \
+    static StaticList<malBuiltIn*>::Node HRECNAME(uniq) \
+        (builtinHandlers(), new malBuiltIn(symbol, FUNCNAME(uniq))); \
+    malValuePtr FUNCNAME(uniq)(const String& name, \
+        malValueIter argsBegin, malValueIter argsEnd)
+
+#define BUILTIN(symbol)  BUILTIN_DEF(__LINE__, symbol)
+
+//  A typed builtin is written as an ordinary function. Its arity and the
+//  type of each argument are taken from the parameter list, and the code
+//  which checks and unpacks the arguments is generated at compile time:
+//
+//      TYPED_BUILTIN("nth", malSequence* seq, malInteger* index) { ... }
+//
+//  Parameters may be malValuePtr (anything), a pointer to a malValue
+//  subclass, or a trailing malArgs which collects the remaining arguments.
+#define TYPED_BUILTIN_DEF(uniq, symbol, ...) \
+    static malValuePtr FUNCNAME(uniq)(__VA_ARGS__); \
+    static StaticList<malBuiltIn*>::Node HRECNAME(uniq) \
+        (builtinHandlers(), new malBuiltIn(symbol, \
+            &TypedBuiltIn<decltype(&FUNCNAME(uniq)), \
+                          &FUNCNAME(uniq)>::apply)); \
+    malValuePtr FUNCNAME(uniq)(__VA_ARGS__)
+
+#define TYPED_BUILTIN(symbol, ...) \
+    TYPED_BUILTIN_DEF(__LINE__, symbol, __VA_ARGS__)
+
+//  The trailing arguments of a variadic typed builtin.
+struct malArgs {
+    malArgs(malValueIter begin, malValueIter end)
+        : begin(begin), end(end) { }
+
+    int count() const { return std::distance(begin, end); }
+
+    malValueIter begin;
+    malValueIter end;
+};
+
+//  ArgType<T>::get() converts the argument at 'it' to the parameter type T.
+template<typename T> struct ArgType;
+
+template<> struct ArgType<malValuePtr> {
+    static const bool isRest = false;
+    static malValuePtr get(malValueIter it, malValueIter end) { return *it; }
+};
+
+template<> struct ArgType<malArgs> {
+    static const bool isRest = true;
+    static malArgs get(malValueIter it, malValueIter end) {
+        return malArgs(it, end);
+    }
+};
+
+// Any class in the hierarchy: a full dynamic_cast.
+#define ARG_TYPE(Type) \
+    template<> struct ArgType<Type*> { \
+        static const bool isRest = false; \
+        static Type* get(malValueIter it, malValueIter end) { \
+            return VALUE_CAST(Type, *it); \
+        } \
+    }
+
+// A leaf class: comparing the dynamic type is enough.
+#define ARG_TYPE_EXACT(Type) \
+    template<> struct ArgType<Type*> { \
+        static const bool isRest = false; \
+        static Type* get(malValueIter it, malValueIter end) { \
+            malValue* value = (*it).ptr(); \
+            MAL_CHECK(typeid(*value) == typeid(Type), "%s is not a %s", \
+                      value->print(true).c_str(), #Type); \
+            return static_cast<Type*>(value); \
+        } \
+    }
+
+ARG_TYPE(malApplicable);
+ARG_TYPE(malSequence);
+ARG_TYPE_EXACT(malAtom);
+ARG_TYPE_EXACT(malChannel);
+ARG_TYPE_EXACT(malHash);
+ARG_TYPE_EXACT(malInteger);
+ARG_TYPE_EXACT(malIsolate);
+ARG_TYPE_EXACT(malKeyword);
+ARG_TYPE_EXACT(malList);
+ARG_TYPE_EXACT(malString);
+ARG_TYPE_EXACT(malSymbol);
+ARG_TYPE_EXACT(malTransducer);
+ARG_TYPE_EXACT(malVector);
+
+template<int... Is> struct ArgIndices { };
+
+template<int N, int... Is>
+struct MakeArgIndices : MakeArgIndices<N - 1, N - 1, Is...> { };
+
+template<int... Is>
+struct MakeArgIndices<0, Is...> {
+    typedef ArgIndices<Is...> type;
+};
+
+template<typename... Args> struct LastIsRest {
+    static const bool value = false;
+};
+
+template<typename Last> struct LastIsRest<Last> {
+    static const bool value = ArgType<Last>::isRest;
+};
+
+template<typename First, typename Second, typename... Rest>
+struct LastIsRest<First, Second, Rest...> {
+    static const bool value = LastIsRest<Second, Rest...>::value;
+};
+
+template<typename F, F f> struct TypedBuiltIn;
+
+template<typename... Args, malValuePtr (*f)(Args...)>
+struct TypedBuiltIn<malValuePtr (*)(Args...), f> {
+    static const bool hasRest = LastIsRest<Args...>::value;
+    static const int  fixedCount = sizeof...(Args) - (hasRest ? 1 : 0);
+
+    static malValuePtr apply(const String& name,
+                             malValueIter argsBegin, malValueIter argsEnd) {
+        if (hasRest) {
+            CHECK_ARGS_AT_LEAST(fixedCount);
+        }
+        else {
+            CHECK_ARGS_IS(fixedCount);
+        }
+        return call(argsBegin, argsEnd,
+                    typename MakeArgIndices<sizeof...(Args)>::type());
+    }
+
+private:
+    template<int... Is>
+    static malValuePtr call(malValueIter argsBegin, malValueIter argsEnd,
+                            ArgIndices<Is...>) {
+        return f(ArgType<Args>::get(argsBegin + Is, argsEnd)...);
+    }
+};
+
+#endif // INCLUDE_BUILTINS_H
@@ -1,71 +1,419 @@
 #include "MAL.h"
+#include "Builtins.h"
 #include "Environment.h"
+#include "FileIO.h"
+#include "FormCache.h"
+#include "HeapProfiler.h"
+#include "Image.h"
+#include "Interpreter.h"
+#include "Profiler.h"
 #include "StaticList.h"
+#include "Task.h"
+#include "ThreadPool.h"
+#include "Tracer.h"
 #include "Types.h"
 
+#include <algorithm>
 #include <chrono>
-#include <fstream>
-#include <iostream>
+#include <cmath>
+#include <memory>
+#include <string.h>
 
-#define CHECK_ARGS_IS(expected) \
-    checkArgsIs(name.c_str(), expected, \
-                  std::distance(argsBegin, argsEnd))
+static void printValues(Sink& out, malValueIter begin, malValueIter end,
+                        const char* sep, bool readably);
+static void printLine(const malArgs& args, bool readably);
 
-#define CHECK_ARGS_BETWEEN(min, max) \
-    checkArgsBetween(name.c_str(), min, max, \
-                       std::distance(argsBegin, argsEnd))
+StaticList<malBuiltIn*>& builtinHandlers()
+{
+    static StaticList<malBuiltIn*> handlers;
+    return handlers;
+}
 
-#define CHECK_ARGS_AT_LEAST(expected) \
-    checkArgsAtLeast(name.c_str(), expected, \
-                        std::distance(argsBegin, argsEnd))
+//  Applies fn to args on the thread pool.
+static malValuePtr startFuture(malValuePtr fn, const malValueVec& args)
+{
+    // The task keeps the interpreter alive, since its owner may let go
+    // of it (a session ending, say) while the future is still running.
+    malInterpreterPtr interp;
+    if (malInterpreter* current = malInterpreter::current()) {
+        interp = current->shared_from_this();
+    }
+    ThreadPool& pool = ThreadPool::start();
+    if (interp) {
+        interp->env()->share();
+    }
+    malValuePtr future = mal::future(fn, args);
+    pool.submit([future, interp]() {
+        malInterpreter::Scope scope(interp.get());
+        STATIC_CAST(malFuture, future)->run();
+    });
+    return future;
+}
 
-static String printValues(malValueIter begin, malValueIter end,
-                           const String& sep, bool readably);
+//  The channel behind a handle, which this thread must own.
+static Channel* channelArg(malChannel* handle)
+{
+    Channel* channel = handle->channel().get();
+    channel->checkOwner();
+    return channel;
+}
 
-static StaticList<malBuiltIn*> handlers;
+//  Calls f with each element of coll until it returns false. coll may be
+//  nil, a sequence or a lazy seq. A lazy seq is let go of once walking it
+//  has started, so that if coll was the only other reference to it, as it
+//  is for the argument of a builtin, the elements walked past are freed as
+//  the walk goes. That keeps reducing over a line-seq of any length in
+//  bounded memory.
+template<typename F>
+static void forEachItem(malValuePtr& coll, F f)
+{
+    if (const malSequence* seq = DYNAMIC_CAST(malSequence, coll)) {
+        for (int i = 0, count = seq->count(); i < count; i++) {
+            if (!f(seq->item(i))) {
+                return;
+            }
+        }
+        return;
+    }
+    malLazySeq::Cursor it(coll);
+    coll = malValuePtr();
+    malValuePtr item;
+    while (it.next(item) && f(item)) {
+    }
+}
+
+namespace {
+    //  One run of a transducer. The take and drop stages count down as
+    //  elements go through them, so a lazy seq can carry the counts over
+    //  from one chunk to the next.
+    class Pipeline {
+    public:
+        Pipeline(const malTransducer::Stages& stages)
+            : m_stages(stages), m_remaining(stages.size()), m_arg(1) {
+            for (int i = 0, count = stages.size(); i < count; i++) {
+                m_remaining[i] = stages[i].count;
+            }
+        }
 
-#define ARG(type, name) type* name = VALUE_CAST(type, *argsBegin++)
+        Pipeline(const malTransducer::Stages& stages,
+                 const std::vector<int64_t>& remaining)
+            : m_stages(stages), m_remaining(remaining), m_arg(1) { }
 
-#define FUNCNAME(uniq) builtIn ## uniq
-#define HRECNAME(uniq) handler ## uniq
-#define BUILTIN_DEF(uniq, symbol) \
-    static malBuiltIn::ApplyFunc FUNCNAME(uniq); \
-    static StaticList<malBuiltIn*>::Node HRECNAME(uniq) \
-        (handlers, new malBuiltIn(symbol, FUNCNAME(uniq))); \
-    malValuePtr FUNCNAME(uniq)(const String& name, \
-        malValueIter argsBegin, malValueIter argsEnd)
+        const std::vector<int64_t>& remaining() const { return m_remaining; }
 
-#define BUILTIN(symbol)  BUILTIN_DEF(__LINE__, symbol)
+        //  Pushes item through the stages and hands it to step if it
+        //  survives. Returns false once step returns false or a take stage
+        //  has let through all of its elements.
+        template<typename Step>
+        bool push(malValuePtr item, Step step);
+
+    private:
+        const malTransducer::Stages& m_stages;
+        std::vector<int64_t>         m_remaining;
+        malValueVec                  m_arg;
+    };
+}
+
+template<typename Step>
+bool Pipeline::push(malValuePtr item, Step step)
+{
+    bool more = true;
+    for (int i = 0, count = m_stages.size(); i < count; i++) {
+        const malTransducer::Stage& stage = m_stages[i];
+        switch (stage.kind) {
+            case malTransducer::Map:
+                m_arg[0] = item;
+                item = APPLY(stage.fn, m_arg.begin(), m_arg.end());
+                break;
+
+            case malTransducer::Filter:
+            case malTransducer::Remove: {
+                m_arg[0] = item;
+                bool keep = APPLY(stage.fn, m_arg.begin(), m_arg.end())
+                                ->isTrue();
+                if (keep != (stage.kind == malTransducer::Filter)) {
+                    return more;
+                }
+                break;
+            }
+
+            case malTransducer::Take:
+                if (m_remaining[i] <= 0) {
+                    return false;
+                }
+                more = (--m_remaining[i] > 0);
+                break;
+
+            case malTransducer::Drop:
+                if (m_remaining[i] > 0) {
+                    m_remaining[i]--;
+                    return more;
+                }
+                break;
+        }
+    }
+    return step(item) && more;
+}
+
+//  Pushes each element of coll through the stages in a single pass and
+//  hands the survivors to step.
+template<typename Step>
+static void runStages(const malTransducer::Stages& stages,
+                      malValuePtr& coll, Step step)
+{
+    Pipeline pipeline(stages);
+    forEachItem(coll, [&](malValuePtr item) -> bool {
+        return pipeline.push(item, step);
+    });
+}
+
+namespace {
+    //  (lazy-seq* f): the sequence returned by calling f.
+    class ThunkSource : public malLazySeq::Source {
+    public:
+        ThunkSource(malValuePtr fn) : m_fn(fn) { }
+
+        virtual malValuePtr realise(malValueVec& chunk) const {
+            malValueVec none;
+            return APPLY(m_fn, none.begin(), none.end());
+        }
+
+    private:
+        const malValuePtr m_fn;
+    };
+
+    //  (iterate f x): x, (f x), (f (f x)), ...
+    class IterateSource : public malLazySeq::Source {
+    public:
+        IterateSource(malValuePtr fn, malValuePtr seed, bool applyFirst)
+            : m_fn(fn), m_seed(seed), m_applyFirst(applyFirst) { }
+
+        virtual malValuePtr realise(malValueVec& chunk) const {
+            malValueVec arg(1, m_seed);
+            malValuePtr value = m_seed;
+            for (int i = 0; i < malLazySeq::ChunkSize; i++) {
+                if ((i > 0) || m_applyFirst) {
+                    arg[0] = value;
+                    value = APPLY(m_fn, arg.begin(), arg.end());
+                }
+                chunk.push_back(value);
+            }
+            return mal::lazySeq(new IterateSource(m_fn, value, true));
+        }
+
+    private:
+        const malValuePtr m_fn;
+        const malValuePtr m_seed;
+        const bool        m_applyFirst;
+    };
+
+    //  (repeat x) and (repeat n x). A negative count repeats forever.
+    class RepeatSource : public malLazySeq::Source {
+    public:
+        RepeatSource(malValuePtr value, int64_t count)
+            : m_value(value), m_count(count) { }
+
+        virtual malValuePtr realise(malValueVec& chunk) const {
+            int64_t size = malLazySeq::ChunkSize;
+            if ((m_count >= 0) && (m_count < size)) {
+                size = m_count;
+            }
+            chunk.assign(size, m_value);
+            if (m_count < 0) {
+                return mal::lazySeq(new RepeatSource(m_value, m_count));
+            }
+            return (m_count > size)
+                ? mal::lazySeq(new RepeatSource(m_value, m_count - size))
+                : mal::nilValue();
+        }
+
+    private:
+        const malValuePtr m_value;
+        const int64_t     m_count;
+    };
+
+    //  (line-seq path): the lines of a file, read as they are needed.
+    class LineSource : public malLazySeq::Source {
+    public:
+        LineSource(LineReaderPtr reader) : m_reader(reader) { }
+
+        virtual malValuePtr realise(malValueVec& chunk) const {
+            String line;
+            while ((chunk.size() < malLazySeq::ChunkSize) &&
+                   m_reader->next(line)) {
+                chunk.push_back(mal::string(std::move(line)));
+            }
+            if (chunk.size() < malLazySeq::ChunkSize) {
+                return mal::nilValue();
+            }
+            return mal::lazySeq(new LineSource(m_reader));
+        }
+
+    private:
+        const LineReaderPtr m_reader;
+    };
+
+    //  (range): 0, 1, 2, ..., and ranges too long to build up front. The
+    //  arithmetic is unsigned so that stepping past the end of a range
+    //  near the integer limits wraps rather than overflowing.
+    class RangeSource : public malLazySeq::Source {
+    public:
+        //  An endless range has more elements than can ever be realised.
+        static const uint64_t Endless = UINT64_MAX;
+
+        RangeSource(int64_t start, int64_t step, uint64_t count)
+            : m_start(start), m_step(step), m_count(count) { }
+
+        virtual malValuePtr realise(malValueVec& chunk) const {
+            uint64_t size = malLazySeq::ChunkSize;
+            if (m_count < size) {
+                size = m_count;
+            }
+            uint64_t value = m_start;
+            for (uint64_t i = 0; i < size; i++, value += m_step) {
+                chunk.push_back(mal::integer(static_cast<int64_t>(value)));
+            }
+            if (m_count == size) {
+                return mal::nilValue();
+            }
+            return mal::lazySeq(new RangeSource(static_cast<int64_t>(value),
+                m_step, (m_count == Endless) ? Endless : m_count - size));
+        }
+
+    private:
+        const int64_t  m_start;
+        const int64_t  m_step;
+        const uint64_t m_count;
+    };
+
+    //  A transducer applied to a lazy seq. Each chunk pulls just enough
+    //  elements from the input to fill itself.
+    class PipelineSource : public malLazySeq::Source {
+    public:
+        PipelineSource(const malTransducer::Stages& stages,
+                       malValuePtr input)
+            : m_stages(stages)
+            , m_remaining(Pipeline(stages).remaining())
+            , m_input(input) { }
+
+        PipelineSource(const malTransducer::Stages& stages,
+                       const std::vector<int64_t>& remaining,
+                       malValuePtr input)
+            : m_stages(stages), m_remaining(remaining), m_input(input) { }
+
+        virtual malValuePtr realise(malValueVec& chunk) const {
+            Pipeline pipeline(m_stages, m_remaining);
+            malLazySeq::Cursor it(m_input);
+            malValuePtr item;
+            bool more = true;
+            while ((chunk.size() < malLazySeq::ChunkSize) && it.next(item)) {
+                more = pipeline.push(item, [&](malValuePtr out) -> bool {
+                    chunk.push_back(out);
+                    return true;
+                });
+                if (!more) {
+                    return mal::nilValue();
+                }
+            }
+            if (chunk.size() < malLazySeq::ChunkSize) {
+                return mal::nilValue();
+            }
+            return mal::lazySeq(new PipelineSource(m_stages,
+                                                   pipeline.remaining(),
+                                                   it.rest()));
+        }
+
+    private:
+        const malTransducer::Stages m_stages;
+        const std::vector<int64_t>  m_remaining;
+        const malValuePtr           m_input;
+    };
+}
+
+static malValueVec* collect(const malTransducer::Stages& stages,
+                            malValuePtr coll)
+{
+    malValueVec* items = new malValueVec;
+    if (const malSequence* seq = DYNAMIC_CAST(malSequence, coll)) {
+        items->reserve(seq->count());
+    }
+    runStages(stages, coll, [=](malValuePtr item) -> bool {
+        items->push_back(item);
+        return true;
+    });
+    return items;
+}
+
+//  map, filter, remove, take and drop return a transducer when called
+//  without a collection, a lazy seq when given one, and a list otherwise.
+static malValuePtr stageOrRun(const String& name, malTransducer::Kind kind,
+                              malValueIter argsBegin, malValueIter argsEnd)
+{
+    int argCount = CHECK_ARGS_BETWEEN(1, 2);
+    malValuePtr fn;
+    int64_t count = 0;
+    if ((kind == malTransducer::Take) || (kind == malTransducer::Drop)) {
+        count = VALUE_CAST(malInteger, *argsBegin)->value();
+    }
+    else {
+        fn = *argsBegin; // this gets checked in APPLY
+    }
+
+    malValuePtr xf = mal::transducer(kind, fn, count);
+    if (argCount == 1) {
+        return xf;
+    }
+    const malTransducer* t = STATIC_CAST(malTransducer, xf);
+    malValuePtr coll = argsBegin[1];
+    if (DYNAMIC_CAST(malLazySeq, coll)) {
+        // Stay lazy, so that this works on unbounded sequences.
+        return mal::lazySeq(new PipelineSource(t->stages(), coll));
+    }
+    return mal::list(collect(t->stages(), coll));
+}
+
+static malValuePtr reduceWith(const malTransducer::Stages& stages,
+                              malValuePtr f, malValuePtr init,
+                              malValuePtr& coll)
+{
+    malValueVec args(2);
+    args[0] = init;
+    runStages(stages, coll, [&](malValuePtr item) -> bool {
+        args[1] = item;
+        args[0] = APPLY(f, args.begin(), args.end());
+        return true;
+    });
+    return args[0];
+}
 
 #define BUILTIN_ISA(symbol, type) \
-    BUILTIN(symbol) { \
-        CHECK_ARGS_IS(1); \
-        return mal::boolean(DYNAMIC_CAST(type, *argsBegin)); \
+    TYPED_BUILTIN(symbol, malValuePtr arg) { \
+        return mal::boolean(DYNAMIC_CAST(type, arg)); \
     }
 
 #define BUILTIN_IS(op, constant) \
-    BUILTIN(op) { \
-        CHECK_ARGS_IS(1); \
-        return mal::boolean(*argsBegin == mal::constant()); \
+    TYPED_BUILTIN(op, malValuePtr arg) { \
+        return mal::boolean(arg == mal::constant()); \
     }
 
 #define BUILTIN_INTOP(op, checkDivByZero) \
-    BUILTIN(#op) { \
-        CHECK_ARGS_IS(2); \
-        ARG(malInteger, lhs); \
-        ARG(malInteger, rhs); \
+    TYPED_BUILTIN(#op, malInteger* lhs, malInteger* rhs) { \
         if (checkDivByZero) { \
             MAL_CHECK(rhs->value() != 0, "Division by zero"); \
         } \
         return mal::integer(lhs->value() op rhs->value()); \
     }
 
+#define BUILTIN_INTCMP(op) \
+    TYPED_BUILTIN(#op, malInteger* lhs, malInteger* rhs) { \
+        return mal::boolean(lhs->value() op rhs->value()); \
+    }
+
 BUILTIN_ISA("atom?",        malAtom);
 BUILTIN_ISA("keyword?",     malKeyword);
 BUILTIN_ISA("list?",        malList);
 BUILTIN_ISA("map?",         malHash);
 BUILTIN_ISA("number?",      malInteger);
-BUILTIN_ISA("sequential?",  malSequence);
 BUILTIN_ISA("string?",      malString);
 BUILTIN_ISA("symbol?",      malSymbol);
 BUILTIN_ISA("vector?",      malVector);
@@ -79,6 +427,11 @@ BUILTIN_IS("true?",         trueValue);
 BUILTIN_IS("false?",        falseValue);
 BUILTIN_IS("nil?",          nilValue);
 
+BUILTIN_INTCMP(<=);
+BUILTIN_INTCMP(>=);
+BUILTIN_INTCMP(<);
+BUILTIN_INTCMP(>);
+
 BUILTIN("-")
 {
     int argCount = CHECK_ARGS_BETWEEN(1, 2);
@@ -91,94 +444,265 @@ BUILTIN("-")
     return mal::integer(lhs->value() - rhs->value());
 }
 
-BUILTIN("<=")
+TYPED_BUILTIN("=", malValuePtr lhs, malValuePtr rhs)
 {
-    CHECK_ARGS_IS(2);
-    ARG(malInteger, lhs);
-    ARG(malInteger, rhs);
-
-    return mal::boolean(lhs->value() <= rhs->value());
+    return mal::boolean(lhs->isEqualTo(rhs.ptr()));
 }
 
-BUILTIN(">=")
+//  Each op is a channel to take from, or a [channel value] pair to put.
+//  Returns [value channel] for the first one to complete.
+TYPED_BUILTIN("alts!", malSequence* opsArg)
 {
-    CHECK_ARGS_IS(2);
-    ARG(malInteger, lhs);
-    ARG(malInteger, rhs);
+    MAL_CHECK(!opsArg->isEmpty(), "alts! needs at least one operation");
+    std::vector<ChannelOp> ops(opsArg->count());
+    malValueVec handles(opsArg->count());
+    for (int i = 0, count = opsArg->count(); i < count; i++) {
+        malValuePtr op = opsArg->item(i);
+        if (const malVector* put = DYNAMIC_CAST(malVector, op)) {
+            checkArgsIs("alts! put", 2, put->count());
+            handles[i] = put->item(0);
+            ops[i].isPut = true;
+            ops[i].value = put->item(1);
+            MAL_CHECK(ops[i].value != mal::nilValue(),
+                      "can't put nil on a channel");
+        }
+        else {
+            handles[i] = op;
+            ops[i].isPut = false;
+        }
+        ops[i].channel = channelArg(VALUE_CAST(malChannel, handles[i]));
+    }
 
-    return mal::boolean(lhs->value() >= rhs->value());
+    malValuePtr value;
+    int index = alts(ops, value);
+    malValueVec* result = new malValueVec;
+    result->push_back(value);
+    result->push_back(handles[index]);
+    return mal::vector(result);
 }
 
-BUILTIN("<")
+BUILTIN("apply")
 {
-    CHECK_ARGS_IS(2);
-    ARG(malInteger, lhs);
-    ARG(malInteger, rhs);
+    CHECK_ARGS_AT_LEAST(2);
+    malValuePtr op = *argsBegin++; // this gets checked in APPLY
 
-    return mal::boolean(lhs->value() < rhs->value());
+    // Copy the first N-1 arguments in.
+    malValueVec args(argsBegin, argsEnd-1);
+
+    // Then append the argument as a list.
+    forEachItem(*(argsEnd-1), [&](malValuePtr item) -> bool {
+        args.push_back(item);
+        return true;
+    });
+
+    return APPLY(op, args.begin(), args.end());
 }
 
-BUILTIN(">")
+TYPED_BUILTIN("assoc", malHash* hash, malArgs args)
 {
-    CHECK_ARGS_IS(2);
-    ARG(malInteger, lhs);
-    ARG(malInteger, rhs);
+    return hash->assoc(args.begin, args.end);
+}
 
-    return mal::boolean(lhs->value() > rhs->value());
+TYPED_BUILTIN("atom", malValuePtr value)
+{
+    return mal::atom(value);
 }
 
-BUILTIN("=")
+//  An option of bench, or its default if opts doesn't give it.
+static int64_t benchOption(const malHash* opts, const char* name,
+                           int64_t defaultValue)
 {
-    CHECK_ARGS_IS(2);
-    const malValue* lhs = (*argsBegin++).ptr();
-    const malValue* rhs = (*argsBegin++).ptr();
+    malValuePtr value = opts ? opts->get(mal::keyword(name))
+                             : mal::nilValue();
+    if (value == mal::nilValue()) {
+        return defaultValue;
+    }
+    int64_t option = VALUE_CAST(malInteger, value)->value();
+    MAL_CHECK(option >= 0, "bench's %s option can't be negative", name);
+    return option;
+}
 
-    return mal::boolean(lhs->isEqualTo(rhs));
+//  The nearest-rank percentile of sorted values.
+static double percentile(const std::vector<double>& values, int p)
+{
+    size_t rank = (values.size() * p + 99) / 100;
+    return values[std::min(std::max(rank, (size_t)1), values.size()) - 1];
 }
 
-BUILTIN("apply")
+static uint64_t allocationCount(const Stats::Totals& totals)
 {
-    CHECK_ARGS_AT_LEAST(2);
-    malValuePtr op = *argsBegin++; // this gets checked in APPLY
+    uint64_t count = 0;
+    for (int i = 0, classes = Stats::classCount(); i < classes; i++) {
+        count += totals.allocated[i];
+    }
+    return count;
+}
 
-    // Copy the first N-1 arguments in.
-    malValueVec args(argsBegin, argsEnd-1);
+//  Calls f in batches, doubling their size until one takes :batch-ns, so
+//  that the clock's resolution and the loop don't count for much. The
+//  statistics are of the nanoseconds per call in each batch, leaving out
+//  batches more than 1.5 interquartile ranges outside the middle half.
+//  Options are :warmup calls, :samples batches and :batch-ns.
+BUILTIN("bench")
+{
+    int argCount = CHECK_ARGS_BETWEEN(1, 2);
+    malValuePtr f = *argsBegin++; // this gets checked in APPLY
+    const malHash* opts = NULL;
+    if (argCount == 2) {
+        opts = VALUE_CAST(malHash, *argsBegin);
+    }
+    int64_t warmup  = benchOption(opts, ":warmup", 10);
+    int64_t samples = benchOption(opts, ":samples", 30);
+    int64_t batchNs = benchOption(opts, ":batch-ns", 1000000);
+    MAL_CHECK(samples > 0, "bench needs at least one sample");
 
-    // Then append the argument as a list.
-    const malSequence* lastArg = VALUE_CAST(malSequence, *(argsEnd-1));
-    for (int i = 0; i < lastArg->count(); i++) {
-        args.push_back(lastArg->item(i));
+    using namespace std::chrono;
+    malValueVec none;
+    auto run = [&](int64_t calls) -> int64_t {
+        steady_clock::time_point start = steady_clock::now();
+        for (int64_t i = 0; i < calls; i++) {
+            APPLY(f, none.begin(), none.end());
+        }
+        return duration_cast<nanoseconds>(
+            steady_clock::now() - start).count();
+    };
+
+    run(warmup);
+    int64_t batch = 1;
+    while ((run(batch) < batchNs) && (batch < (1 << 30))) {
+        batch *= 2;
     }
 
-    return APPLY(op, args.begin(), args.end());
+    Stats::Totals before, after;
+    Stats::read(before);
+    std::vector<double> times(samples);
+    for (int64_t i = 0; i < samples; i++) {
+        times[i] = double(run(batch)) / batch;
+    }
+    Stats::read(after);
+    int64_t calls = samples * batch;
+
+    std::sort(times.begin(), times.end());
+    double q1 = percentile(times, 25), q3 = percentile(times, 75);
+    double low = q1 - 1.5 * (q3 - q1), high = q3 + 1.5 * (q3 - q1);
+    std::vector<double> kept;
+    for (double t : times) {
+        if ((t >= low) && (t <= high)) {
+            kept.push_back(t);
+        }
+    }
+
+    double mean = 0, variance = 0;
+    for (double t : kept) {
+        mean += t;
+    }
+    mean /= kept.size();
+    for (double t : kept) {
+        variance += (t - mean) * (t - mean);
+    }
+    variance /= kept.size();
+
+    uint64_t allocations = allocationCount(after) - allocationCount(before);
+    uint64_t bytes = after.allocatedBytes - before.allocatedBytes;
+    const struct { const char* name; double value; } stats[] = {
+        { ":mean",            mean },
+        { ":median",          percentile(kept, 50) },
+        { ":p99",             percentile(kept, 99) },
+        { ":stddev",          std::sqrt(variance) },
+        { ":min",             kept.front() },
+        { ":max",             kept.back() },
+        { ":allocs",          double(allocations) / calls },
+        { ":allocated-bytes", double(bytes) / calls },
+        { ":batch",           double(batch) },
+        { ":samples",         double(kept.size()) },
+        { ":outliers",        double(times.size() - kept.size()) },
+    };
+    malValueVec items;
+    for (auto& stat : stats) {
+        items.push_back(mal::keyword(stat.name));
+        items.push_back(mal::integer(std::llround(stat.value)));
+    }
+    return mal::hash(items.begin(), items.end(), true);
 }
 
-BUILTIN("assoc")
+BUILTIN("chan")
 {
-    CHECK_ARGS_AT_LEAST(1);
-    ARG(malHash, hash);
+    int argCount = CHECK_ARGS_BETWEEN(0, 1);
+    int capacity = 0;
+    if (argCount == 1) {
+        ARG(malInteger, size);
+        capacity = size->value();
+        MAL_CHECK(capacity >= 0, "chan expects a size of at least 0");
+    }
+    return malValuePtr(new malChannel(std::make_shared<Channel>(capacity)));
+}
 
-    return hash->assoc(argsBegin, argsEnd);
+TYPED_BUILTIN("close!", malChannel* handle)
+{
+    channelArg(handle)->close();
+    Scheduler::instance().settle();
+    return mal::nilValue();
 }
 
-BUILTIN("atom")
+//  Composes either transducers, into one transducer, or functions, into
+//  a function which applies the last to its arguments and each of the
+//  others to the result of the one after it.
+TYPED_BUILTIN("comp", malArgs args)
 {
-    CHECK_ARGS_IS(1);
+    if ((args.begin == args.end) ||
+        (DYNAMIC_CAST(malTransducer, *args.begin) != NULL)) {
+        malTransducer::Stages stages;
+        for (auto it = args.begin; it != args.end; ++it) {
+            const malTransducer* xf = DYNAMIC_CAST(malTransducer, *it);
+            MAL_CHECK(xf != NULL, "comp expects transducers, got %s",
+                      (*it)->print(true).c_str());
+            stages.insert(stages.end(),
+                          xf->stages().begin(), xf->stages().end());
+        }
+        return mal::transducer(stages);
+    }
 
-    return mal::atom(*argsBegin);
+    for (auto it = args.begin; it != args.end; ++it) {
+        MAL_CHECK(DYNAMIC_CAST(malApplicable, *it) != NULL,
+                  "comp expects functions, got %s",
+                  (*it)->print(true).c_str());
+    }
+    if (args.end - args.begin == 1) {
+        return *args.begin;
+    }
+
+    // (fn* [& args] (f (g (apply h args)))), with the functions themselves
+    // in place of their names, as values evaluate to themselves.
+    malValuePtr apply;
+    StaticList<malBuiltIn*>& handlers = builtinHandlers();
+    for (auto it = handlers.begin(), end = handlers.end(); it != end; ++it) {
+        if ((*it)->name() == "apply") {
+            apply = *it;
+        }
+    }
+    auto it = args.end - 1;
+    malValuePtr body = mal::list(apply, *it, mal::symbol("args"));
+    while (it != args.begin) {
+        --it;
+        body = mal::list(*it, body);
+    }
+    StringVec params;
+    params.push_back("&");
+    params.push_back("args");
+    return mal::lambda(params, body, malEnvPtr(new malEnv));
 }
 
-BUILTIN("concat")
+TYPED_BUILTIN("concat", malArgs args)
 {
     int count = 0;
-    for (auto it = argsBegin; it != argsEnd; ++it) {
+    for (auto it = args.begin; it != args.end; ++it) {
         const malSequence* seq = VALUE_CAST(malSequence, *it);
         count += seq->count();
     }
 
     malValueVec* items = new malValueVec(count);
     int offset = 0;
-    for (auto it = argsBegin; it != argsEnd; ++it) {
+    for (auto it = args.begin; it != args.end; ++it) {
         const malSequence* seq = STATIC_CAST(malSequence, *it);
         std::copy(seq->begin(), seq->end(), items->begin() + offset);
         offset += seq->count();
@@ -187,20 +711,17 @@ BUILTIN("concat")
     return mal::list(items);
 }
 
-BUILTIN("conj")
+TYPED_BUILTIN("conj", malSequence* seq, malArgs args)
 {
-    CHECK_ARGS_AT_LEAST(1);
-    ARG(malSequence, seq);
-
-    return seq->conj(argsBegin, argsEnd);
+    return seq->conj(args.begin, args.end);
 }
 
-BUILTIN("cons")
+TYPED_BUILTIN("cons", malValuePtr first, malValuePtr restArg)
 {
-    CHECK_ARGS_IS(2);
-    malValuePtr first = *argsBegin++;
-    ARG(malSequence, rest);
-
+    if (DYNAMIC_CAST(malLazySeq, restArg)) {
+        return mal::lazySeq(first, restArg);
+    }
+    const malSequence* rest = VALUE_CAST(malSequence, restArg);
     malValueVec* items = new malValueVec(1 + rest->count());
     items->at(0) = first;
     std::copy(rest->begin(), rest->end(), items->begin() + 1);
@@ -208,72 +729,79 @@ BUILTIN("cons")
     return mal::list(items);
 }
 
-BUILTIN("contains?")
+TYPED_BUILTIN("contains?", malValuePtr map, malValuePtr key)
 {
-    CHECK_ARGS_IS(2);
-    if (*argsBegin == mal::nilValue()) {
-        return *argsBegin;
+    if (map == mal::nilValue()) {
+        return map;
     }
-    ARG(malHash, hash);
-    return mal::boolean(hash->contains(*argsBegin));
+    malHash* hash = VALUE_CAST(malHash, map);
+    return mal::boolean(hash->contains(key));
 }
 
-BUILTIN("count")
+TYPED_BUILTIN("count", malValuePtr arg)
 {
-    CHECK_ARGS_IS(1);
-    if (*argsBegin == mal::nilValue()) {
+    if (arg == mal::nilValue()) {
         return mal::integer(0);
     }
+    if (const malLazySeq* lazy = DYNAMIC_CAST(malLazySeq, arg)) {
+        return mal::integer(lazy->count());
+    }
 
-    ARG(malSequence, seq);
+    malSequence* seq = VALUE_CAST(malSequence, arg);
     return mal::integer(seq->count());
 }
 
-BUILTIN("deref")
+TYPED_BUILTIN("deref", malValuePtr arg)
 {
-    CHECK_ARGS_IS(1);
-    ARG(malAtom, atom);
-
-    return atom->deref();
+    if (const malFuture* future = DYNAMIC_CAST(malFuture, arg)) {
+        return future->deref();
+    }
+    return VALUE_CAST(malAtom, arg)->deref();
 }
 
-BUILTIN("dissoc")
+TYPED_BUILTIN("dissoc", malHash* hash, malArgs args)
 {
-    CHECK_ARGS_AT_LEAST(1);
-    ARG(malHash, hash);
-
-    return hash->dissoc(argsBegin, argsEnd);
+    return hash->dissoc(args.begin, args.end);
 }
 
-BUILTIN("empty?")
+BUILTIN("drop")
 {
-    CHECK_ARGS_IS(1);
-    ARG(malSequence, seq);
+    return stageOrRun(name, malTransducer::Drop, argsBegin, argsEnd);
+}
 
+TYPED_BUILTIN("empty?", malValuePtr arg)
+{
+    if (const malLazySeq* lazy = DYNAMIC_CAST(malLazySeq, arg)) {
+        return mal::boolean(lazy->isEmpty());
+    }
+    malSequence* seq = VALUE_CAST(malSequence, arg);
     return mal::boolean(seq->isEmpty());
 }
 
-BUILTIN("eval")
+TYPED_BUILTIN("eval", malValuePtr ast)
 {
-    CHECK_ARGS_IS(1);
-    return EVAL(*argsBegin, NULL);
+    return EVAL(ast, NULL);
 }
 
-BUILTIN("first")
+BUILTIN("filter")
 {
-    CHECK_ARGS_IS(1);
-    if (*argsBegin == mal::nilValue()) {
+    return stageOrRun(name, malTransducer::Filter, argsBegin, argsEnd);
+}
+
+TYPED_BUILTIN("first", malValuePtr arg)
+{
+    if (arg == mal::nilValue()) {
         return mal::nilValue();
     }
-    ARG(malSequence, seq);
+    if (const malLazySeq* lazy = DYNAMIC_CAST(malLazySeq, arg)) {
+        return lazy->first();
+    }
+    malSequence* seq = VALUE_CAST(malSequence, arg);
     return seq->first();
 }
 
-BUILTIN("fn?")
+TYPED_BUILTIN("fn?", malValuePtr arg)
 {
-    CHECK_ARGS_IS(1);
-    malValuePtr arg = *argsBegin++;
-
     // Lambdas are functions, unless they're macros.
     if (const malLambda* lambda = DYNAMIC_CAST(malLambda, arg)) {
         return mal::boolean(!lambda->isMacro());
@@ -282,32 +810,95 @@ BUILTIN("fn?")
     return mal::boolean(DYNAMIC_CAST(malBuiltIn, arg));
 }
 
-BUILTIN("get")
+TYPED_BUILTIN("future-call", malValuePtr fn)
+{
+    return startFuture(fn, malValueVec());
+}
+
+TYPED_BUILTIN("future-done?", malValuePtr arg)
+{
+    return mal::boolean(VALUE_CAST(malFuture, arg)->isDone());
+}
+
+TYPED_BUILTIN("get", malValuePtr map, malValuePtr key)
+{
+    if (map == mal::nilValue()) {
+        return map;
+    }
+    malHash* hash = VALUE_CAST(malHash, map);
+    return hash->get(key);
+}
+
+TYPED_BUILTIN("go*", malValuePtr fn)
+{
+    return Scheduler::instance().go(fn);
+}
+
+TYPED_BUILTIN("hash-map", malArgs args)
 {
-    CHECK_ARGS_IS(2);
-    if (*argsBegin == mal::nilValue()) {
-        return *argsBegin;
+    return mal::hash(args.begin, args.end, true);
+}
+
+//  Samples every allocation by default.
+BUILTIN("heap-profile-start")
+{
+    int argCount = CHECK_ARGS_BETWEEN(0, 1);
+    int rate = 1;
+    if (argCount == 1) {
+        ARG(malInteger, every);
+        rate = every->value();
     }
-    ARG(malHash, hash);
-    return hash->get(*argsBegin);
+    HeapProfiler::start(rate);
+    return mal::nilValue();
 }
 
-BUILTIN("hash-map")
+TYPED_BUILTIN("heap-profile-stop", malString* path)
 {
-    return mal::hash(argsBegin, argsEnd, true);
+    return mal::integer(HeapProfiler::stop(path->value()));
 }
 
-BUILTIN("keys")
+BUILTIN("into")
+{
+    int argCount = CHECK_ARGS_BETWEEN(2, 3);
+    malValuePtr to = *argsBegin++;
+    malTransducer::Stages stages;
+    if (argCount == 3) {
+        ARG(malTransducer, xf);
+        stages = xf->stages();
+    }
+    std::unique_ptr<malValueVec> items(collect(stages, *argsBegin));
+
+    if (const malHash* hash = DYNAMIC_CAST(malHash, to)) {
+        malValueVec pairs;
+        pairs.reserve(2 * items->size());
+        for (auto it = items->begin(), end = items->end(); it != end; ++it) {
+            const malSequence* pair = VALUE_CAST(malSequence, *it);
+            MAL_CHECK(pair->count() == 2,
+                      "into expects [key value] pairs for a hash-map");
+            pairs.push_back(pair->item(0));
+            pairs.push_back(pair->item(1));
+        }
+        return hash->assoc(pairs.begin(), pairs.end());
+    }
+    if (to == mal::nilValue()) {
+        to = mal::list(new malValueVec(0));
+    }
+    const malSequence* seq = VALUE_CAST(malSequence, to);
+    return seq->conj(items->begin(), items->end());
+}
+
+TYPED_BUILTIN("iterate", malValuePtr fn, malValuePtr seed)
+{
+    return mal::lazySeq(new IterateSource(fn, seed, false));
+}
+
+TYPED_BUILTIN("keys", malHash* hash)
 {
-    CHECK_ARGS_IS(1);
-    ARG(malHash, hash);
     return hash->keys();
 }
 
-BUILTIN("keyword")
+TYPED_BUILTIN("keyword", malValuePtr arg)
 {
-    CHECK_ARGS_IS(1);
-    const malValuePtr arg = *argsBegin++;
     if (malKeyword* s = DYNAMIC_CAST(malKeyword, arg))
       return s;
     if (const malString* s = DYNAMIC_CAST(malString, arg))
@@ -315,110 +906,323 @@ BUILTIN("keyword")
     MAL_FAIL("keyword expects a keyword or string");
 }
 
-BUILTIN("list")
+TYPED_BUILTIN("line-seq", malString* path)
 {
-    return mal::list(argsBegin, argsEnd);
+    return mal::lazySeq(new LineSource(new LineReader(path->value())));
 }
 
-BUILTIN("macro?")
+TYPED_BUILTIN("list", malArgs args)
 {
-    CHECK_ARGS_IS(1);
+    return mal::list(args.begin, args.end);
+}
 
+TYPED_BUILTIN("macro?", malValuePtr arg)
+{
     // Macros are implemented as lambdas, with a special flag.
-    const malLambda* lambda = DYNAMIC_CAST(malLambda, *argsBegin);
+    const malLambda* lambda = DYNAMIC_CAST(malLambda, arg);
     return mal::boolean((lambda != NULL) && lambda->isMacro());
 }
 
 BUILTIN("map")
 {
-    CHECK_ARGS_IS(2);
-    malValuePtr op = *argsBegin++; // this gets checked in APPLY
-    ARG(malSequence, source);
-
-    const int length = source->count();
-    malValueVec* items = new malValueVec(length);
-    auto it = source->begin();
-    for (int i = 0; i < length; i++) {
-      items->at(i) = APPLY(op, it+i, it+i+1);
-    }
-
-    return  mal::list(items);
+    return stageOrRun(name, malTransducer::Map, argsBegin, argsEnd);
 }
 
-BUILTIN("meta")
+TYPED_BUILTIN("lazy-seq*", malValuePtr fn)
 {
-    CHECK_ARGS_IS(1);
-    malValuePtr obj = *argsBegin++;
+    return mal::lazySeq(new ThunkSource(fn));
+}
 
+TYPED_BUILTIN("meta", malValuePtr obj)
+{
     return obj->meta();
 }
 
-BUILTIN("nth")
+TYPED_BUILTIN("nth", malValuePtr arg, malInteger* index)
 {
-    CHECK_ARGS_IS(2);
-    ARG(malSequence, seq);
-    ARG(malInteger,  index);
+    int64_t i = index->value();
+    if (DYNAMIC_CAST(malLazySeq, arg)) {
+        malLazySeq::Cursor it(arg);
+        malValuePtr item;
+        for (int64_t n = 0; (i >= 0) && it.next(item); n++) {
+            if (n == i) {
+                return item;
+            }
+        }
+        MAL_FAIL("Index out of range");
+    }
 
-    int i = index->value();
+    malSequence* seq = VALUE_CAST(malSequence, arg);
     MAL_CHECK(i >= 0 && i < seq->count(), "Index out of range");
 
     return seq->item(i);
 }
 
-BUILTIN("pr-str")
+TYPED_BUILTIN("pcalls", malArgs args)
 {
-    return mal::string(printValues(argsBegin, argsEnd, " ", true));
+    malValueVec futures(args.begin, args.end);
+    for (auto it = futures.begin(), end = futures.end(); it != end; ++it) {
+        *it = startFuture(*it, malValueVec());
+    }
+    malValueVec* items = new malValueVec(futures.size());
+    for (int i = 0, count = futures.size(); i < count; i++) {
+        (*items)[i] = STATIC_CAST(malFuture, futures[i])->deref();
+    }
+    return mal::list(items);
 }
 
-BUILTIN("println")
+TYPED_BUILTIN("pmap", malValuePtr fn, malValuePtr coll)
 {
-    std::cout << printValues(argsBegin, argsEnd, " ", false) << "\n";
+    malValueVec futures;
+    forEachItem(coll, [&](malValuePtr item) -> bool {
+        futures.push_back(startFuture(fn, malValueVec(1, item)));
+        return true;
+    });
+    malValueVec* items = new malValueVec(futures.size());
+    for (int i = 0, count = futures.size(); i < count; i++) {
+        (*items)[i] = STATIC_CAST(malFuture, futures[i])->deref();
+    }
+    return mal::list(items);
+}
+
+TYPED_BUILTIN("pr-str", malArgs args)
+{
+    Sink out;
+    printValues(out, args.begin, args.end, " ", true);
+    return mal::string(out.str());
+}
+
+TYPED_BUILTIN("println", malArgs args)
+{
+    printLine(args, false);
     return mal::nilValue();
 }
 
-BUILTIN("prn")
+TYPED_BUILTIN("prn", malArgs args)
 {
-    std::cout << printValues(argsBegin, argsEnd, " ", true) << "\n";
+    printLine(args, true);
     return mal::nilValue();
 }
 
-BUILTIN("read-string")
+//  Samples every millisecond of CPU time by default.
+BUILTIN("profile-start")
 {
-    CHECK_ARGS_IS(1);
-    ARG(malString, str);
+    int argCount = CHECK_ARGS_BETWEEN(0, 1);
+    int intervalUs = 1000;
+    if (argCount == 1) {
+        ARG(malInteger, interval);
+        intervalUs = interval->value();
+    }
+    Profiler::start(intervalUs);
+    return mal::nilValue();
+}
 
-    return readStr(str->value());
+TYPED_BUILTIN("profile-stop", malString* path)
+{
+    return mal::integer(Profiler::stop(path->value()));
+}
+
+TYPED_BUILTIN("put!", malChannel* handle, malValuePtr value)
+{
+    MAL_CHECK(value != mal::nilValue(), "can't put nil on a channel");
+    std::vector<ChannelOp> ops(1);
+    ops[0].channel = channelArg(handle);
+    ops[0].isPut = true;
+    ops[0].value = value;
+    malValuePtr isAccepted;
+    alts(ops, isAccepted);
+    return isAccepted;
+}
+
+//  Ranges longer than this are built a chunk at a time, as they're used.
+static const uint64_t EagerRangeLimit = 1 << 16;
+
+BUILTIN("range")
+{
+    int argCount = CHECK_ARGS_BETWEEN(0, 3);
+    int64_t start = 0, end, step = 1;
+    if (argCount == 0) {
+        return mal::lazySeq(new RangeSource(0, 1, RangeSource::Endless));
+    }
+    if (argCount == 1) {
+        ARG(malInteger, endArg);
+        end = endArg->value();
+    }
+    else {
+        ARG(malInteger, startArg);
+        ARG(malInteger, endArg);
+        start = startArg->value();
+        end = endArg->value();
+        if (argCount == 3) {
+            ARG(malInteger, stepArg);
+            step = stepArg->value();
+            MAL_CHECK(step != 0, "range step must not be zero");
+        }
+    }
+
+    if ((step > 0) ? (start >= end) : (start <= end)) {
+        return mal::list(new malValueVec);
+    }
+    // The distance and step as magnitudes, which always fit unsigned.
+    uint64_t distance = (step > 0) ? uint64_t(end) - uint64_t(start)
+                                   : uint64_t(start) - uint64_t(end);
+    uint64_t stride = (step > 0) ? uint64_t(step) : 0 - uint64_t(step);
+    uint64_t count = distance / stride + ((distance % stride) ? 1 : 0);
+    if (count > EagerRangeLimit) {
+        return mal::lazySeq(new RangeSource(start, step, count));
+    }
+
+    malValueVec* items = new malValueVec;
+    items->reserve(count);
+    uint64_t value = start;
+    for (uint64_t i = 0; i < count; i++, value += step) {
+        items->push_back(mal::integer(static_cast<int64_t>(value)));
+    }
+    return mal::list(items);
 }
 
-BUILTIN("readline")
+//  What load-file evaluates: the forms in a file, as (do forms... nil).
+TYPED_BUILTIN("read-file", malString* path)
 {
-    CHECK_ARGS_IS(1);
-    ARG(malString, str);
+    return FormCache::read(path->value());
+}
 
+TYPED_BUILTIN("read-string", malString* str)
+{
+    return readStr(str->value());
+}
+
+TYPED_BUILTIN("readline", malString* str)
+{
     return readline(str->value());
 }
 
-BUILTIN("reset!")
+BUILTIN("reduce")
+{
+    int argCount = CHECK_ARGS_BETWEEN(2, 3);
+    malValuePtr f = *argsBegin++; // this gets checked in APPLY
+    if (argCount == 3) {
+        malValuePtr init = *argsBegin++;
+        return reduceWith(malTransducer::Stages(), f, init, *argsBegin);
+    }
+
+    // Without an initial value, the first element is used instead.
+    malValuePtr init;
+    malValuePtr rest;
+    {
+        malLazySeq::Cursor it(*argsBegin);
+        if (!it.next(init)) {
+            malValueVec none;
+            return APPLY(f, none.begin(), none.end());
+        }
+        rest = it.rest();
+    }
+    *argsBegin = malValuePtr();
+    return reduceWith(malTransducer::Stages(), f, init, rest);
+}
+
+BUILTIN("remove")
 {
-    CHECK_ARGS_IS(2);
-    ARG(malAtom, atom);
-    return atom->reset(*argsBegin);
+    return stageOrRun(name, malTransducer::Remove, argsBegin, argsEnd);
+}
+
+BUILTIN("repeat")
+{
+    int argCount = CHECK_ARGS_BETWEEN(1, 2);
+    int64_t count = -1;
+    if (argCount == 2) {
+        ARG(malInteger, countArg);
+        count = std::max<int64_t>(countArg->value(), 0);
+    }
+    return mal::lazySeq(new RepeatSource(*argsBegin, count));
 }
 
-BUILTIN("rest")
+TYPED_BUILTIN("reset!", malAtom* atom, malValuePtr value)
 {
-    CHECK_ARGS_IS(1);
-    if (*argsBegin == mal::nilValue()) {
+    return atom->reset(value);
+}
+
+TYPED_BUILTIN("rest", malValuePtr arg)
+{
+    if (arg == mal::nilValue()) {
         return mal::list(new malValueVec(0));
     }
-    ARG(malSequence, seq);
+    if (const malLazySeq* lazy = DYNAMIC_CAST(malLazySeq, arg)) {
+        return lazy->rest();
+    }
+    malSequence* seq = VALUE_CAST(malSequence, arg);
     return seq->rest();
 }
 
-BUILTIN("seq")
+//  Counts since the last runtime-stats-reset!, except for the live ones,
+//  which are since the process started.
+TYPED_BUILTIN("runtime-stats")
+{
+    Stats::Totals totals, all;
+    Stats::read(totals);
+    Stats::readAll(all);
+    const uint64_t* counters = totals.counters;
+
+    malValueVec classes;
+    int envClass = -1;
+    for (int i = 0, count = Stats::classCount(); i < count; i++) {
+        malValueVec counts;
+        counts.push_back(mal::keyword(":allocated"));
+        counts.push_back(mal::integer(totals.allocated[i]));
+        counts.push_back(mal::keyword(":freed"));
+        counts.push_back(mal::integer(totals.freed[i]));
+        counts.push_back(mal::keyword(":live"));
+        counts.push_back(mal::integer(all.allocated[i] - all.freed[i]));
+        classes.push_back(mal::string(Stats::className(i)));
+        classes.push_back(mal::hash(counts.begin(), counts.end(), true));
+        if (strcmp(Stats::className(i), "malEnv") == 0) {
+            envClass = i;
+        }
+    }
+
+    const struct { const char* name; int64_t value; } stats[] = {
+        { ":eval-calls",        (int64_t)counters[Stats::EvalCalls] },
+        { ":eval-iterations",   (int64_t)counters[Stats::EvalIterations] },
+        { ":tail-calls",        (int64_t)(counters[Stats::EvalIterations] -
+                                          counters[Stats::EvalCalls]) },
+        { ":macroexpand-calls", (int64_t)counters[Stats::MacroExpandCalls] },
+        { ":macro-expansions",  (int64_t)counters[Stats::MacroExpansions] },
+        { ":builtin-calls",     (int64_t)counters[Stats::BuiltinCalls] },
+        { ":lambda-calls",      (int64_t)counters[Stats::LambdaCalls] },
+        { ":exceptions",        (int64_t)counters[Stats::Exceptions] },
+        { ":envs-created",      (int64_t)(envClass < 0 ? 0
+                                          : totals.allocated[envClass]) },
+        { ":allocated-bytes",   (int64_t)totals.allocatedBytes },
+        { ":live-bytes",        (int64_t)(all.allocatedBytes -
+                                          all.freedBytes) },
+    };
+    malValueVec items;
+    for (auto& stat : stats) {
+        items.push_back(mal::keyword(stat.name));
+        items.push_back(mal::integer(stat.value));
+    }
+    items.push_back(mal::keyword(":classes"));
+    items.push_back(mal::hash(classes.begin(), classes.end(), true));
+    return mal::hash(items.begin(), items.end(), true);
+}
+
+TYPED_BUILTIN("runtime-stats-reset!")
+{
+    Stats::reset();
+    return mal::nilValue();
+}
+
+//  Saves the current interpreter's root environment, for --image.
+TYPED_BUILTIN("save-image", malString* path)
+{
+    malInterpreter* interp = malInterpreter::current();
+    MAL_CHECK(interp != NULL, "no interpreter to save");
+    Image::save(path->value(), interp->env());
+    return mal::nilValue();
+}
+
+TYPED_BUILTIN("seq", malValuePtr arg)
 {
-    CHECK_ARGS_IS(1);
-    malValuePtr arg = *argsBegin++;
     if (arg == mal::nilValue()) {
         return mal::nilValue();
     }
@@ -426,6 +1230,9 @@ BUILTIN("seq")
         return seq->isEmpty() ? mal::nilValue()
                               : mal::list(seq->begin(), seq->end());
     }
+    if (const malLazySeq* lazy = DYNAMIC_CAST(malLazySeq, arg)) {
+        return lazy->isEmpty() ? mal::nilValue() : arg;
+    }
     if (const malString* strVal = DYNAMIC_CAST(malString, arg)) {
         const String str = strVal->value();
         int length = str.length();
@@ -442,62 +1249,106 @@ BUILTIN("seq")
 }
 
 
-BUILTIN("slurp")
+TYPED_BUILTIN("sequential?", malValuePtr arg)
 {
-    CHECK_ARGS_IS(1);
-    ARG(malString, filename);
-
-    std::ios_base::openmode openmode =
-        std::ios::ate | std::ios::in | std::ios::binary;
-    std::ifstream file(filename->value().c_str(), openmode);
-    MAL_CHECK(!file.fail(), "Cannot open %s", filename->value().c_str());
-
-    String data;
-    data.reserve(file.tellg());
-    file.seekg(0, std::ios::beg);
-    data.append(std::istreambuf_iterator<char>(file.rdbuf()),
-                std::istreambuf_iterator<char>());
-
-    return mal::string(data);
+    return mal::boolean(DYNAMIC_CAST(malSequence, arg) ||
+                        DYNAMIC_CAST(malLazySeq, arg));
 }
 
-BUILTIN("str")
+TYPED_BUILTIN("slurp", malString* filename)
 {
-    return mal::string(printValues(argsBegin, argsEnd, "", false));
+    return mal::string(readFile(filename->value()));
 }
 
-BUILTIN("swap!")
+//  (spit path content), optionally followed by :append true. content is a
+//  string, or a sequence or lazy seq whose elements are written one after
+//  another as str would print them, without ever holding all of them.
+BUILTIN("spit")
 {
-    CHECK_ARGS_AT_LEAST(2);
-    ARG(malAtom, atom);
+    int argCount = CHECK_ARGS_AT_LEAST(2);
+    ARG(malString, path);
+    malValueIter content = argsBegin++;
+    MAL_CHECK(argCount % 2 == 0, "spit options must come in pairs");
+    bool append = false;
+    for (; argsBegin != argsEnd; argsBegin += 2) {
+        const malKeyword* option = VALUE_CAST(malKeyword, *argsBegin);
+        MAL_CHECK(option->value() == ":append", "Unknown spit option %s",
+                  option->value().c_str());
+        append = (*(argsBegin + 1))->isTrue();
+    }
 
-    malValuePtr op = *argsBegin++; // this gets checked in APPLY
+    FileWriter file(path->value(), append);
+    if (const malString* str = DYNAMIC_CAST(malString, *content)) {
+        file.write(str->value());
+    }
+    else if (*content != mal::nilValue()) {
+        forEachItem(*content, [&](malValuePtr item) -> bool {
+            if (const malString* str = DYNAMIC_CAST(malString, item)) {
+                file.write(str->value());
+            }
+            else {
+                file.write(item->print(false));
+            }
+            return true;
+        });
+    }
+    file.close();
+    return mal::nilValue();
+}
 
-    malValueVec args(1 + argsEnd - argsBegin);
-    args[0] = atom->deref();
-    std::copy(argsBegin, argsEnd, args.begin() + 1);
+TYPED_BUILTIN("str", malArgs args)
+{
+    Sink out;
+    printValues(out, args.begin, args.end, "", false);
+    return mal::string(out.str());
+}
 
-    malValuePtr value = APPLY(op, args.begin(), args.end());
-    return atom->reset(value);
+TYPED_BUILTIN("swap!", malAtom* atom, malValuePtr op, malArgs rest)
+{
+    // op gets checked in APPLY, which may let go of the arguments, so each
+    // try gets its own.
+    malValueVec args(1 + rest.count());
+
+    // If another thread got in first, try again with its value.
+    for (;;) {
+        malValuePtr current = atom->deref();
+        args[0] = current;
+        std::copy(rest.begin, rest.end, args.begin() + 1);
+        malValuePtr value = APPLY(op, args.begin(), args.end());
+        if (atom->compareAndSet(current, value)) {
+            return value;
+        }
+    }
 }
 
-BUILTIN("symbol")
+TYPED_BUILTIN("symbol", malString* token)
 {
-    CHECK_ARGS_IS(1);
-    ARG(malString, token);
     return mal::symbol(token->value());
 }
 
-BUILTIN("throw")
+BUILTIN("take")
 {
-    CHECK_ARGS_IS(1);
-    throw *argsBegin;
+    return stageOrRun(name, malTransducer::Take, argsBegin, argsEnd);
 }
 
-BUILTIN("time-ms")
+TYPED_BUILTIN("take!", malChannel* handle)
 {
-    CHECK_ARGS_IS(0);
+    std::vector<ChannelOp> ops(1);
+    ops[0].channel = channelArg(handle);
+    ops[0].isPut = false;
+    malValuePtr value;
+    alts(ops, value);
+    return value;
+}
 
+TYPED_BUILTIN("throw", malValuePtr value)
+{
+    Stats::count(Stats::Exceptions);
+    throw value;
+}
+
+TYPED_BUILTIN("time-ms")
+{
     using namespace std::chrono;
     milliseconds ms = duration_cast<milliseconds>(
         high_resolution_clock::now().time_since_epoch()
@@ -506,54 +1357,91 @@ BUILTIN("time-ms")
     return mal::integer(ms.count());
 }
 
-BUILTIN("vals")
+//  Only for measuring intervals: the clock's epoch is unspecified.
+TYPED_BUILTIN("time-ns")
+{
+    using namespace std::chrono;
+    nanoseconds ns = duration_cast<nanoseconds>(
+        steady_clock::now().time_since_epoch()
+    );
+
+    return mal::integer(ns.count());
+}
+
+TYPED_BUILTIN("trace-start")
+{
+    Tracer::start();
+    return mal::nilValue();
+}
+
+TYPED_BUILTIN("trace-stop", malString* path)
+{
+    return mal::integer(Tracer::stop(path->value()));
+}
+
+BUILTIN("transduce")
+{
+    // Untyped, so that the collection can be walked from its argument
+    // rather than from a copy which would hold on to its head.
+    CHECK_ARGS_IS(4);
+    ARG(malTransducer, xf);
+    malValuePtr f = *argsBegin++; // this gets checked in APPLY
+    malValuePtr init = *argsBegin++;
+    return reduceWith(xf->stages(), f, init, *argsBegin);
+}
+
+TYPED_BUILTIN("vals", malHash* hash)
 {
-    CHECK_ARGS_IS(1);
-    ARG(malHash, hash);
     return hash->values();
 }
 
-BUILTIN("vec")
+TYPED_BUILTIN("vec", malSequence* s)
 {
-    CHECK_ARGS_IS(1);
-    ARG(malSequence, s);
     return mal::vector(s->begin(), s->end());
 }
 
-BUILTIN("vector")
+TYPED_BUILTIN("vector", malArgs args)
 {
-    return mal::vector(argsBegin, argsEnd);
+    return mal::vector(args.begin, args.end);
 }
 
-BUILTIN("with-meta")
+TYPED_BUILTIN("with-meta", malValuePtr obj, malValuePtr meta)
 {
-    CHECK_ARGS_IS(2);
-    malValuePtr obj  = *argsBegin++;
-    malValuePtr meta = *argsBegin++;
     return obj->withMeta(meta);
 }
 
 void installCore(malEnvPtr env) {
+    StaticList<malBuiltIn*>& handlers = builtinHandlers();
     for (auto it = handlers.begin(), end = handlers.end(); it != end; ++it) {
         malBuiltIn* handler = *it;
         env->set(handler->name(), handler);
     }
 }
 
-static String printValues(malValueIter begin, malValueIter end,
-                          const String& sep, bool readably)
+static void printValues(Sink& out, malValueIter begin, malValueIter end,
+                        const char* sep, bool readably)
 {
-    String out;
-
     if (begin != end) {
-        out += (*begin)->print(readably);
+        (*begin)->print(out, readably);
         ++begin;
     }
 
     for ( ; begin != end; ++begin) {
-        out += sep;
-        out += (*begin)->print(readably);
+        out << sep;
+        (*begin)->print(out, readably);
     }
+}
 
-    return out;
+//  Prints to the current interpreter's output, or to stdout for the steps
+//  which don't have one.
+static void printLine(const malArgs& args, bool readably)
+{
+    malInterpreter* interp = malInterpreter::current();
+    FILE* file = interp ? interp->output() : stdout;
+    Sink out(file);
+    printValues(out, args.begin, args.end, " ", readably);
+    out << '\n';
+    if (!file) {
+        interp->capture(out.str());
+    }
 }
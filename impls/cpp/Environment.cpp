@@ -1,10 +1,16 @@
 #include "Environment.h"
+#include "EvalStack.h"
+#include "HeapProfiler.h"
 #include "Types.h"
 
 #include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <thread>
 
 malEnv::malEnv(malEnvPtr outer)
 : m_outer(outer)
+, m_isShared(false)
 {
     TRACE_ENV("Creating malEnv %p, outer=%p\n", this, m_outer.ptr());
 }
@@ -12,8 +18,15 @@ malEnv::malEnv(malEnvPtr outer)
 malEnv::malEnv(malEnvPtr outer, const StringVec& bindings,
                malValueIter argsBegin, malValueIter argsEnd)
 : m_outer(outer)
+, m_isShared(false)
 {
     TRACE_ENV("Creating malEnv %p, outer=%p\n", this, m_outer.ptr());
+    bind(bindings, argsBegin, argsEnd);
+}
+
+void malEnv::bind(const StringVec& bindings,
+                  malValueIter argsBegin, malValueIter argsEnd)
+{
     int n = bindings.size();
     auto it = argsBegin;
     for (int i = 0; i < n; i++) {
@@ -35,33 +48,272 @@ malEnv::~malEnv()
     TRACE_ENV("Destroying malEnv %p, outer=%p\n", this, m_outer.ptr());
 }
 
+void malEnv::rebind(malEnvPtr outer, const StringVec& bindings,
+                    malValueIter argsBegin, malValueIter argsEnd)
+{
+    TRACE_ENV("Reusing malEnv %p, outer=%p\n", this, outer.ptr());
+    m_outer = outer;
+
+    // A self tail call binds the same names again, so the existing map
+    // nodes are simply overwritten. Otherwise start from an empty frame.
+    size_t count = m_map.size();
+    if (count != bindings.size()) {
+        m_map.clear();
+    }
+    bind(bindings, argsBegin, argsEnd);
+    if (m_map.size() != count) {
+        m_map.clear();
+        bind(bindings, argsBegin, argsEnd);
+    }
+}
+
+namespace {
+    // Freed frames are threaded through their own storage.
+    struct FreeFrame {
+        FreeFrame* next;
+    };
+
+    const int maxFreeFrames = 4096;
+
+    thread_local FreeFrame* s_freeFrames = NULL;
+    thread_local int s_freeFrameCount = 0;
+    thread_local bool s_hasExited = false;
+
+    //  Frees the thread's free list when the thread exits. Frames freed
+    //  after that, by other thread_local destructors, go straight back.
+    struct FreeFramesOwner {
+        ~FreeFramesOwner() {
+            while (FreeFrame* frame = s_freeFrames) {
+                s_freeFrames = frame->next;
+                ::operator delete(frame);
+            }
+            s_freeFrameCount = 0;
+            s_hasExited = true;
+        }
+    };
+}
+
+static int envStatsClass()
+{
+    static const int index = Stats::registerClass("malEnv");
+    return index;
+}
+
+void* malEnv::operator new(size_t size)
+{
+    static_assert(sizeof(malEnv) <= HeapProfiler::MaxSampledSize,
+                  "malEnv is too big for the heap profiler");
+    ASSERT(size == sizeof(malEnv), "Unexpected malEnv size %zu\n", size);
+    Stats::allocated(envStatsClass(), sizeof(malEnv));
+    if (void* p = HeapProfiler::allocate(sizeof(malEnv))) {
+        return p;
+    }
+    if (FreeFrame* frame = s_freeFrames) {
+        s_freeFrames = frame->next;
+        s_freeFrameCount--;
+        return frame;
+    }
+    return ::operator new(sizeof(malEnv));
+}
+
+void malEnv::operator delete(void* p)
+{
+    Stats::freed(envStatsClass(), sizeof(malEnv));
+    if (HeapProfiler::owns(p)) {
+        HeapProfiler::release(p);
+        return;
+    }
+    if ((s_freeFrameCount >= maxFreeFrames) || s_hasExited) {
+        ::operator delete(p);
+        return;
+    }
+    if (s_freeFrameCount == 0) {
+        // Only on the way to the list's first frame, as the owner is
+        // checked for on every use.
+        static thread_local FreeFramesOwner owner;
+    }
+    FreeFrame* frame = static_cast<FreeFrame*>(p);
+    frame->next = s_freeFrames;
+    s_freeFrames = frame;
+    s_freeFrameCount++;
+}
+
+namespace {
+    //  Guards the frames which have been shared with the thread pool.
+    //  There is one lock for all of them, as def! in a shared frame is
+    //  rare. Lookups only write to a flag of their own, so they don't
+    //  contend with each other; def! waits until no lookup is in progress.
+    class RootLock {
+    public:
+        RootLock() : m_readers(NULL), m_isWriting(false) { }
+
+        void lockShared() {
+            std::atomic<bool>& active = readerFlag();
+            for (;;) {
+                active.store(true);
+                if (!m_isWriting.load()) {
+                    return;
+                }
+                active.store(false);
+                std::lock_guard<std::mutex> wait(m_writerLock);
+            }
+        }
+
+        void unlockShared() {
+            readerFlag().store(false, std::memory_order_release);
+        }
+
+        void lock() {
+            m_writerLock.lock();
+            m_isWriting.store(true);
+            for (Reader* r = m_readers.load(); r; r = r->next) {
+                while (r->active.load()) {
+                    std::this_thread::yield();
+                }
+            }
+        }
+
+        void unlock() {
+            m_isWriting.store(false);
+            m_writerLock.unlock();
+        }
+
+    private:
+        // Padded so that each thread's flag has a cache line to itself.
+        struct Reader {
+            std::atomic<bool> active;
+            Reader*           next;
+            char              padding[64];
+        };
+
+        std::atomic<bool>& readerFlag() {
+            static thread_local Reader* reader = NULL;
+            if (!reader) {
+                // Readers are never freed, and are only ever prepended.
+                reader = new Reader;
+                reader->active.store(false);
+                reader->next = m_readers.load();
+                while (!m_readers.compare_exchange_weak(reader->next, reader)) {
+                }
+            }
+            return reader->active;
+        }
+
+        std::atomic<Reader*> m_readers;
+        std::atomic<bool>    m_isWriting;
+        std::mutex           m_writerLock;
+    };
+
+    RootLock s_rootLock;
+}
+
+bool malEnv::lookup(const String& symbol, malValuePtr* value) const
+{
+    bool shared = m_isShared;
+    if (shared) {
+        s_rootLock.lockShared();
+    }
+    auto it = m_map.find(symbol);
+    bool found = it != m_map.end();
+    if (found && value) {
+        *value = it->second;
+    }
+    if (shared) {
+        s_rootLock.unlockShared();
+    }
+    return found;
+}
+
+malEnv::Map malEnv::bindings() const
+{
+    bool shared = m_isShared;
+    if (shared) {
+        s_rootLock.lockShared();
+    }
+    Map map = m_map;
+    if (shared) {
+        s_rootLock.unlockShared();
+    }
+    return map;
+}
+
+//  The frames are walked without counting references to them, as this
+//  frame holds on to all of its outer ones.
 malEnvPtr malEnv::find(const String& symbol)
 {
-    for (malEnvPtr env = this; env; env = env->m_outer) {
-        if (env->m_map.find(symbol) != env->m_map.end()) {
+    for (malEnv* env = this; env; env = env->m_outer.ptr()) {
+        if (env->lookup(symbol, NULL)) {
             return env;
         }
     }
     return NULL;
 }
 
-malValuePtr malEnv::get(const String& symbol)
+malValuePtr malEnv::findValue(const String& symbol) const
 {
-    for (malEnvPtr env = this; env; env = env->m_outer) {
-        auto it = env->m_map.find(symbol);
-        if (it != env->m_map.end()) {
-            return it->second;
+    malValuePtr value;
+    for (const malEnv* env = this; env; env = env->m_outer.ptr()) {
+        if (env->lookup(symbol, &value)) {
+            break;
         }
     }
-    MAL_FAIL("'%s' not found", symbol.c_str());
+    return value;
+}
+
+malValuePtr malEnv::get(const String& symbol)
+{
+    malValuePtr value = findValue(symbol);
+    if (!value) {
+        MAL_FAIL("'%s' not found", symbol.c_str());
+    }
+    return value;
 }
 
 malValuePtr malEnv::set(const String& symbol, malValuePtr value)
 {
+    if (m_isShared) {
+        // Shared definitions are visible to every thread, but are counted
+        // like anything else, so that redefining one frees the old value.
+        // That happens once the lock has been dropped, since freeing it
+        // may free a good deal more.
+        malValuePtr old = value;
+        {
+            std::lock_guard<RootLock> guard(s_rootLock);
+            std::swap(m_map[symbol], old);
+        }
+        return value;
+    }
     m_map[symbol] = value;
     return value;
 }
 
+void malEnv::makeImmortal() const
+{
+    if (isImmortal()) {
+        return;
+    }
+    EvalStack::check();
+    markImmortal();
+    for (auto it = m_map.begin(), end = m_map.end(); it != end; ++it) {
+        it->second->makeImmortal();
+    }
+    if (m_outer) {
+        m_outer->makeImmortal();
+    }
+}
+
+void malEnv::share()
+{
+    if (m_isShared) {
+        return;
+    }
+    makeImmortal();
+    for (malEnv* env = this; env && !env->m_isShared;
+         env = env->m_outer.ptr()) {
+        env->m_isShared = true;
+    }
+}
+
 malEnvPtr malEnv::getRoot()
 {
     // Work our way down the the global environment.
@@ -7,6 +7,8 @@
 
 class malEnv : public RefCounted {
 public:
+    typedef std::map<String, malValuePtr> Map;
+
     malEnv(malEnvPtr outer = NULL);
     malEnv(malEnvPtr outer,
            const StringVec& bindings,
@@ -17,13 +19,42 @@ public:
 
     malValuePtr get(const String& symbol);
     malEnvPtr   find(const String& symbol);
+    // The value bound to symbol here or in an outer frame, or NULL.
+    malValuePtr findValue(const String& symbol) const;
     malValuePtr set(const String& symbol, malValuePtr value);
     malEnvPtr   getRoot();
+    malEnvPtr   getOuter() const { return m_outer; }
+
+    // A copy of the frame's own bindings.
+    Map bindings() const;
+
+    // Stops counting references to the frame and everything bound in it.
+    void makeImmortal() const;
+
+    // Lets the thread pool's workers see the frame and its outer frames.
+    // From then on their bindings are guarded by a lock, and what they
+    // held when they were shared is immortal.
+    void share();
+
+    void rebind(malEnvPtr outer,
+                const StringVec& bindings,
+                malValueIter argsBegin,
+                malValueIter argsEnd);
+
+    // Frames are recycled through a per-thread free list.
+    static void* operator new(size_t size);
+    static void operator delete(void* p);
 
 private:
-    typedef std::map<String, malValuePtr> Map;
+    bool lookup(const String& symbol, malValuePtr* value) const;
+
+    void bind(const StringVec& bindings,
+              malValueIter argsBegin,
+              malValueIter argsEnd);
+
     Map m_map;
     malEnvPtr m_outer;
+    bool m_isShared;
 };
 
 #endif // INCLUDE_ENVIRONMENT_H
@@ -0,0 +1,142 @@
+#include "EvalStack.h"
+#include "MAL.h"
+
+#include <exception>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+// Room left for unwinding, and for the builtins called at the deepest
+// point, once the check has failed.
+static const size_t MaxReserve = 256 * 1024;
+
+// Each thread starts at the top of the address space, so that its first
+// check always fails over to overflow(), which finds the real limit.
+static const uintptr_t UnknownLimit = UINTPTR_MAX;
+
+__thread uintptr_t EvalStack::s_limit = UnknownLimit;
+__thread bool EvalStack::s_isInterrupted = false;
+
+static size_t evalStackSize()
+{
+    size_t mb = 64;
+    if (const char* env = getenv("MAL_STACK_MB")) {
+        int size = atoi(env);
+        if (size > 0) {
+            mb = size;
+        }
+    }
+    return mb * 1024 * 1024;
+}
+
+uintptr_t EvalStack::setLimit(const char* base, size_t size)
+{
+    uintptr_t previous = s_limit;
+    size_t reserve = (size / 4 < MaxReserve) ? size / 4 : MaxReserve;
+    restoreLimit(reinterpret_cast<uintptr_t>(base) + reserve);
+    return previous;
+}
+
+void EvalStack::restoreLimit(uintptr_t limit)
+{
+    // interrupt() sets the flag and then the limit, so one of us sees
+    // what the other did, and an interrupt is never overwritten.
+    __atomic_store_n(&s_limit, limit, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&s_isInterrupted, __ATOMIC_SEQ_CST)) {
+        __atomic_store_n(&s_limit, UnknownLimit, __ATOMIC_SEQ_CST);
+    }
+}
+
+void EvalStack::Thread::interrupt() const
+{
+    __atomic_store_n(m_isInterrupted, true, __ATOMIC_SEQ_CST);
+    __atomic_store_n(m_limit, UnknownLimit, __ATOMIC_SEQ_CST);
+}
+
+void EvalStack::overflow()
+{
+    MAL_CHECK(!__atomic_load_n(&s_isInterrupted, __ATOMIC_SEQ_CST),
+              "Interrupted");
+    if (s_limit == UnknownLimit) {
+        // The first check on a thread we didn't make the stack for.
+        pthread_attr_t attr;
+        void* base;
+        size_t size;
+        if ((pthread_getattr_np(pthread_self(), &attr) == 0) &&
+            (pthread_attr_getstack(&attr, &base, &size) == 0)) {
+            setLimit(static_cast<const char*>(base), size);
+            pthread_attr_destroy(&attr);
+        }
+        else {
+            restoreLimit(0);
+        }
+        char here;
+        if (reinterpret_cast<uintptr_t>(&here) >=
+            __atomic_load_n(&s_limit, __ATOMIC_RELAXED)) {
+            return;
+        }
+    }
+    MAL_FAIL("Stack overflow");
+}
+
+namespace {
+    struct StackCall {
+        const std::function<void()>* f;
+        std::exception_ptr           error;
+        ucontext_t                   caller;
+    };
+}
+
+static thread_local StackCall* s_call = NULL;
+
+static void stackMain()
+{
+    // Nothing may be thrown past here, as there's no frame to unwind to.
+    StackCall* call = s_call;
+    try {
+        (*call->f)();
+    }
+    catch (...) {
+        call->error = std::current_exception();
+    }
+}
+
+void EvalStack::run(const std::function<void()>& f)
+{
+    const size_t size = evalStackSize();
+    const size_t guard = sysconf(_SC_PAGESIZE);
+    void* mapping = mmap(NULL, size + guard, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE |
+                         MAP_STACK, -1, 0);
+    if (mapping == MAP_FAILED) {
+        // Make do with the stack we've got.
+        f();
+        return;
+    }
+    mprotect(mapping, guard, PROT_NONE);
+    char* base = static_cast<char*>(mapping) + guard;
+
+    StackCall call;
+    call.f = &f;
+    ucontext_t context;
+    getcontext(&context);
+    context.uc_stack.ss_sp = base;
+    context.uc_stack.ss_size = size;
+    context.uc_link = &call.caller;
+    makecontext(&context, &stackMain, 0);
+
+    StackCall* savedCall = s_call;
+    s_call = &call;
+    uintptr_t savedLimit = setLimit(base, size);
+    swapcontext(&call.caller, &context);
+    restoreLimit(savedLimit);
+    s_call = savedCall;
+
+    munmap(mapping, size + guard);
+    if (call.error) {
+        std::rethrow_exception(call.error);
+    }
+}
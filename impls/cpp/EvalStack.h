@@ -0,0 +1,67 @@
+#ifndef INCLUDE_EVALSTACK_H
+#define INCLUDE_EVALSTACK_H
+
+#include <functional>
+#include <stddef.h>
+#include <stdint.h>
+
+//  Non-tail recursion in mal is recursion in EVAL, on the C++ stack. EVAL
+//  checks how much of the stack is left each time it is called, and throws
+//  "Stack overflow" while there is still room to unwind, rather than
+//  running into the guard page.
+//
+//  The REPL evaluates everything on a stack of its own. It is reserved
+//  with mmap, and only the pages the recursion reaches are ever committed,
+//  so its size is a cap on memory rather than a cost up front. The cap is
+//  read from MAL_STACK_MB, and defaults to 64MB, which is room for
+//  around 170,000 nested calls.
+//
+//  The same check lets one thread interrupt another: the limit is moved
+//  past the top of the stack, so the next check fails however deep the
+//  evaluation is.
+class EvalStack {
+public:
+    static void check() {
+        char here;
+        if (reinterpret_cast<uintptr_t>(&here) <
+            __atomic_load_n(&s_limit, __ATOMIC_RELAXED)) {
+            overflow();
+        }
+    }
+
+    //  A thread which another one can interrupt. From then on every check
+    //  on it fails with "Interrupted", so whatever it is evaluating
+    //  unwinds, even through catch*. It must only be used while the
+    //  thread is running.
+    class Thread {
+    public:
+        static Thread current() {
+            return Thread(&s_limit, &s_isInterrupted);
+        }
+
+        void interrupt() const;
+
+    private:
+        Thread(uintptr_t* limit, bool* isInterrupted)
+            : m_limit(limit), m_isInterrupted(isInterrupted) { }
+
+        uintptr_t* m_limit;
+        bool*      m_isInterrupted;
+    };
+
+    //  Makes [base, base + size) the current stack, returning the previous
+    //  limit for restoreLimit().
+    static uintptr_t setLimit(const char* base, size_t size);
+    static void restoreLimit(uintptr_t limit);
+
+    //  Calls f on a new stack, rethrowing anything it throws.
+    static void run(const std::function<void()>& f);
+
+private:
+    static void overflow();
+
+    static __thread uintptr_t s_limit;
+    static __thread bool      s_isInterrupted;
+};
+
+#endif // INCLUDE_EVALSTACK_H
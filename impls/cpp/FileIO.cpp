@@ -0,0 +1,191 @@
+#include "FileIO.h"
+#include "MAL.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+static const size_t bufferSize = 65536;
+
+// How much of a mapped file slurp copies at a time. A multiple of the
+// page size.
+static const size_t sliceSize = 8 << 20;
+
+static int openForReading(const String& path)
+{
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    MAL_CHECK(fd >= 0, "Cannot open %s", path.c_str());
+    return fd;
+}
+
+//  Appends up to size bytes from fd to data, returning how many there
+//  were, and 0 at the end of the file.
+static size_t readSome(int fd, const String& path, String& data,
+                       size_t size)
+{
+    size_t start = data.size();
+    data.resize(start + size);
+    ssize_t n;
+    while (((n = read(fd, &data[start], size)) < 0) && (errno == EINTR)) {
+    }
+    int error = errno;
+    data.resize(start + std::max<ssize_t>(n, 0));
+    MAL_CHECK(n >= 0, "Cannot read %s: %s", path.c_str(), strerror(error));
+    return n;
+}
+
+String readFile(const String& path)
+{
+    int fd = openForReading(path);
+    String data;
+    struct stat st;
+    if ((fstat(fd, &st) == 0) && S_ISREG(st.st_mode) && (st.st_size > 0)) {
+        void* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            // The pages copied so far are dropped as the copy goes, so
+            // that a big file isn't resident twice over.
+            const char* begin = static_cast<const char*>(map);
+            size_t size = st.st_size;
+            madvise(map, size, MADV_SEQUENTIAL);
+            data.reserve(size);
+            for (size_t done = 0; done < size; done += sliceSize) {
+                size_t count = std::min(sliceSize, size - done);
+                data.append(begin + done, count);
+                madvise(const_cast<char*>(begin) + done, count, MADV_DONTNEED);
+            }
+            munmap(map, size);
+            close(fd);
+            return data;
+        }
+    }
+
+    // Files under /proc can't tell us their size up front.
+    try {
+        while (readSome(fd, path, data, bufferSize) > 0) {
+        }
+    }
+    catch (...) {
+        close(fd);
+        throw;
+    }
+    close(fd);
+    return data;
+}
+
+LineReader::LineReader(const String& path)
+: m_fd(openForReading(path))
+, m_path(path)
+, m_pos(0)
+{
+    posix_fadvise(m_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+}
+
+LineReader::~LineReader()
+{
+    if (m_fd >= 0) {
+        close(m_fd);
+    }
+}
+
+bool LineReader::next(String& line)
+{
+    size_t end;
+    while ((end = m_buffer.find('\n', m_pos)) == String::npos) {
+        if (!fill()) {
+            if (m_pos == m_buffer.size()) {
+                return false;
+            }
+            end = m_buffer.size();
+            break;
+        }
+    }
+    size_t next = std::min(end + 1, m_buffer.size());
+    if ((end > m_pos) && (m_buffer[end - 1] == '\r')) {
+        end--;
+    }
+    line.assign(m_buffer, m_pos, end - m_pos);
+    m_pos = next;
+    return true;
+}
+
+//  Reads more of the file into the buffer, dropping the lines which have
+//  already been returned. Returns false at the end of the file, which is
+//  closed then rather than when the last node of the line-seq goes.
+bool LineReader::fill()
+{
+    if (m_fd < 0) {
+        return false;
+    }
+    m_buffer.erase(0, m_pos);
+    m_pos = 0;
+    if (readSome(m_fd, m_path, m_buffer, bufferSize) > 0) {
+        return true;
+    }
+    close(m_fd);
+    m_fd = -1;
+    return false;
+}
+
+FileWriter::FileWriter(const String& path, bool append)
+: m_fd(open(path.c_str(),
+            O_WRONLY | O_CREAT | O_CLOEXEC | (append ? O_APPEND : O_TRUNC),
+            0666))
+, m_path(path)
+{
+    MAL_CHECK(m_fd >= 0, "Cannot open %s: %s", path.c_str(), strerror(errno));
+    m_buffer.reserve(bufferSize);
+}
+
+FileWriter::~FileWriter()
+{
+    if (m_fd >= 0) {
+        ::close(m_fd);
+    }
+}
+
+void FileWriter::write(const char* data, size_t size)
+{
+    if (m_buffer.size() + size > bufferSize) {
+        flush();
+    }
+    if (size >= bufferSize) {
+        // Too big to be worth copying into the buffer first.
+        writeAll(data, size);
+        return;
+    }
+    m_buffer.append(data, size);
+}
+
+void FileWriter::flush()
+{
+    writeAll(m_buffer.data(), m_buffer.size());
+    m_buffer.clear();
+}
+
+void FileWriter::writeAll(const char* data, size_t size)
+{
+    size_t written = 0;
+    while (written < size) {
+        ssize_t n = ::write(m_fd, data + written, size - written);
+        if ((n < 0) && (errno == EINTR)) {
+            continue;
+        }
+        MAL_CHECK(n > 0, "Cannot write %s: %s", m_path.c_str(),
+                  strerror(errno));
+        written += n;
+    }
+}
+
+void FileWriter::close()
+{
+    flush();
+    int fd = m_fd;
+    m_fd = -1;
+    MAL_CHECK(::close(fd) == 0, "Cannot write %s: %s", m_path.c_str(),
+              strerror(errno));
+}
@@ -0,0 +1,66 @@
+#ifndef INCLUDE_FILEIO_H
+#define INCLUDE_FILEIO_H
+
+#include "RefCountedPtr.h"
+#include "String.h"
+
+#include <stddef.h>
+
+//  Reading and writing files for slurp, line-seq and spit. Files are read
+//  and written a buffer at a time, so that line-seq and spit only ever
+//  hold a buffer's worth of the file, however big it is.
+
+//  The whole of the file at path. A regular file is mapped and copied
+//  into the string in one go; anything else, such as a pipe or a file
+//  under /proc, is read until it ends.
+extern String readFile(const String& path);
+
+//  Reads a file a line at a time. Shared by the nodes of a line-seq, each
+//  of which reads on from where the last one stopped.
+class LineReader : public RefCounted {
+public:
+    LineReader(const String& path);
+    ~LineReader();
+
+    //  Sets line to the next line, without its "\n" or "\r\n", or returns
+    //  false at the end of the file. A last line without a newline still
+    //  counts.
+    bool next(String& line);
+
+private:
+    bool fill();
+
+    int    m_fd;
+    String m_path;
+    String m_buffer;
+    size_t m_pos;
+};
+
+typedef RefCountedPtr<LineReader> LineReaderPtr;
+
+//  Writes a file through a buffer. Whatever is buffered is written by
+//  close(), which reports any error; the destructor closes the file
+//  without reporting any.
+class FileWriter {
+public:
+    FileWriter(const String& path, bool append);
+    ~FileWriter();
+
+    void write(const char* data, size_t size);
+    void write(const String& data) { write(data.data(), data.size()); }
+
+    void close();
+
+private:
+    FileWriter(const FileWriter&); // no copy ctor
+    FileWriter& operator = (const FileWriter&); // no assignments
+
+    void flush();
+    void writeAll(const char* data, size_t size);
+
+    int    m_fd;
+    String m_path;
+    String m_buffer;
+};
+
+#endif // INCLUDE_FILEIO_H
@@ -0,0 +1,369 @@
+#include "FormCache.h"
+#include "Binary.h"
+#include "EvalStack.h"
+#include "Types.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <memory>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+//  A checksum of the sources of the format and of the reader, which the
+//  Makefile passes in, so that changing either makes every cache file
+//  stale. Anything else building this file gets the time it was built.
+#ifndef MAL_FORM_CACHE_VERSION
+#define MAL_FORM_CACHE_VERSION hashOf(__DATE__ " " __TIME__)
+#endif
+
+static constexpr uint32_t hashOf(const char* s, uint32_t hash = 2166136261u)
+{
+    return *s ? hashOf(s + 1, (hash ^ uint8_t(*s)) * 16777619u) : hash;
+}
+
+namespace {
+    const char Magic[4] = { 'M', 'A', 'L', 'C' };
+    const uint32_t Version = MAL_FORM_CACHE_VERSION;
+
+    //  Deeper forms aren't cached, which keeps a corrupt file from
+    //  recursing the decoder off the end of the stack.
+    const int MaxDepth = 1000;
+
+    enum Tag : uint8_t {
+        NilTag, TrueTag, FalseTag, IntegerTag, StringTag, KeywordTag,
+        SymbolTag, ListTag, VectorTag, HashTag,
+    };
+
+    //  What a cache file is valid for.
+    struct Key {
+        String   path;
+        uint64_t size;
+        int64_t  mtimeSec;
+        int64_t  mtimeNsec;
+    };
+
+    //  Thrown when a form isn't one the reader could have made, or a
+    //  cache file is corrupt.
+    struct Unencodable { };
+    struct Corrupt { };
+
+    class Encoder : public BinaryWriter {
+    public:
+        void putKey(const Key& key) {
+            put(Magic, sizeof(Magic));
+            put32(Version);
+            putString(key.path);
+            put64(key.size);
+            put64(key.mtimeSec);
+            put64(key.mtimeNsec);
+        }
+
+        Encoder() : m_depth(0) { }
+
+        void putForm(malValuePtr form);
+
+    private:
+        void putItems(Tag tag, const malSequence* seq);
+
+        int m_depth;
+    };
+
+    class Decoder : public BinaryReader {
+    public:
+        Decoder(const char* begin, const char* end)
+            : BinaryReader(begin, end), m_depth(0) { }
+
+        bool matchesKey(const Key& key) {
+            return (memcmp(get(sizeof(Magic)), Magic, sizeof(Magic)) == 0)
+                && (get32() == Version)
+                && (getString() == key.path)
+                && (get64() == key.size)
+                && (int64_t(get64()) == key.mtimeSec)
+                && (int64_t(get64()) == key.mtimeNsec);
+        }
+
+        malValuePtr getForm();
+
+    private:
+        malValueVec* getItems(uint32_t count);
+
+        int m_depth;
+    };
+
+    //  Counts how deep the encoder or decoder is, throwing Failure once
+    //  it's too deep.
+    template<typename Failure>
+    class Nesting {
+    public:
+        explicit Nesting(int& depth) : m_depth(depth) {
+            if (++m_depth > MaxDepth) {
+                --m_depth;
+                throw Failure();
+            }
+        }
+        ~Nesting() { --m_depth; }
+
+    private:
+        int& m_depth;
+    };
+}
+
+void Encoder::putForm(malValuePtr form)
+{
+    EvalStack::check();
+    if (form == mal::nilValue()) {
+        put8(NilTag);
+    }
+    else if (form == mal::trueValue()) {
+        put8(TrueTag);
+    }
+    else if (form == mal::falseValue()) {
+        put8(FalseTag);
+    }
+    else if (const malInteger* i = DYNAMIC_CAST(malInteger, form)) {
+        put8(IntegerTag);
+        put64(i->value());
+    }
+    else if (const malString* s = DYNAMIC_CAST(malString, form)) {
+        put8(StringTag);
+        putString(s->value());
+    }
+    else if (const malKeyword* k = DYNAMIC_CAST(malKeyword, form)) {
+        put8(KeywordTag);
+        putString(k->value());
+    }
+    else if (const malSymbol* s = DYNAMIC_CAST(malSymbol, form)) {
+        put8(SymbolTag);
+        putString(s->value());
+    }
+    else if (const malList* l = DYNAMIC_CAST(malList, form)) {
+        putItems(ListTag, l);
+    }
+    else if (const malVector* v = DYNAMIC_CAST(malVector, form)) {
+        putItems(VectorTag, v);
+    }
+    else if (const malHash* h = DYNAMIC_CAST(malHash, form)) {
+        Nesting<Unencodable> nesting(m_depth);
+        malValuePtr keys = h->keys();
+        const malSequence* seq = STATIC_CAST(malSequence, keys);
+        put8(HashTag);
+        put32(seq->count());
+        for (malValueIter it = seq->begin(); it != seq->end(); ++it) {
+            putForm(*it);
+            putForm(h->get(*it));
+        }
+    }
+    else {
+        throw Unencodable();
+    }
+}
+
+void Encoder::putItems(Tag tag, const malSequence* seq)
+{
+    Nesting<Unencodable> nesting(m_depth);
+    put8(tag);
+    put32(seq->count());
+    for (malValueIter it = seq->begin(), end = seq->end(); it != end; ++it) {
+        putForm(*it);
+    }
+}
+
+malValuePtr Decoder::getForm()
+{
+    EvalStack::check();
+    switch (get8()) {
+        case NilTag:     return mal::nilValue();
+        case TrueTag:    return mal::trueValue();
+        case FalseTag:   return mal::falseValue();
+        case IntegerTag: return mal::integer(int64_t(get64()));
+        case StringTag:  return mal::string(getString());
+        case KeywordTag: return mal::keyword(getString());
+        case SymbolTag:  return mal::symbol(getString());
+        case ListTag:    return mal::list(getItems(get32()));
+        case VectorTag:  return mal::vector(getItems(get32()));
+        case HashTag: {
+            uint32_t count = get32();
+            std::unique_ptr<malValueVec> items(getItems(2 * count));
+            return mal::hash(items->begin(), items->end(), false);
+        }
+    }
+    throw Corrupt();
+}
+
+malValueVec* Decoder::getItems(uint32_t count)
+{
+    // Every item takes at least a byte, which keeps a corrupt count from
+    // reserving more than the file could hold.
+    if (count > remaining()) {
+        throw Corrupt();
+    }
+    Nesting<Corrupt> nesting(m_depth);
+    std::unique_ptr<malValueVec> items(new malValueVec);
+    items->reserve(count);
+    for (uint32_t i = 0; i < count; i++) {
+        items->push_back(getForm());
+    }
+    return items.release();
+}
+
+//  The forms in the cache file, or a null pointer if it is missing, stale
+//  or corrupt.
+static malValuePtr readCache(const String& cachePath, const Key& key)
+{
+    int fd = open(cachePath.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return malValuePtr();
+    }
+    struct stat st;
+    void* data = MAP_FAILED;
+    if ((fstat(fd, &st) == 0) && (st.st_size > 0)) {
+        data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (data == MAP_FAILED) {
+        return malValuePtr();
+    }
+
+    malValuePtr forms;
+    const char* begin = static_cast<const char*>(data);
+    Decoder decoder(begin, begin + st.st_size);
+    try {
+        if (decoder.matchesKey(key)) {
+            forms = decoder.getForm();
+            if (!decoder.atEnd()) {
+                forms = malValuePtr();
+            }
+        }
+    }
+    catch (Corrupt&) {
+        forms = malValuePtr();
+    }
+    catch (BinaryReader::Truncated&) {
+        forms = malValuePtr();
+    }
+    munmap(data, st.st_size);
+    return forms;
+}
+
+//  Writes the cache file under another name and renames it into place, so
+//  that readers never see part of one.
+static void writeCache(const String& cachePath, const Key& key,
+                       malValuePtr forms)
+{
+    Encoder encoder;
+    try {
+        encoder.putKey(key);
+        encoder.putForm(forms);
+    }
+    catch (Unencodable&) {
+        return;
+    }
+
+    String tempPath = cachePath + ".XXXXXX";
+    int fd = mkstemp(&tempPath[0]);
+    if (fd < 0) {
+        return;
+    }
+    const String& data = encoder.data();
+    size_t written = 0;
+    while (written < data.size()) {
+        ssize_t n = write(fd, data.data() + written, data.size() - written);
+        if ((n < 0) && (errno == EINTR)) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        written += n;
+    }
+    fchmod(fd, 0644);
+    bool isWritten = (close(fd) == 0) && (written == data.size());
+    if (!isWritten || (rename(tempPath.c_str(), cachePath.c_str()) != 0)) {
+        unlink(tempPath.c_str());
+    }
+}
+
+//  The whole of the file open on fd, which is size bytes long.
+static String readSource(int fd, const String& path, size_t size)
+{
+    String source;
+    source.reserve(size);
+    char buffer[65536];
+    for (;;) {
+        ssize_t n = ::read(fd, buffer, sizeof(buffer));
+        if ((n < 0) && (errno == EINTR)) {
+            continue;
+        }
+        MAL_CHECK(n >= 0, "Cannot read %s", path.c_str());
+        if (n == 0) {
+            return source;
+        }
+        source.append(buffer, n);
+    }
+}
+
+bool FormCache::isEnabled()
+{
+    static const bool isEnabled = []() {
+        const char* env = getenv("MAL_FORM_CACHE");
+        return env && *env && (strcmp(env, "0") != 0);
+    }();
+    return isEnabled;
+}
+
+malValuePtr FormCache::read(const String& path)
+{
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    MAL_CHECK(fd >= 0, "Cannot open %s", path.c_str());
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        MAL_FAIL("Cannot open %s", path.c_str());
+    }
+
+    // Files under /proc and pipes can't be cached.
+    Key key;
+    char resolved[PATH_MAX];
+    bool isCacheable = isEnabled() && S_ISREG(st.st_mode)
+                    && (st.st_size > 0)
+                    && (realpath(path.c_str(), resolved) != NULL);
+    String cachePath;
+    if (isCacheable) {
+        key.path = resolved;
+        key.size = st.st_size;
+        key.mtimeSec = st.st_mtim.tv_sec;
+        key.mtimeNsec = st.st_mtim.tv_nsec;
+        cachePath = key.path;
+        if ((cachePath.size() > 4) &&
+            (cachePath.compare(cachePath.size() - 4, 4, ".mal") == 0)) {
+            cachePath += 'c';
+        }
+        else {
+            cachePath += ".malc";
+        }
+        if (malValuePtr forms = readCache(cachePath, key)) {
+            close(fd);
+            return forms;
+        }
+    }
+
+    String source;
+    try {
+        source = readSource(fd, path, isCacheable ? st.st_size : 0);
+    }
+    catch (...) {
+        close(fd);
+        throw;
+    }
+    close(fd);
+
+    malValuePtr forms = readStr("(do " + source + "\nnil)");
+    if (isCacheable) {
+        writeCache(cachePath, key, forms);
+    }
+    return forms;
+}
@@ -0,0 +1,23 @@
+#ifndef INCLUDE_FORMCACHE_H
+#define INCLUDE_FORMCACHE_H
+
+#include "MAL.h"
+
+//  Reads whole files of forms for load-file. When MAL_FORM_CACHE is set,
+//  the forms read from foo.mal are also written to foo.malc in a compact
+//  binary form, and later reads of foo.mal map that in and rebuild the
+//  forms from it instead of tokenising the source again.
+//
+//  A cache file records the path, size and modification time of its
+//  source and a checksum of the code which wrote it, and is ignored if any
+//  of them doesn't match. Forms nested too deeply aren't cached. Failing
+//  to write a cache file isn't an error.
+class FormCache {
+public:
+    //  The forms in the file at path, as (do forms... nil).
+    static malValuePtr read(const String& path);
+
+    static bool isEnabled();
+};
+
+#endif // INCLUDE_FORMCACHE_H
@@ -0,0 +1,238 @@
+#include "HeapProfiler.h"
+#include "MAL.h"
+#include "Profiler.h"
+
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <vector>
+
+std::atomic<bool> HeapProfiler::s_isActive(false);
+std::atomic<uintptr_t> HeapProfiler::s_base(0);
+std::atomic<uintptr_t> HeapProfiler::s_span(0);
+__thread int64_t HeapProfiler::s_countdown = 0;
+
+namespace {
+    const size_t SlotSize = HeapProfiler::MaxSampledSize;
+    const int SlotCount = 1 << 16;
+    const int SiteDepth = 2;
+
+    typedef std::vector<const char*> Stack;
+
+    struct Site {
+        Site(const Stack& stack)
+        : stack(stack), allocs(0), bytes(0), freedAllocs(0), freedBytes(0) { }
+
+        Stack    stack;
+        uint64_t allocs;
+        uint64_t bytes;
+        uint64_t freedAllocs;
+        uint64_t freedBytes;
+    };
+
+    struct Slot {
+        int      session;   // which run of the profiler sampled it
+        int      site;
+        uint32_t size;
+        int      next;      // the next free slot
+    };
+
+    //  Sampled allocations are rare, so one lock covers everything.
+    struct State {
+        State() : session(0), samples(0), dropped(0),
+                  freeSlot(-1), unusedSlot(0) { }
+
+        std::mutex          lock;
+        int                 session;
+        int                 samples;
+        int                 dropped;
+        std::map<Stack,int> siteIndex;
+        std::vector<Site>   sites;
+        Slot                slots[SlotCount];
+        int                 freeSlot;
+        int                 unusedSlot;
+    };
+}
+
+static std::atomic<int> s_rate(1);
+
+static State& state()
+{
+    // Never destroyed, as sampled objects may be freed during exit.
+    static State* s = new State;
+    return *s;
+}
+
+//  Spaces samples a random distance apart, averaging the rate, so that
+//  allocations which happen in a fixed pattern aren't always or never
+//  sampled.
+static int64_t nextCountdown()
+{
+    int rate = s_rate.load(std::memory_order_relaxed);
+    if (rate <= 1) {
+        return 1;
+    }
+    static thread_local uint64_t seed = 0;
+    if (seed == 0) {
+        seed = reinterpret_cast<uintptr_t>(&seed) | 1;
+    }
+    seed ^= seed << 13;
+    seed ^= seed >> 7;
+    seed ^= seed << 17;
+    return 1 + static_cast<int64_t>(seed % (2 * rate - 1));
+}
+
+void HeapProfiler::start(int rate)
+{
+    MAL_CHECK(!isActive(), "the heap profiler is already running");
+    MAL_CHECK(rate > 0, "the sampling rate must be positive");
+
+    State& st = state();
+    std::lock_guard<std::mutex> guard(st.lock);
+    if (s_base.load() == 0) {
+        void* arena = mmap(NULL, SlotCount * SlotSize,
+                           PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                           -1, 0);
+        MAL_CHECK(arena != MAP_FAILED, "Cannot reserve the sample arena");
+        s_base.store(reinterpret_cast<uintptr_t>(arena));
+        s_span.store(SlotCount * SlotSize);
+    }
+    st.siteIndex.clear();
+    st.sites.clear();
+    st.samples = 0;
+    st.dropped = 0;
+    s_rate = rate;
+    Profiler::addTracker();
+    s_isActive = true;
+}
+
+void* HeapProfiler::sample(size_t size)
+{
+    s_countdown = nextCountdown();
+    if (size > SlotSize) {
+        return NULL;
+    }
+    // The site is the function and whatever called it, so that the
+    // report neither lumps everything into the builtins which allocate
+    // nor gives each depth of a recursion a line of its own.
+    const char* const* frames;
+    int depth = Profiler::stack(frames);
+    Stack stack(frames + std::max(0, depth - SiteDepth), frames + depth);
+
+    State& st = state();
+    std::lock_guard<std::mutex> guard(st.lock);
+    if (!isActive()) {
+        return NULL;
+    }
+    int slot = st.freeSlot;
+    if (slot >= 0) {
+        st.freeSlot = st.slots[slot].next;
+    }
+    else if (st.unusedSlot < SlotCount) {
+        slot = st.unusedSlot++;
+    }
+    else {
+        st.dropped++;
+        return NULL;
+    }
+
+    auto it = st.siteIndex.find(stack);
+    if (it == st.siteIndex.end()) {
+        it = st.siteIndex.insert(std::make_pair(stack, st.sites.size())).first;
+        st.sites.push_back(Site(stack));
+    }
+    Site& site = st.sites[it->second];
+    site.allocs++;
+    site.bytes += size;
+    st.samples++;
+
+    Slot& info = st.slots[slot];
+    info.session = st.session;
+    info.site = it->second;
+    info.size = size;
+    return reinterpret_cast<void*>(s_base.load() + slot * SlotSize);
+}
+
+void HeapProfiler::release(void* p)
+{
+    int slot = (reinterpret_cast<uintptr_t>(p) - s_base.load()) / SlotSize;
+
+    State& st = state();
+    std::lock_guard<std::mutex> guard(st.lock);
+    Slot& info = st.slots[slot];
+    if (info.session == st.session) {
+        Site& site = st.sites[info.site];
+        site.freedAllocs++;
+        site.freedBytes += info.size;
+    }
+    info.next = st.freeSlot;
+    st.freeSlot = slot;
+}
+
+void HeapProfiler::addBytes(void* p, size_t bytes)
+{
+    int slot = (reinterpret_cast<uintptr_t>(p) - s_base.load()) / SlotSize;
+
+    State& st = state();
+    std::lock_guard<std::mutex> guard(st.lock);
+    Slot& info = st.slots[slot];
+    if (info.session == st.session) {
+        st.sites[info.site].bytes += bytes;
+        info.size += bytes;
+    }
+}
+
+static bool moreBytes(const Site* a, const Site* b)
+{
+    return a->bytes > b->bytes;
+}
+
+int HeapProfiler::stop(const String& path)
+{
+    MAL_CHECK(isActive(), "the heap profiler isn't running");
+
+    s_isActive = false;
+    Profiler::removeTracker();
+
+    State& st = state();
+    std::lock_guard<std::mutex> guard(st.lock);
+    // Objects sampled by this run are still freed into the arena, but no
+    // longer counted.
+    st.session++;
+
+    std::vector<const Site*> sites;
+    for (auto it = st.sites.begin(), end = st.sites.end(); it != end; ++it) {
+        sites.push_back(&*it);
+    }
+    std::stable_sort(sites.begin(), sites.end(), moreBytes);
+
+    FILE* out = fopen(path.c_str(), "w");
+    MAL_CHECK(out != NULL, "Cannot open %s", path.c_str());
+    const uint64_t rate = s_rate.load();
+    fprintf(out, "# heap profile: 1 in %llu allocations sampled, "
+                 "%d samples, %d dropped\n",
+            (unsigned long long)rate, st.samples, st.dropped);
+    fprintf(out, "# %10s %12s %10s %12s  %s\n",
+            "allocs", "bytes", "live", "live-bytes", "site");
+    for (auto it = sites.begin(), end = sites.end(); it != end; ++it) {
+        const Site& site = **it;
+        String stack;
+        for (auto f = site.stack.begin(); f != site.stack.end(); ++f) {
+            if (!stack.empty()) {
+                stack += ';';
+            }
+            stack += *f;
+        }
+        fprintf(out, "  %10llu %12llu %10llu %12llu  %s\n",
+                (unsigned long long)(site.allocs * rate),
+                (unsigned long long)(site.bytes * rate),
+                (unsigned long long)((site.allocs - site.freedAllocs) * rate),
+                (unsigned long long)((site.bytes - site.freedBytes) * rate),
+                stack.empty() ? "(top level)" : stack.c_str());
+    }
+    fclose(out);
+    return st.samples;
+}
@@ -0,0 +1,69 @@
+#ifndef INCLUDE_HEAPPROFILER_H
+#define INCLUDE_HEAPPROFILER_H
+
+#include "String.h"
+
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+
+//  A sampling allocation profiler for mal code. While it runs, about one
+//  in every rate counted allocations is attributed to the innermost
+//  lambda or builtin which made it, and to its caller (see Profiler.h).
+//  Stopping it writes a report of the estimated allocations and bytes of
+//  each of these sites, and of how many of them are still alive.
+//
+//  Sampled objects live in an arena of their own, so that telling whether
+//  an object was sampled when it is freed is a range check rather than a
+//  lookup. Objects too big for an arena slot are never sampled; every
+//  counted mal type and malEnv is checked to fit when it is compiled. A
+//  sampled list or vector is also charged for the buffer of its items, by
+//  its capacity, since that is usually most of its memory.
+class HeapProfiler {
+public:
+    //  The size of an arena slot.
+    static const size_t MaxSampledSize = 256;
+
+    static bool isActive() {
+        return s_isActive.load(std::memory_order_relaxed);
+    }
+
+    static void start(int rate);
+
+    //  Stops sampling and writes the report to path, returning how many
+    //  samples there were.
+    static int stop(const String& path);
+
+    //  Memory for a counted object of size bytes if it is to be sampled,
+    //  otherwise NULL.
+    static void* allocate(size_t size) {
+        if (!isActive() || (--s_countdown > 0)) {
+            return NULL;
+        }
+        return sample(size);
+    }
+
+    //  Whether p was returned by allocate(), whether or not the profiler
+    //  is still running.
+    static bool owns(void* p) {
+        return (reinterpret_cast<uintptr_t>(p) -
+                s_base.load(std::memory_order_relaxed)) <
+               s_span.load(std::memory_order_relaxed);
+    }
+
+    static void release(void* p);
+
+    //  Charges a sampled object p for bytes more than its own size, for
+    //  memory which it owns and frees with itself.
+    static void addBytes(void* p, size_t bytes);
+
+private:
+    static void* sample(size_t size);
+
+    static std::atomic<bool> s_isActive;
+    static std::atomic<uintptr_t> s_base;
+    static std::atomic<uintptr_t> s_span;
+    static __thread int64_t s_countdown;
+};
+
+#endif // INCLUDE_HEAPPROFILER_H
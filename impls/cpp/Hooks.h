@@ -0,0 +1,36 @@
+#ifndef INCLUDE_HOOKS_H
+#define INCLUDE_HOOKS_H
+
+#include <atomic>
+
+//  What is watching the evaluator. The profilers, the tracer and the call
+//  counters each set a bit of one word while they are on, and the hooks
+//  in EVAL and apply test the whole word before doing anything else. With
+//  none of them on, a hook costs one load and one branch, and EVAL tests
+//  it once per call rather than on every turn of its loop. Once any
+//  interpreter has enabled constant folding, EVAL also has to look out
+//  for folded forms, so the optimiser sets a bit of its own for good.
+class Hooks {
+public:
+    enum Hook {
+        Profiling = 1 << 0,
+        Tracing   = 1 << 1,
+        Counting  = 1 << 2,
+        Folding   = 1 << 3,
+    };
+
+    static bool any() {
+        return s_active.load(std::memory_order_relaxed) != 0;
+    }
+    static bool isOn(Hook hook) {
+        return (s_active.load(std::memory_order_relaxed) & hook) != 0;
+    }
+
+    static void turnOn(Hook hook)  { s_active.fetch_or(hook); }
+    static void turnOff(Hook hook) { s_active.fetch_and(~hook); }
+
+private:
+    static std::atomic<unsigned> s_active;
+};
+
+#endif // INCLUDE_HOOKS_H
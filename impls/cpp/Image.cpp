@@ -0,0 +1,582 @@
+#include "Image.h"
+#include "Binary.h"
+#include "Builtins.h"
+#include "Environment.h"
+#include "Types.h"
+
+#include <fcntl.h>
+#include <map>
+#include <memory>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+namespace {
+    const char Magic[4] = { 'M', 'A', 'L', 'I' };
+    const uint32_t Version = 1;
+
+    //  An absent reference: an environment with no outer one, a value
+    //  without metadata, or a transducer stage without a function.
+    const uint32_t None = 0xffffffff;
+
+    enum Tag : uint8_t {
+        NilTag, TrueTag, FalseTag, IntegerTag, StringTag, KeywordTag,
+        SymbolTag, ListTag, VectorTag, HashTag, BuiltinTag, LambdaTag,
+        AtomTag, TransducerTag,
+    };
+
+    //  Values are written after any they refer to, other than through
+    //  environments and atoms, which are numbered as they are found and
+    //  only filled in once every value has been read. Those are the only
+    //  places a cycle can go through.
+    class ImageWriter {
+    public:
+        void save(malEnvPtr root);
+
+        const String& data() const { return m_out.data(); }
+
+    private:
+        //  A value waiting to be written until everything it refers to
+        //  has been.
+        struct Pending {
+            explicit Pending(malValuePtr value)
+                : value(value), isExpanded(false) { }
+
+            malValuePtr value;
+            // A hash-map's keys are made afresh each time they're asked
+            // for, so they're asked for once and kept here.
+            malValuePtr keys;
+            bool        isExpanded;
+        };
+
+        //  Each of these returns the index of what it's given, adding it
+        //  to the image if it isn't there yet.
+        uint32_t addValue(malValuePtr value);
+        uint32_t addEnv(malEnvPtr env);
+        uint32_t addAtom(malValuePtr atom);
+
+        //  The values pending refers to, which must be written first.
+        void getReferences(Pending& pending, malValueVec& refs);
+        //  Writes pending, once everything it refers to has an index.
+        void writeValue(const Pending& pending);
+        uint32_t indexOf(malValuePtr value) const;
+
+        BinaryWriter                          m_out;
+        BinaryWriter                          m_values;
+        // Some values, such as hash-map keys, are made while saving, so
+        // every value is held on to until the end, to keep the addresses
+        // in the index from being reused.
+        malValueVec                           m_valuesSeen;
+        std::map<const malValue*, uint32_t>   m_valueIndex;
+        std::vector<malEnvPtr>                m_envs;
+        std::map<const malEnv*, uint32_t>     m_envIndex;
+        std::vector<malValuePtr>              m_atoms;
+        std::map<const malValue*, uint32_t>   m_atomIndex;
+    };
+
+    class ImageReader : public BinaryReader {
+    public:
+        ImageReader(const char* begin, const char* end)
+            : BinaryReader(begin, end) { }
+
+        void load(malEnvPtr root);
+
+    private:
+        malValuePtr getValue(uint8_t tag);
+        malValuePtr valueAt(uint32_t index);
+        malValueVec* getItems();
+
+        std::vector<malEnvPtr>   m_envs;
+        std::vector<malValuePtr> m_atoms;
+        malValueVec              m_values;
+    };
+
+    //  Thrown when the image refers to something it doesn't have.
+    struct Corrupt { };
+}
+
+uint32_t ImageWriter::addEnv(malEnvPtr env)
+{
+    // Outer environments are numbered first, so they're made first.
+    std::vector<malEnvPtr> chain;
+    for (malEnvPtr e = env; e && !m_envIndex.count(e.ptr());
+         e = e->getOuter()) {
+        chain.push_back(e);
+    }
+    for (auto it = chain.rbegin(), end = chain.rend(); it != end; ++it) {
+        m_envIndex[it->ptr()] = m_envs.size();
+        m_envs.push_back(*it);
+    }
+    return m_envIndex[env.ptr()];
+}
+
+uint32_t ImageWriter::addAtom(malValuePtr atom)
+{
+    auto it = m_atomIndex.find(atom.ptr());
+    if (it != m_atomIndex.end()) {
+        return it->second;
+    }
+    uint32_t index = m_atoms.size();
+    m_atoms.push_back(atom);
+    m_atomIndex[atom.ptr()] = index;
+    return index;
+}
+
+//  Folded forms are saved as the forms they were folded from, and the
+//  folder can do its work again once the image is loaded.
+static malValuePtr unfolded(malValuePtr value)
+{
+    while (const malFolded* f = DYNAMIC_CAST(malFolded, value)) {
+        value = f->original();
+    }
+    return value;
+}
+
+uint32_t ImageWriter::indexOf(malValuePtr value) const
+{
+    auto found = m_valueIndex.find(unfolded(value).ptr());
+    ASSERT(found != m_valueIndex.end(), "value written out of order");
+    return found->second;
+}
+
+uint32_t ImageWriter::addValue(malValuePtr value)
+{
+    // Everything a value refers to is written before it. Values can be
+    // nested as deeply as memory allows, so instead of recursing, those
+    // still to be written are kept on a stack of their own.
+    std::vector<Pending> pending;
+    pending.push_back(Pending(unfolded(value)));
+    malValueVec refs;
+    while (!pending.empty()) {
+        Pending& next = pending.back();
+        if (m_valueIndex.count(next.value.ptr())) {
+            pending.pop_back();
+        }
+        else if (!next.isExpanded) {
+            next.isExpanded = true;
+            refs.clear();
+            getReferences(next, refs);
+            // Pushed in reverse, so they're written in order.
+            for (auto it = refs.rbegin(), end = refs.rend(); it != end; ++it) {
+                pending.push_back(Pending(unfolded(*it)));
+            }
+        }
+        else {
+            writeValue(next);
+            pending.pop_back();
+        }
+    }
+    return indexOf(value);
+}
+
+void ImageWriter::getReferences(Pending& pending, malValueVec& refs)
+{
+    malValuePtr value = pending.value;
+    malValuePtr meta = value->meta();
+    if (meta != mal::nilValue()) {
+        refs.push_back(meta);
+    }
+    if (const malSequence* seq = DYNAMIC_CAST(malSequence, value)) {
+        refs.insert(refs.end(), seq->begin(), seq->end());
+    }
+    else if (const malHash* h = DYNAMIC_CAST(malHash, value)) {
+        pending.keys = h->keys();
+        const malSequence* keys = STATIC_CAST(malSequence, pending.keys);
+        for (malValueIter it = keys->begin(); it != keys->end(); ++it) {
+            refs.push_back(*it);
+            refs.push_back(h->get(*it));
+        }
+    }
+    else if (const malLambda* l = DYNAMIC_CAST(malLambda, value)) {
+        refs.push_back(l->getBody());
+    }
+    else if (const malTransducer* t = DYNAMIC_CAST(malTransducer, value)) {
+        const malTransducer::Stages& stages = t->stages();
+        for (auto it = stages.begin(), end = stages.end(); it != end; ++it) {
+            if (it->fn) {
+                refs.push_back(it->fn);
+            }
+        }
+    }
+}
+
+void ImageWriter::writeValue(const Pending& pending)
+{
+    malValuePtr value = pending.value;
+    malValuePtr meta = value->meta();
+    uint32_t metaIndex = (meta == mal::nilValue()) ? None : indexOf(meta);
+    BinaryWriter record;
+    // Lists, vectors and hash-maps end with the indices of their items.
+    bool hasItems = false;
+    std::vector<uint32_t> items;
+    if (value == mal::nilValue()) {
+        record.put8(NilTag);
+    }
+    else if (value == mal::trueValue()) {
+        record.put8(TrueTag);
+    }
+    else if (value == mal::falseValue()) {
+        record.put8(FalseTag);
+    }
+    else if (const malInteger* i = DYNAMIC_CAST(malInteger, value)) {
+        record.put8(IntegerTag);
+        record.put64(i->value());
+    }
+    else if (const malString* s = DYNAMIC_CAST(malString, value)) {
+        record.put8(StringTag);
+        record.putString(s->value());
+    }
+    else if (const malKeyword* k = DYNAMIC_CAST(malKeyword, value)) {
+        record.put8(KeywordTag);
+        record.putString(k->value());
+    }
+    else if (const malSymbol* s = DYNAMIC_CAST(malSymbol, value)) {
+        record.put8(SymbolTag);
+        record.putString(s->value());
+    }
+    else if (const malSequence* seq = DYNAMIC_CAST(malSequence, value)) {
+        for (malValueIter it = seq->begin(); it != seq->end(); ++it) {
+            items.push_back(indexOf(*it));
+        }
+        record.put8(DYNAMIC_CAST(malList, value) ? ListTag : VectorTag);
+        hasItems = true;
+    }
+    else if (const malHash* h = DYNAMIC_CAST(malHash, value)) {
+        const malSequence* keys = STATIC_CAST(malSequence, pending.keys);
+        for (malValueIter it = keys->begin(); it != keys->end(); ++it) {
+            items.push_back(indexOf(*it));
+            items.push_back(indexOf(h->get(*it)));
+        }
+        record.put8(HashTag);
+        record.put8(h->isEvaluated());
+        hasItems = true;
+    }
+    else if (const malBuiltIn* b = DYNAMIC_CAST(malBuiltIn, value)) {
+        record.put8(BuiltinTag);
+        record.putString(b->name());
+    }
+    else if (const malLambda* l = DYNAMIC_CAST(malLambda, value)) {
+        uint32_t body = indexOf(l->getBody());
+        uint32_t env = addEnv(l->getEnv());
+        const StringVec& bindings = l->getBindings();
+        record.put8(LambdaTag);
+        record.put8(l->isMacro());
+        record.putString(l->name());
+        record.put32(bindings.size());
+        for (auto it = bindings.begin(); it != bindings.end(); ++it) {
+            record.putString(*it);
+        }
+        record.put32(body);
+        record.put32(env);
+    }
+    else if (DYNAMIC_CAST(malAtom, value)) {
+        MAL_CHECK(metaIndex == None, "can't save an atom with metadata");
+        record.put8(AtomTag);
+        record.put32(addAtom(value));
+    }
+    else if (const malTransducer* t = DYNAMIC_CAST(malTransducer, value)) {
+        const malTransducer::Stages& stages = t->stages();
+        record.put8(TransducerTag);
+        record.put32(stages.size());
+        for (auto it = stages.begin(), end = stages.end(); it != end; ++it) {
+            record.put8(it->kind);
+            record.put32(it->fn ? indexOf(it->fn) : None);
+            record.put64(it->count);
+        }
+    }
+    else {
+        // Printing a lazy seq could take forever.
+        MAL_FAIL("images can't hold %s",
+                 DYNAMIC_CAST(malLazySeq, value) ? "lazy seqs"
+                 : DYNAMIC_CAST(malFuture, value) ? "futures"
+                 : DYNAMIC_CAST(malChannel, value) ? "channels"
+                 : DYNAMIC_CAST(malIsolate, value) ? "isolates"
+                 : value->print(true).c_str());
+    }
+
+    m_values.put(record.data().data(), record.data().size());
+    if (hasItems) {
+        m_values.put32(items.size());
+        for (auto it = items.begin(), end = items.end(); it != end; ++it) {
+            m_values.put32(*it);
+        }
+    }
+    m_values.put32(metaIndex);
+
+    uint32_t index = m_valuesSeen.size();
+    m_valuesSeen.push_back(value);
+    m_valueIndex[value.ptr()] = index;
+}
+
+void ImageWriter::save(malEnvPtr root)
+{
+    addEnv(root);
+
+    // Saving bindings and atoms' values finds more environments and
+    // atoms, and so on until there are no new ones.
+    std::vector<std::vector<std::pair<String, uint32_t>>> bindings;
+    std::vector<uint32_t> atomValues;
+    while ((bindings.size() < m_envs.size()) ||
+           (atomValues.size() < m_atoms.size())) {
+        for (size_t i = bindings.size(); i < m_envs.size(); i++) {
+            malEnv::Map map = m_envs[i]->bindings();
+            std::vector<std::pair<String, uint32_t>> frame;
+            for (auto it = map.begin(), end = map.end(); it != end; ++it) {
+                uint32_t index;
+                try {
+                    index = addValue(it->second);
+                }
+                catch (String& error) {
+                    throw STRF("%s (bound to %s)", error.c_str(),
+                               it->first.c_str());
+                }
+                frame.push_back(std::make_pair(it->first, index));
+            }
+            bindings.push_back(frame);
+        }
+        for (size_t i = atomValues.size(); i < m_atoms.size(); i++) {
+            const malAtom* atom = STATIC_CAST(malAtom, m_atoms[i]);
+            atomValues.push_back(addValue(atom->deref()));
+        }
+    }
+
+    m_out.put(Magic, sizeof(Magic));
+    m_out.put32(Version);
+    m_out.put32(m_envs.size());
+    for (auto it = m_envs.begin(), end = m_envs.end(); it != end; ++it) {
+        malEnvPtr outer = (*it)->getOuter();
+        m_out.put32(outer ? m_envIndex[outer.ptr()] : None);
+    }
+    m_out.put32(m_atoms.size());
+    m_out.put32(m_valuesSeen.size());
+    m_out.put(m_values.data().data(), m_values.data().size());
+    for (auto& frame : bindings) {
+        m_out.put32(frame.size());
+        for (auto& binding : frame) {
+            m_out.putString(binding.first);
+            m_out.put32(binding.second);
+        }
+    }
+    for (auto it = atomValues.begin(); it != atomValues.end(); ++it) {
+        m_out.put32(*it);
+    }
+}
+
+malValuePtr ImageReader::valueAt(uint32_t index)
+{
+    // Only values already read can be referred to.
+    if (index >= m_values.size()) {
+        throw Corrupt();
+    }
+    return m_values[index];
+}
+
+malValueVec* ImageReader::getItems()
+{
+    uint32_t count = get32();
+    if (count > remaining() / sizeof(uint32_t)) {
+        throw Corrupt();
+    }
+    std::unique_ptr<malValueVec> items(new malValueVec);
+    items->reserve(count);
+    for (uint32_t i = 0; i < count; i++) {
+        items->push_back(valueAt(get32()));
+    }
+    return items.release();
+}
+
+//  The builtins of this interpreter, by name.
+static const std::map<String, malValuePtr>& builtinsByName()
+{
+    static const std::map<String, malValuePtr> builtins = []() {
+        std::map<String, malValuePtr> builtins;
+        StaticList<malBuiltIn*>& handlers = builtinHandlers();
+        for (auto it = handlers.begin(); it != handlers.end(); ++it) {
+            builtins[(*it)->name()] = *it;
+        }
+        return builtins;
+    }();
+    return builtins;
+}
+
+malValuePtr ImageReader::getValue(uint8_t tag)
+{
+    switch (tag) {
+        case NilTag:     return mal::nilValue();
+        case TrueTag:    return mal::trueValue();
+        case FalseTag:   return mal::falseValue();
+        case IntegerTag: return mal::integer(int64_t(get64()));
+        case StringTag:  return mal::string(getString());
+        case KeywordTag: return mal::keyword(getString());
+        case SymbolTag:  return mal::symbol(getString());
+        case ListTag:    return mal::list(getItems());
+        case VectorTag:  return mal::vector(getItems());
+
+        case HashTag: {
+            bool isEvaluated = get8();
+            std::unique_ptr<malValueVec> items(getItems());
+            return mal::hash(items->begin(), items->end(), isEvaluated);
+        }
+
+        case BuiltinTag: {
+            String name = getString();
+            auto it = builtinsByName().find(name);
+            MAL_CHECK(it != builtinsByName().end(),
+                      "the image needs the builtin %s, which this "
+                      "interpreter doesn't have", name.c_str());
+            return it->second;
+        }
+
+        case LambdaTag: {
+            bool isMacro = get8();
+            String name = getString();
+            uint32_t count = get32();
+            StringVec bindings;
+            for (uint32_t i = 0; i < count; i++) {
+                bindings.push_back(getString());
+            }
+            malValuePtr body = valueAt(get32());
+            uint32_t env = get32();
+            if (env >= m_envs.size()) {
+                throw Corrupt();
+            }
+            malValuePtr lambda = mal::lambda(bindings, body, m_envs[env]);
+            if (name != "anonymous") {
+                STATIC_CAST(malLambda, lambda)->setName(name);
+            }
+            return isMacro ? mal::macro(*STATIC_CAST(malLambda, lambda))
+                           : lambda;
+        }
+
+        case AtomTag: {
+            uint32_t atom = get32();
+            if (atom >= m_atoms.size()) {
+                throw Corrupt();
+            }
+            return m_atoms[atom];
+        }
+
+        case TransducerTag: {
+            uint32_t count = get32();
+            malTransducer::Stages stages;
+            for (uint32_t i = 0; i < count; i++) {
+                uint8_t kind = get8();
+                uint32_t fn = get32();
+                int64_t stageCount = get64();
+                if (kind > malTransducer::Drop) {
+                    throw Corrupt();
+                }
+                stages.push_back(malTransducer::Stage(
+                    malTransducer::Kind(kind),
+                    fn == None ? malValuePtr() : valueAt(fn), stageCount));
+            }
+            return mal::transducer(stages);
+        }
+    }
+    throw Corrupt();
+}
+
+void ImageReader::load(malEnvPtr root)
+{
+    if ((memcmp(get(sizeof(Magic)), Magic, sizeof(Magic)) != 0) ||
+        (get32() != Version)) {
+        throw Corrupt();
+    }
+
+    uint32_t envCount = get32();
+    for (uint32_t i = 0; i < envCount; i++) {
+        uint32_t outer = get32();
+        if (i == 0) {
+            if (outer != None) {
+                throw Corrupt();
+            }
+            m_envs.push_back(root);
+        }
+        else if (outer == None) {
+            m_envs.push_back(malEnvPtr(new malEnv()));
+        }
+        else if (outer < i) {
+            m_envs.push_back(malEnvPtr(new malEnv(m_envs[outer])));
+        }
+        else {
+            throw Corrupt();
+        }
+    }
+
+    uint32_t atomCount = get32();
+    for (uint32_t i = 0; i < atomCount; i++) {
+        m_atoms.push_back(mal::atom(mal::nilValue()));
+    }
+
+    uint32_t valueCount = get32();
+    m_values.reserve(valueCount);
+    for (uint32_t i = 0; i < valueCount; i++) {
+        malValuePtr value = getValue(get8());
+        uint32_t meta = get32();
+        if (meta != None) {
+            value = value->withMeta(valueAt(meta));
+        }
+        m_values.push_back(value);
+    }
+
+    for (uint32_t i = 0; i < envCount; i++) {
+        uint32_t count = get32();
+        for (uint32_t j = 0; j < count; j++) {
+            String name = getString();
+            m_envs[i]->set(name, valueAt(get32()));
+        }
+    }
+    for (uint32_t i = 0; i < atomCount; i++) {
+        STATIC_CAST(malAtom, m_atoms[i])->reset(valueAt(get32()));
+    }
+    if (!atEnd()) {
+        throw Corrupt();
+    }
+}
+
+void Image::save(const String& path, malEnvPtr root)
+{
+    ImageWriter writer;
+    writer.save(root);
+
+    FILE* out = fopen(path.c_str(), "wb");
+    MAL_CHECK(out != NULL, "Cannot open %s", path.c_str());
+    const String& data = writer.data();
+    bool isWritten = fwrite(data.data(), 1, data.size(), out) == data.size();
+    isWritten = (fclose(out) == 0) && isWritten;
+    MAL_CHECK(isWritten, "Cannot write %s", path.c_str());
+}
+
+void Image::load(const String& path, malEnvPtr root)
+{
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    MAL_CHECK(fd >= 0, "Cannot open %s", path.c_str());
+    struct stat st;
+    void* data = MAP_FAILED;
+    if ((fstat(fd, &st) == 0) && (st.st_size > 0)) {
+        data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    MAL_CHECK(data != MAP_FAILED, "%s is not a mal image", path.c_str());
+
+    const char* begin = static_cast<const char*>(data);
+    ImageReader reader(begin, begin + st.st_size);
+    bool isValid = true;
+    try {
+        reader.load(root);
+    }
+    catch (Corrupt&) {
+        isValid = false;
+    }
+    catch (BinaryReader::Truncated&) {
+        isValid = false;
+    }
+    catch (...) {
+        munmap(data, st.st_size);
+        throw;
+    }
+    munmap(data, st.st_size);
+    MAL_CHECK(isValid, "%s is not a mal image", path.c_str());
+}
@@ -0,0 +1,25 @@
+#ifndef INCLUDE_IMAGE_H
+#define INCLUDE_IMAGE_H
+
+#include "MAL.h"
+
+//  Saves everything reachable from a root environment to a file, and
+//  loads it back into another interpreter's root, so that a program can
+//  start from the state a long prelude left behind without evaluating it
+//  again.
+//
+//  An image is a table of the environments, atoms and values reachable
+//  from the root, which refer to each other by index. Closures keep the
+//  environments they captured, and environments and atoms shared between
+//  closures stay shared. Builtins are saved by name, and bound to the
+//  loading interpreter's own. Lazy seqs, futures, channels and isolates
+//  can't be saved.
+class Image {
+public:
+    static void save(const String& path, malEnvPtr root);
+
+    //  Binds the image's root definitions in root, replacing any it has.
+    static void load(const String& path, malEnvPtr root);
+};
+
+#endif // INCLUDE_IMAGE_H
@@ -0,0 +1,72 @@
+#include "Interpreter.h"
+#include "Types.h"
+
+malInterpreter::Installer malInterpreter::s_installer = NULL;
+__thread malInterpreter* malInterpreter::s_current = NULL;
+
+void malInterpreter::setInstaller(Installer installer)
+{
+    s_installer = installer;
+}
+
+malInterpreterPtr malInterpreter::create(FILE* output)
+{
+    malInterpreterPtr interp(new malInterpreter(output));
+
+    // The installer may evaluate code, which may print or start futures.
+    Scope scope(interp.get());
+    if (s_installer) {
+        s_installer(interp->m_env);
+    }
+    return interp;
+}
+
+malInterpreterPtr malInterpreter::create(malEnvPtr env, FILE* output)
+{
+    return malInterpreterPtr(new malInterpreter(env, output));
+}
+
+malInterpreter::malInterpreter(FILE* output)
+: m_env(new malEnv)
+, m_output(output)
+{
+}
+
+malInterpreter::malInterpreter(malEnvPtr env, FILE* output)
+: m_env(env)
+, m_output(output)
+{
+}
+
+malInterpreter::~malInterpreter()
+{
+    if (s_current == this) {
+        s_current = NULL;
+    }
+}
+
+void malInterpreter::capture(const String& text)
+{
+    // Futures may print from other threads.
+    std::lock_guard<std::mutex> guard(m_captureLock);
+    m_captured += text;
+}
+
+String malInterpreter::takeOutput()
+{
+    std::lock_guard<std::mutex> guard(m_captureLock);
+    String text;
+    text.swap(m_captured);
+    return text;
+}
+
+malInterpreter::Scope::Scope(malInterpreter* interp)
+: m_saved(s_current)
+{
+    s_current = interp;
+}
+
+malInterpreter::Scope::~Scope()
+{
+    s_current = m_saved;
+}
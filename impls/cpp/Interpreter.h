@@ -0,0 +1,120 @@
+#ifndef INCLUDE_INTERPRETER_H
+#define INCLUDE_INTERPRETER_H
+
+#include "MAL.h"
+#include "Environment.h"
+
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdio.h>
+
+//  An interpreter: a root environment set up by the step file, somewhere
+//  for printing to go, and the optimiser's caches. A process can keep one
+//  per thread and reuse it from request to request:
+//
+//      malInterpreterPtr interp = malInterpreter::create(NULL); // capture
+//      malInterpreter::Scope scope(interp.get());
+//      interp->rep("(println (+ 1 2))");
+//      interp->takeOutput();           // => "3\n"
+//
+//  Each thread has a current interpreter, which eval, EVAL(ast, NULL) and
+//  the printing builtins use. Futures run with the interpreter of the
+//  thread which started them, and hold a reference to it, so it lives on
+//  until the last of them has finished even if its owner lets it go.
+//
+//  Interpreters are not wholly independent. What they share is:
+//   - the lock over shared frames (Environment.cpp), one for every frame
+//     that malEnv::share() has handed to the thread pool;
+//   - the reference counts of shared objects, which are atomic on every
+//     thread that has called RefCounted::shareBetweenThreads();
+//   - the thread pool itself, started once for the whole process;
+//   - the Stats, Profiler, Tracer and Hooks globals;
+//   - malAtom's serial numbers and the serial below which atoms are
+//     frozen.
+class malInterpreter;
+typedef std::shared_ptr<malInterpreter> malInterpreterPtr;
+
+class malInterpreter : public std::enable_shared_from_this<malInterpreter> {
+public:
+    //  Called on each new root environment, to install the builtins and
+    //  the step file's own definitions.
+    typedef void (*Installer)(malEnvPtr env);
+    static void setInstaller(Installer installer);
+
+    //  Printing goes to output, or is captured if it is NULL.
+    static malInterpreterPtr create(FILE* output = stdout);
+
+    //  An interpreter for an environment the caller has already set up,
+    //  such as a frame over another interpreter's root. The installer
+    //  isn't run.
+    static malInterpreterPtr create(malEnvPtr env, FILE* output);
+    ~malInterpreter();
+
+    //  The calling thread's interpreter, or NULL if it has none.
+    static malInterpreter* current() { return s_current; }
+
+    //  Makes an interpreter current on this thread until the end of the
+    //  scope.
+    class Scope {
+    public:
+        Scope(malInterpreter* interp);
+        ~Scope();
+
+    private:
+        Scope(const Scope&); // no copy ctor
+        Scope& operator = (const Scope&); // no assignments
+
+        malInterpreter* m_saved;
+    };
+
+    malEnvPtr env() const { return m_env; }
+
+    //  Inline, so that only the steps which use it need a rep().
+    String rep(const String& input) {
+        Scope scope(this);
+        return ::rep(input, m_env);
+    }
+
+    FILE* output() const { return m_output; }
+    void capture(const String& text);
+    String takeOutput();
+
+    //  The state of constant folding (Optimizer.cpp): the values the
+    //  foldable builtins had when it was enabled, and for each of them a
+    //  count of times it has been redefined since.
+    struct FoldState {
+        enum { MaxFoldable = 32 };
+
+        FoldState() : isEnabled(false) {
+            for (int i = 0; i < MaxFoldable; i++) {
+                epochs[i] = 0;
+            }
+        }
+
+        bool                          isEnabled;
+        std::atomic<int>              epochs[MaxFoldable];
+        std::map<String, malValuePtr> pristine;
+    };
+    FoldState& folding() { return m_folding; }
+
+private:
+    //  Only through create(), so that shared_from_this() always works.
+    explicit malInterpreter(FILE* output);
+    malInterpreter(malEnvPtr env, FILE* output);
+
+    malInterpreter(const malInterpreter&); // no copy ctor
+    malInterpreter& operator = (const malInterpreter&); // no assignments
+
+    static Installer s_installer;
+    static __thread malInterpreter* s_current;
+
+    malEnvPtr  m_env;
+    FILE*      m_output;
+    std::mutex m_captureLock;
+    String     m_captured;
+    FoldState  m_folding;
+};
+
+#endif // INCLUDE_INTERPRETER_H
@@ -0,0 +1,398 @@
+#include "Isolate.h"
+#include "Builtins.h"
+#include "Environment.h"
+#include "EvalStack.h"
+#include "Interpreter.h"
+#include "Types.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <list>
+#include <stdlib.h>
+#include <thread>
+
+namespace {
+    struct Message {
+        Message() : next(NULL) { }
+        Message(malValuePtr value) : next(NULL), value(value) { }
+
+        std::atomic<Message*> next;
+        malValuePtr           value;
+    };
+}
+
+//  Vyukov's intrusive multi-producer, single-consumer queue. Any thread
+//  may send, but only the isolate which owns the mailbox receives.
+class Mailbox {
+public:
+    Mailbox()
+        : m_head(&m_stub), m_tail(&m_stub)
+        , m_isWaiting(false), m_isInterrupted(false) { }
+
+    ~Mailbox() {
+        while (Message* message = pop()) {
+            delete message;
+        }
+    }
+
+    //  The message's value must not be referred to by anything else, as
+    //  the receiving thread becomes its only owner.
+    void send(Message* message) {
+        push(message);
+        if (m_isWaiting.load()) {
+            std::lock_guard<std::mutex> guard(m_lock);
+            m_wakeup.notify_one();
+        }
+    }
+
+    //  Waits for a message for up to timeoutMs, or forever if negative.
+    bool receive(malValuePtr& value, int64_t timeoutMs) {
+        using namespace std::chrono;
+        steady_clock::time_point deadline =
+            steady_clock::now() + milliseconds(timeoutMs);
+        for (;;) {
+            MAL_CHECK(!m_isInterrupted.load(), "Interrupted");
+            if (Message* message = pop()) {
+                value = message->value;
+                delete message;
+                return true;
+            }
+            if (!isEmpty()) {
+                // A send has swapped the head but not yet linked the old
+                // one, which it is just about to do.
+                std::this_thread::yield();
+                continue;
+            }
+            if ((timeoutMs == 0) ||
+                ((timeoutMs > 0) && (steady_clock::now() >= deadline))) {
+                return false;
+            }
+
+            // send() reads m_isWaiting after pushing, so either it sees
+            // that we are waiting, or we see what it pushed.
+            std::unique_lock<std::mutex> guard(m_lock);
+            m_isWaiting.store(true);
+            if (isEmpty() && !m_isInterrupted.load()) {
+                if (timeoutMs < 0) {
+                    m_wakeup.wait(guard);
+                }
+                else {
+                    m_wakeup.wait_until(guard, deadline);
+                }
+            }
+            m_isWaiting.store(false);
+        }
+    }
+
+    //  Makes receive fail from now on, waking it if it is waiting.
+    void interrupt() {
+        std::lock_guard<std::mutex> guard(m_lock);
+        m_isInterrupted.store(true);
+        m_wakeup.notify_all();
+    }
+
+private:
+    void push(Message* message) {
+        message->next.store(NULL, std::memory_order_relaxed);
+        Message* prev = m_head.exchange(message);
+        prev->next.store(message, std::memory_order_release);
+    }
+
+    Message* pop() {
+        Message* tail = m_tail;
+        Message* next = tail->next.load(std::memory_order_acquire);
+        if (tail == &m_stub) {
+            if (!next) {
+                return NULL;
+            }
+            m_tail = next;
+            tail = next;
+            next = next->next.load(std::memory_order_acquire);
+        }
+        if (next) {
+            m_tail = next;
+            return tail;
+        }
+        if (tail != m_head.load()) {
+            return NULL;
+        }
+        // tail is the last message, so put the stub behind it.
+        push(&m_stub);
+        next = tail->next.load(std::memory_order_acquire);
+        if (next) {
+            m_tail = next;
+            return tail;
+        }
+        return NULL;
+    }
+
+    //  Only the receiving thread may ask.
+    bool isEmpty() const {
+        return m_head.load() == m_tail;
+    }
+
+    std::atomic<Message*>   m_head;
+    Message*                m_tail;
+    Message                 m_stub;
+
+    std::mutex              m_lock;
+    std::condition_variable m_wakeup;
+    std::atomic<bool>       m_isWaiting;
+    std::atomic<bool>       m_isInterrupted;
+};
+
+namespace {
+    //  An isolate which has been spawned and not yet joined. Its stack is
+    //  only set while it is evaluating, so that it can be interrupted.
+    struct Running {
+        Running(std::shared_ptr<Mailbox> mailbox)
+            : mailbox(mailbox), stack(NULL), isDone(false) { }
+
+        std::thread              thread;
+        std::shared_ptr<Mailbox> mailbox;
+        EvalStack::Thread*       stack;
+        bool                     isDone;
+    };
+
+    std::mutex          s_runningLock;
+    std::list<Running>  s_running;
+    std::atomic<bool>   s_isStopping(false);
+}
+
+static bool s_isEnabled = false;
+
+static thread_local std::shared_ptr<Mailbox> s_mailbox;
+
+void enableIsolates()
+{
+    if (!s_isEnabled) {
+        s_isEnabled = true;
+        atexit(&stopIsolates);
+    }
+}
+
+void stopIsolates()
+{
+    std::list<Running> running;
+    {
+        std::lock_guard<std::mutex> guard(s_runningLock);
+        s_isStopping = true;
+        for (auto it = s_running.begin(), end = s_running.end();
+             it != end; ++it) {
+            it->mailbox->interrupt();
+            if (it->stack) {
+                it->stack->interrupt();
+            }
+        }
+        running.swap(s_running);
+    }
+    for (auto it = running.begin(), end = running.end(); it != end; ++it) {
+        it->thread.join();
+    }
+}
+
+//  Joins the isolates which have finished. s_runningLock must be held.
+static void joinFinished()
+{
+    for (auto it = s_running.begin(); it != s_running.end(); ) {
+        if (it->isDone) {
+            it->thread.join();
+            it = s_running.erase(it);
+        }
+        else {
+            ++it;
+        }
+    }
+}
+
+static const std::shared_ptr<Mailbox>& currentMailbox()
+{
+    if (!s_mailbox) {
+        s_mailbox.reset(new Mailbox);
+    }
+    return s_mailbox;
+}
+
+//  Copies value into a new set of objects, which nothing else refers to.
+//  Constants and builtins are never freed, so they can be shared.
+static malValuePtr copyValue(malValuePtr value)
+{
+    EvalStack::check();
+    malValuePtr copy;
+    if (DYNAMIC_CAST(malConstant, value) || DYNAMIC_CAST(malBuiltIn, value)) {
+        return value;
+    }
+    else if (const malInteger* i = DYNAMIC_CAST(malInteger, value)) {
+        copy = mal::integer(i->value());
+    }
+    else if (const malString* s = DYNAMIC_CAST(malString, value)) {
+        copy = mal::string(s->value());
+    }
+    else if (const malKeyword* k = DYNAMIC_CAST(malKeyword, value)) {
+        copy = mal::keyword(k->value());
+    }
+    else if (const malSymbol* sym = DYNAMIC_CAST(malSymbol, value)) {
+        copy = mal::symbol(sym->value());
+    }
+    else if (const malSequence* seq = DYNAMIC_CAST(malSequence, value)) {
+        malValueVec* items = new malValueVec(seq->count());
+        for (int i = 0, count = seq->count(); i < count; i++) {
+            (*items)[i] = copyValue(seq->item(i));
+        }
+        copy = DYNAMIC_CAST(malVector, value) ? mal::vector(items)
+                                              : mal::list(items);
+    }
+    else if (const malLazySeq* lazy = DYNAMIC_CAST(malLazySeq, value)) {
+        // It might never end, so only what has already been computed can
+        // be copied.
+        MAL_CHECK(lazy->isFullyRealised(),
+                  "lazy seqs can't be sent to another isolate until they "
+                  "have been realised");
+        malValueVec* items = new malValueVec;
+        malLazySeq::Cursor it(value);
+        malValuePtr item;
+        while (it.next(item)) {
+            items->push_back(copyValue(item));
+        }
+        copy = mal::list(items);
+    }
+    else if (const malHash* hash = DYNAMIC_CAST(malHash, value)) {
+        malValuePtr keys = hash->keys();
+        malValuePtr values = hash->values();
+        const malSequence* keySeq = STATIC_CAST(malSequence, keys);
+        const malSequence* valueSeq = STATIC_CAST(malSequence, values);
+        malValueVec items;
+        for (int i = 0, count = keySeq->count(); i < count; i++) {
+            items.push_back(copyValue(keySeq->item(i)));
+            items.push_back(copyValue(valueSeq->item(i)));
+        }
+        copy = mal::hash(items.begin(), items.end(), true);
+    }
+    else if (const malIsolate* isolate = DYNAMIC_CAST(malIsolate, value)) {
+        copy = new malIsolate(isolate->mailbox());
+    }
+    else {
+        MAL_FAIL("%s can't be sent to another isolate",
+                 value->print(true).c_str());
+    }
+
+    malValuePtr meta = value->meta();
+    return (meta == mal::nilValue()) ? copy
+                                     : copy->withMeta(copyValue(meta));
+}
+
+static void evaluateIsolate(FILE* output, bool isFolding,
+                            malValuePtr ast, malValuePtr parent)
+{
+    // Futures the isolate started hold on to the interpreter, and may go
+    // on running after this returns.
+    malInterpreterPtr interp = malInterpreter::create(output);
+    malInterpreter::Scope scope(interp.get());
+    if (isFolding) {
+        enableFolding();
+    }
+    interp->env()->set("*parent*", parent);
+    EVAL(ast, interp->env());
+}
+
+static void runIsolate(Running* running, FILE* output, bool isFolding,
+                       Message* code, Message* parent)
+{
+    s_mailbox = running->mailbox;
+    malValuePtr ast = code->value;
+    malValuePtr parentValue = parent->value;
+    delete code;
+    delete parent;
+
+    EvalStack::Thread stack = EvalStack::Thread::current();
+    {
+        std::lock_guard<std::mutex> guard(s_runningLock);
+        running->stack = &stack;
+        if (s_isStopping) {
+            stack.interrupt();
+        }
+    }
+
+    // Nothing may be thrown past here, or the process is aborted. An
+    // isolate which was interrupted as the process exits stops quietly.
+    try {
+        evaluateIsolate(output, isFolding, ast, parentValue);
+    }
+    catch (malEmptyInputException&) {
+    }
+    catch (malValuePtr& mv) {
+        fprintf(stderr, "Error in isolate: %s\n", mv->print(true).c_str());
+    }
+    catch (String& s) {
+        if (!s_isStopping) {
+            fprintf(stderr, "Error in isolate: %s\n", s.c_str());
+        }
+    }
+    catch (std::exception& e) {
+        fprintf(stderr, "Error in isolate: %s\n", e.what());
+    }
+    catch (...) {
+        fprintf(stderr, "Error in isolate\n");
+    }
+    ast = NULL;
+    parentValue = NULL;
+
+    std::lock_guard<std::mutex> guard(s_runningLock);
+    running->stack = NULL;
+    running->isDone = true;
+}
+
+BUILTIN("receive")
+{
+    int argCount = CHECK_ARGS_BETWEEN(0, 1);
+    int64_t timeoutMs = -1;
+    if (argCount == 1) {
+        ARG(malInteger, timeout);
+        timeoutMs = timeout->value();
+    }
+    malValuePtr value;
+    if (!currentMailbox()->receive(value, timeoutMs)) {
+        return mal::nilValue();
+    }
+    return value;
+}
+
+TYPED_BUILTIN("self")
+{
+    return malValuePtr(new malIsolate(currentMailbox()));
+}
+
+TYPED_BUILTIN("send", malIsolate* isolate, malValuePtr value)
+{
+    Message* message = new Message(copyValue(value));
+    isolate->mailbox()->send(message);
+    return mal::nilValue();
+}
+
+TYPED_BUILTIN("spawn", malValuePtr form)
+{
+    MAL_CHECK(s_isEnabled, "isolates are not available");
+
+    // The isolate prints where we do, unless we capture our output.
+    malInterpreter* interp = malInterpreter::current();
+    FILE* output = (interp && interp->output()) ? interp->output() : stdout;
+    bool isFolding = foldingEnabled();
+
+    // The new thread becomes the only owner of both of these.
+    Message* code = new Message(copyValue(form));
+    Message* parent = new Message(new malIsolate(currentMailbox()));
+
+    std::shared_ptr<Mailbox> mailbox(new Mailbox);
+    std::lock_guard<std::mutex> guard(s_runningLock);
+    if (s_isStopping) {
+        delete code;
+        delete parent;
+        MAL_FAIL("isolates are stopping");
+    }
+    joinFinished();
+    s_running.emplace_back(mailbox);
+    Running* running = &s_running.back();
+    running->thread = std::thread(runIsolate, running, output, isFolding,
+                                  code, parent);
+    return malValuePtr(new malIsolate(mailbox));
+}
@@ -0,0 +1,32 @@
+#ifndef INCLUDE_ISOLATE_H
+#define INCLUDE_ISOLATE_H
+
+#include "MAL.h"
+
+//  Isolates are interpreters running on threads of their own. Each has its
+//  own malInterpreter and its own values, and they communicate only by
+//  sending deep copies of values to each other's mailboxes:
+//
+//      (def! worker (spawn '(send *parent* (* 2 (receive)))))
+//      (send worker 21)
+//      (receive)    ; => 42
+//
+//  Only immutable values are shared: the constants and the builtins,
+//  which are never freed. The process as a whole still has some state in
+//  common, though. A thread counts references atomically only once it
+//  has called RefCounted::shareBetweenThreads(), which an isolate does
+//  when it starts its first future, as do the thread pool's workers and
+//  the REPL server's sessions. An isolate which starts none goes on
+//  counting plainly. A def! in a frame which a future can see takes a
+//  lock which all such frames share.
+//
+//  spawn fails until isolates have been enabled, so that a program which
+//  embeds the interpreter decides whether scripts may start threads.
+extern void enableIsolates();
+
+//  Interrupts every isolate which is still running, and waits for them to
+//  unwind. Isolates are stopped this way when the process exits, and
+//  can't be spawned afterwards.
+extern void stopIsolates();
+
+#endif // INCLUDE_ISOLATE_H
@@ -26,6 +26,14 @@ extern String rep(const String& input, malEnvPtr env);
 // Core.cpp
 extern void installCore(malEnvPtr env);
 
+// Optimizer.cpp
+extern void enableFolding();
+extern bool foldingEnabled();
+extern int foldEpoch(unsigned uses);
+extern malValuePtr foldLambdaBody(malValuePtr fnForm, const StringVec& params,
+                                  malEnvPtr env);
+extern void noteDefinition(const String& name);
+
 // Reader.cpp
 extern malValuePtr readStr(const String& input);
 
@@ -0,0 +1,475 @@
+#include "MAL.h"
+#include "Environment.h"
+#include "Hooks.h"
+#include "Interpreter.h"
+#include "Types.h"
+
+#include <map>
+#include <set>
+
+//  Constant folding of lambda bodies.
+//
+//  Calls to a small set of pure builtins whose arguments are all constant
+//  are replaced by their result, if forms with a constant test are pruned,
+//  and let*-bound constants are propagated into the let* body. Every
+//  rewrite that depends on a builtin is wrapped in a malFolded, which falls
+//  back to the original form as soon as one of the builtins it relied on
+//  is redefined.
+//
+//  The arguments of any other call are left as they are, since the call
+//  may turn out to be to a macro, which must see the forms as written.
+//  For the same reason, such a call might def! anything, and stops a let*
+//  constant being propagated.
+
+static const char* foldableNames[] = {
+    "+", "-", "*", "/", "%", "<", "<=", ">", ">=", "=",
+    "count", "list", "not", "vector",
+};
+
+//  Folding is enabled per interpreter, and a folded form is only ever
+//  evaluated by the interpreter which folded it. Each foldable builtin has
+//  its own epoch, bumped by a def! of its name on any of the interpreter's
+//  threads, and a folded form checks the epochs of the builtins it used.
+static malInterpreter::FoldState* foldState()
+{
+    malInterpreter* interp = malInterpreter::current();
+    return interp ? &interp->folding() : NULL;
+}
+
+//  A foldable builtin's place in foldableNames, which is also its bit in
+//  malFolded::uses() and its epoch in FoldState, or -1 if name isn't one.
+static int foldableIndex(const String& name)
+{
+    static_assert(sizeof(foldableNames) / sizeof(foldableNames[0])
+                      <= malInterpreter::FoldState::MaxFoldable,
+                  "too many foldable builtins");
+    int index = 0;
+    for (auto foldable : foldableNames) {
+        if (name == foldable) {
+            return index;
+        }
+        index++;
+    }
+    return -1;
+}
+
+static malValuePtr foldedMarker()
+{
+    static malValuePtr c(new malConstant("folded"));
+    return c;
+}
+
+void enableFolding()
+{
+    malInterpreter* interp = malInterpreter::current();
+    MAL_CHECK(interp != NULL, "folding needs an interpreter");
+    malInterpreter::FoldState& state = interp->folding();
+    malEnvPtr env = interp->env();
+    for (auto name : foldableNames) {
+        if (env->find(name)) {
+            state.pristine[name] = env->get(name);
+        }
+    }
+    state.isEnabled = true;
+    Hooks::turnOn(Hooks::Folding);
+}
+
+bool foldingEnabled()
+{
+    malInterpreter::FoldState* state = foldState();
+    return state && state->isEnabled;
+}
+
+//  The sum of the epochs of the builtins in uses. Epochs only ever go up,
+//  so the sum is unchanged only if none of those builtins has been
+//  redefined. With no interpreter there is nothing to have folded against,
+//  so no folded form's epoch matches and each falls back to its original.
+int foldEpoch(unsigned uses)
+{
+    malInterpreter::FoldState* state = foldState();
+    if (!state) {
+        return -1;
+    }
+    int sum = 0;
+    for (int i = 0; uses != 0; i++, uses >>= 1) {
+        if (uses & 1) {
+            sum += state->epochs[i].load(std::memory_order_relaxed);
+        }
+    }
+    return sum;
+}
+
+void noteDefinition(const String& name)
+{
+    malInterpreter::FoldState* state = foldState();
+    int index = foldableIndex(name);
+    if (state && (index >= 0)) {
+        ++state->epochs[index];
+    }
+}
+
+namespace {
+    struct Scope {
+        malEnvPtr                     env;
+        std::set<String>              shadowed;
+        std::map<String, malValuePtr> constants;
+
+        void bind(const String& name) {
+            shadowed.insert(name);
+            constants.erase(name);
+        }
+    };
+}
+
+static malValuePtr fold(malValuePtr ast, const Scope& scope);
+
+static bool isSymbol(malValuePtr obj, const char* text)
+{
+    const malSymbol* sym = DYNAMIC_CAST(malSymbol, obj);
+    return sym && (sym->value() == text);
+}
+
+static bool isSelfEvaluating(malValuePtr obj)
+{
+    return DYNAMIC_CAST(malInteger, obj)
+        || DYNAMIC_CAST(malString, obj)
+        || DYNAMIC_CAST(malKeyword, obj)
+        || DYNAMIC_CAST(malConstant, obj);
+}
+
+//  If ast always evaluates to the same value, store it in value.
+static bool constantValue(malValuePtr ast, malValuePtr& value)
+{
+    if (const malFolded* folded = DYNAMIC_CAST(malFolded, ast)) {
+        return constantValue(folded->form(), value);
+    }
+    if (isSelfEvaluating(ast)) {
+        value = ast;
+        return true;
+    }
+    const malList* list = DYNAMIC_CAST(malList, ast);
+    if (list && (list->count() == 2) && isSymbol(list->item(0), "quote")) {
+        value = list->item(1);
+        return true;
+    }
+    return false;
+}
+
+static malValuePtr constantForm(malValuePtr value)
+{
+    return isSelfEvaluating(value) ? value
+                                   : mal::list(mal::symbol("quote"), value);
+}
+
+//  The builtins a folded form relied on, or none if ast isn't one.
+static unsigned usesOf(malValuePtr ast)
+{
+    const malFolded* folded = DYNAMIC_CAST(malFolded, ast);
+    return folded ? folded->uses() : 0;
+}
+
+static malValuePtr guard(malValuePtr form, malValuePtr original,
+                         unsigned uses)
+{
+    return malValuePtr(new malFolded(form, original, uses, foldEpoch(uses)));
+}
+
+//  The foldable builtin a call's operator names, as its foldableIndex, if
+//  the name isn't bound lexically inside the body being folded and still
+//  refers to the builtin as it was when folding was enabled; otherwise -1.
+//  Anything else might be a macro by the time the call runs, even if it
+//  isn't one yet, so only these calls are safe to look inside.
+static int pristineIndex(malValuePtr op, const Scope& scope)
+{
+    const malSymbol* sym = DYNAMIC_CAST(malSymbol, op);
+    if (!sym) {
+        return -1;
+    }
+    const String& name = sym->value();
+    if ((scope.shadowed.find(name) != scope.shadowed.end()) ||
+        !scope.env->find(name)) {
+        return -1;
+    }
+    const std::map<String, malValuePtr>& pristine = foldState()->pristine;
+    auto it = pristine.find(name);
+    if ((it == pristine.end()) || (it->second != scope.env->get(name))) {
+        return -1;
+    }
+    return foldableIndex(name);
+}
+
+static bool isSpecialForm(malValuePtr op)
+{
+    static const char* names[] = {
+        "catch*", "def!", "defmacro!", "do", "fn*", "if", "let*",
+        "macroexpand", "quasiquote", "quasiquoteexpand", "quote", "try*",
+    };
+    const malSymbol* sym = DYNAMIC_CAST(malSymbol, op);
+    if (!sym) {
+        return false;
+    }
+    for (auto special : names) {
+        if (sym->value() == special) {
+            return true;
+        }
+    }
+    return false;
+}
+
+//  True if ast might redefine name in the frame it runs in. Any call but
+//  one to a pristine builtin might be a macro call by then, which might
+//  expand into a def! of anything, so it counts as one.
+static bool mayDefine(malValuePtr ast, const String& name,
+                      const Scope& scope)
+{
+    if (isSymbol(ast, "eval")) {
+        return true;
+    }
+    const malSequence* seq = DYNAMIC_CAST(malSequence, ast);
+    if (!seq) {
+        return false;
+    }
+    if (DYNAMIC_CAST(malList, ast) && !seq->isEmpty()) {
+        malValuePtr op = seq->item(0);
+        if (isSymbol(op, "quote")) {
+            return false;
+        }
+        if ((seq->count() > 1) && isSymbol(seq->item(1), name.c_str()) &&
+            (isSymbol(op, "def!") || isSymbol(op, "defmacro!"))) {
+            return true;
+        }
+        if (!isSpecialForm(op) && (pristineIndex(op, scope) < 0)) {
+            return true;
+        }
+    }
+    for (auto it = seq->begin(), end = seq->end(); it != end; ++it) {
+        if (mayDefine(*it, name, scope)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static malValuePtr foldItems(const malSequence* seq, int start,
+                             const Scope& scope)
+{
+    malValueVec* items = new malValueVec(seq->begin(), seq->end());
+    for (int i = start; i < seq->count(); i++) {
+        (*items)[i] = fold(seq->item(i), scope);
+    }
+    return dynamic_cast<const malVector*>(seq) ? mal::vector(items)
+                                               : mal::list(items);
+}
+
+static malValuePtr foldLambda(malValuePtr ast, const Scope& scope)
+{
+    const malList* list = STATIC_CAST(malList, ast);
+    const malSequence* bindings = DYNAMIC_CAST(malSequence, list->item(1));
+    if (!bindings) {
+        return ast;
+    }
+    Scope inner(scope);
+    for (auto it = bindings->begin(), end = bindings->end(); it != end; ++it) {
+        if (const malSymbol* sym = DYNAMIC_CAST(malSymbol, *it)) {
+            inner.bind(sym->value());
+        }
+    }
+    return foldItems(list, 2, inner)->withMeta(foldedMarker());
+}
+
+static malValuePtr foldIf(malValuePtr ast, const Scope& scope)
+{
+    const malList* list = STATIC_CAST(malList, ast);
+    malValuePtr test = fold(list->item(1), scope);
+    malValuePtr value;
+    if (!constantValue(test, value)) {
+        malValueVec* items = new malValueVec(list->begin(), list->end());
+        (*items)[1] = test;
+        for (int i = 2; i < list->count(); i++) {
+            (*items)[i] = fold(list->item(i), scope);
+        }
+        return mal::list(items);
+    }
+
+    int branch = value->isTrue() ? 2 : 3;
+    malValuePtr chosen = (branch < list->count())
+                       ? fold(list->item(branch), scope)
+                       : mal::nilValue();
+    if (DYNAMIC_CAST(malFolded, test)) {
+        return guard(chosen, ast, usesOf(test));
+    }
+    return chosen;
+}
+
+static malValuePtr foldLet(malValuePtr ast, const Scope& scope)
+{
+    const malList* list = STATIC_CAST(malList, ast);
+    const malSequence* bindings = DYNAMIC_CAST(malSequence, list->item(1));
+    if (!bindings || (bindings->count() % 2 != 0)) {
+        return ast;
+    }
+
+    Scope inner(scope);
+    malValueVec* folded = new malValueVec(bindings->begin(), bindings->end());
+    for (int i = 0; i < bindings->count(); i += 2) {
+        const malSymbol* var = DYNAMIC_CAST(malSymbol, bindings->item(i));
+        if (!var) {
+            delete folded;
+            return ast;
+        }
+        malValuePtr init = fold(bindings->item(i+1), inner);
+        (*folded)[i+1] = init;
+
+        const String& name = var->value();
+        inner.bind(name);
+
+        // Only propagate if nothing later in the let* can rebind the name.
+        malValuePtr value;
+        bool redefined = mayDefine(list->item(2), name, inner);
+        for (int j = i + 3; !redefined && (j < bindings->count()); j += 2) {
+            redefined = mayDefine(bindings->item(j), name, inner);
+        }
+        if (!redefined && constantValue(init, value)) {
+            inner.constants[name] = init;
+        }
+    }
+
+    malValuePtr newBindings = dynamic_cast<const malVector*>(bindings)
+                            ? mal::vector(folded) : mal::list(folded);
+    return mal::list(list->item(0), newBindings, fold(list->item(2), inner));
+}
+
+static malValuePtr foldTry(malValuePtr ast, const Scope& scope)
+{
+    const malList* list = STATIC_CAST(malList, ast);
+    malValuePtr body = fold(list->item(1), scope);
+    if (list->count() != 3) {
+        return mal::list(list->item(0), body);
+    }
+
+    const malList* catchBlock = DYNAMIC_CAST(malList, list->item(2));
+    const malSymbol* excSym = (catchBlock && (catchBlock->count() == 3))
+                            ? DYNAMIC_CAST(malSymbol, catchBlock->item(1))
+                            : NULL;
+    if (!excSym) {
+        return mal::list(list->item(0), body, list->item(2));
+    }
+
+    Scope inner(scope);
+    inner.bind(excSym->value());
+    return mal::list(list->item(0), body, foldItems(catchBlock, 2, inner));
+}
+
+static malValuePtr foldCall(malValuePtr ast, const Scope& scope)
+{
+    const malList* list = STATIC_CAST(malList, ast);
+    // Only a pristine builtin's arguments are certain to be code: anything
+    // else may be a macro, now or once it has been defined.
+    int index = pristineIndex(list->item(0), scope);
+    if (index < 0) {
+        return ast;
+    }
+
+    malValuePtr rewritten = foldItems(list, 1, scope);
+    const malList* call = STATIC_CAST(malList, rewritten);
+    unsigned uses = 1u << index;
+    bool isChanged = false;
+    bool isConstant = true;
+    malValueVec args;
+    for (int i = 1; i < call->count(); i++) {
+        malValuePtr arg = call->item(i), value;
+        uses |= usesOf(arg);
+        isChanged = isChanged || (arg != list->item(i));
+        if (isConstant && constantValue(arg, value)) {
+            args.push_back(value);
+        }
+        else {
+            isConstant = false;
+        }
+    }
+
+    // Leave anything that fails for EVAL to report at run time.
+    if (isConstant) {
+        try {
+            malValuePtr op = scope.env->get(STATIC_CAST(malSymbol,
+                                            list->item(0))->value());
+            return guard(constantForm(APPLY(op, args.begin(), args.end())),
+                         ast, uses);
+        }
+        catch (String&) { }
+        catch (malValuePtr&) { }
+    }
+
+    // Once the builtin is redefined, perhaps as a macro, the call goes
+    // back to its original arguments.
+    return isChanged ? guard(rewritten, ast, uses) : ast;
+}
+
+static malValuePtr fold(malValuePtr ast, const Scope& scope)
+{
+    if (const malSymbol* sym = DYNAMIC_CAST(malSymbol, ast)) {
+        auto it = scope.constants.find(sym->value());
+        if (it == scope.constants.end()) {
+            return ast;
+        }
+        const malFolded* folded = DYNAMIC_CAST(malFolded, it->second);
+        return folded ? guard(folded->form(), ast, folded->uses())
+                      : it->second;
+    }
+    if (DYNAMIC_CAST(malVector, ast)) {
+        return foldItems(STATIC_CAST(malVector, ast), 0, scope);
+    }
+
+    const malList* list = DYNAMIC_CAST(malList, ast);
+    if (!list || list->isEmpty()) {
+        return ast;
+    }
+
+    if (const malSymbol* sym = DYNAMIC_CAST(malSymbol, list->item(0))) {
+        const String& special = sym->value();
+        int argCount = list->count() - 1;
+
+        if ((special == "quote") || (special == "quasiquote") ||
+            (special == "quasiquoteexpand") || (special == "macroexpand")) {
+            return ast;
+        }
+        if ((special == "def!") || (special == "defmacro!")) {
+            return (argCount == 2) ? foldItems(list, 2, scope) : ast;
+        }
+        if (special == "do") {
+            return foldItems(list, 1, scope);
+        }
+        if (special == "fn*") {
+            return (argCount == 2) ? foldLambda(ast, scope) : ast;
+        }
+        if (special == "if") {
+            return ((argCount == 2) || (argCount == 3))
+                 ? foldIf(ast, scope) : ast;
+        }
+        if (special == "let*") {
+            return (argCount == 2) ? foldLet(ast, scope) : ast;
+        }
+        if (special == "try*") {
+            return ((argCount == 1) || (argCount == 2))
+                 ? foldTry(ast, scope) : ast;
+        }
+    }
+    return foldCall(ast, scope);
+}
+
+malValuePtr foldLambdaBody(malValuePtr fnForm, const StringVec& params,
+                           malEnvPtr env)
+{
+    const malList* list = STATIC_CAST(malList, fnForm);
+    if (!foldingEnabled() || (list->meta() == foldedMarker())) {
+        // Already folded as part of an enclosing lambda.
+        return list->item(2);
+    }
+
+    Scope scope;
+    scope.env = env;
+    for (auto it = params.begin(), end = params.end(); it != end; ++it) {
+        scope.bind(*it);
+    }
+    return fold(list->item(2), scope);
+}
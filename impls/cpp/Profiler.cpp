@@ -0,0 +1,165 @@
+#include "Profiler.h"
+#include "MAL.h"
+
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include <set>
+#include <stdio.h>
+#include <sys/time.h>
+#include <vector>
+
+std::atomic<bool> Profiler::s_isActive(false);
+std::atomic<int> Profiler::s_trackers(0);
+thread_local Profiler::ShadowStack Profiler::s_stack;
+__thread Profiler::ShadowStack* Profiler::s_switched = NULL;
+
+namespace {
+    //  Samples are appended by the signal handler on whichever thread was
+    //  interrupted, so space is claimed with a single atomic add. Each
+    //  sample is its depth followed by its frames, outermost first.
+    struct SampleBuffer {
+        static const size_t Capacity = 1 << 20;
+
+        SampleBuffer() : used(0), end(Capacity), inHandler(0) { }
+
+        const char*         entries[Capacity];
+        std::atomic<size_t> used;
+        std::atomic<size_t> end;    // where the first sample which
+                                    // didn't fit would have started
+        std::atomic<int>    inHandler;
+    };
+}
+
+static SampleBuffer* s_samples = NULL;
+
+const char* Profiler::intern(const String& name)
+{
+    static std::mutex lock;
+    static std::set<String>* names = new std::set<String>;
+    std::lock_guard<std::mutex> guard(lock);
+    return names->insert(name).first->c_str();
+}
+
+Profiler::ShadowStack* Profiler::switchStack(ShadowStack* stack)
+{
+    ShadowStack* previous = s_switched;
+    // The handler must see either stack whole.
+    std::atomic_signal_fence(std::memory_order_release);
+    s_switched = stack;
+    std::atomic_signal_fence(std::memory_order_release);
+    return previous;
+}
+
+void Profiler::enter(const char* name, int& saved)
+{
+    ShadowStack& stack = current();
+    if (saved < 0) {
+        saved = stack.depth;
+    }
+    if (saved < MaxDepth) {
+        stack.frames[saved] = name;
+    }
+    // The handler may run between any two instructions, but only on this
+    // thread, so it must not see the depth before the frame.
+    std::atomic_signal_fence(std::memory_order_release);
+    stack.depth = saved + 1;
+}
+
+void Profiler::sample(int)
+{
+    SampleBuffer* samples = s_samples;
+    if (!samples) {
+        return;
+    }
+    samples->inHandler++;
+    if (isActive()) {
+        const ShadowStack& stack = current();
+        int depth = stack.depth;
+        if (depth > MaxDepth) {
+            depth = MaxDepth;
+        }
+        std::atomic_signal_fence(std::memory_order_acquire);
+
+        size_t start = samples->used.fetch_add(depth + 1);
+        if (start + depth + 1 <= SampleBuffer::Capacity) {
+            samples->entries[start] = reinterpret_cast<const char*>(depth);
+            for (int i = 0; i < depth; i++) {
+                samples->entries[start + 1 + i] = stack.frames[i];
+            }
+        }
+        else {
+            size_t end = samples->end.load();
+            while ((start < end) &&
+                   !samples->end.compare_exchange_weak(end, start)) {
+            }
+        }
+    }
+    samples->inHandler--;
+}
+
+void Profiler::start(int intervalUs)
+{
+    MAL_CHECK(!isActive(), "the profiler is already running");
+    MAL_CHECK(intervalUs > 0, "the sampling interval must be positive");
+
+    if (!s_samples) {
+        s_samples = new SampleBuffer;
+    }
+    s_samples->used = 0;
+    s_samples->end = SampleBuffer::Capacity;
+
+    struct sigaction action;
+    action.sa_handler = &Profiler::sample;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGPROF, &action, NULL);
+
+    s_isActive = true;
+    addTracker();
+    struct itimerval timer;
+    timer.it_interval.tv_sec = intervalUs / 1000000;
+    timer.it_interval.tv_usec = intervalUs % 1000000;
+    timer.it_value = timer.it_interval;
+    setitimer(ITIMER_PROF, &timer, NULL);
+}
+
+int Profiler::stop(const String& path)
+{
+    MAL_CHECK(isActive(), "the profiler isn't running");
+
+    struct itimerval timer = { { 0, 0 }, { 0, 0 } };
+    setitimer(ITIMER_PROF, &timer, NULL);
+    s_isActive = false;
+    removeTracker();
+    // A handler which had already started on another thread finishes
+    // writing its sample.
+    while (s_samples->inHandler.load() > 0) {
+    }
+
+    std::map<String, int> stacks;
+    int count = 0;
+    const size_t used = std::min(s_samples->used.load(),
+                                 s_samples->end.load());
+    for (size_t i = 0; i < used; count++) {
+        int depth = static_cast<int>(
+            reinterpret_cast<intptr_t>(s_samples->entries[i]));
+        String stack;
+        for (int j = 0; j < depth; j++) {
+            if (j > 0) {
+                stack += ';';
+            }
+            stack += s_samples->entries[i + 1 + j];
+        }
+        stacks[depth ? stack : "(top level)"]++;
+        i += depth + 1;
+    }
+
+    FILE* out = fopen(path.c_str(), "w");
+    MAL_CHECK(out != NULL, "Cannot open %s", path.c_str());
+    for (auto it = stacks.begin(), end = stacks.end(); it != end; ++it) {
+        fprintf(out, "%s %d\n", it->first.c_str(), it->second);
+    }
+    fclose(out);
+    return count;
+}
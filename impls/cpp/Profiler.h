@@ -0,0 +1,114 @@
+#ifndef INCLUDE_PROFILER_H
+#define INCLUDE_PROFILER_H
+
+#include "Hooks.h"
+#include "String.h"
+
+#include <atomic>
+#include <signal.h>
+
+//  A sampling profiler for mal code. While it runs, each thread keeps a
+//  shadow stack of the lambdas and builtins it is in, and a SIGPROF timer
+//  copies the interrupted thread's shadow stack into a buffer. Stopping
+//  it writes one "outer;inner count" line per distinct stack, which is
+//  the folded format flamegraph.pl and speedscope read.
+//
+//  Lambdas are named after the first symbol def! binds them to.
+class Profiler {
+public:
+    static bool isActive() {
+        return s_isActive.load(std::memory_order_relaxed);
+    }
+
+    //  Whether threads are keeping their shadow stacks, which they do
+    //  while anything is tracking them.
+    static bool isTracking() { return Hooks::isOn(Hooks::Profiling); }
+    static void addTracker() {
+        if (s_trackers++ == 0) {
+            Hooks::turnOn(Hooks::Profiling);
+        }
+    }
+    static void removeTracker() {
+        if (--s_trackers == 0) {
+            Hooks::turnOff(Hooks::Profiling);
+        }
+    }
+
+    static const int MaxDepth = 256;
+
+    //  Only the outermost MaxDepth frames are kept.
+    struct ShadowStack {
+        ShadowStack() : depth(0) { }
+
+        volatile int depth;
+        const char*  frames[MaxDepth];
+    };
+
+    //  The current thread's shadow stack, outermost frame first. Only the
+    //  outermost MaxDepth frames are kept.
+    static int stack(const char* const*& frames) {
+        const ShadowStack& stack = current();
+        int depth = stack.depth;
+        frames = stack.frames;
+        return (depth < MaxDepth) ? depth : MaxDepth;
+    }
+
+    //  Makes stack the one the current thread's calls go on, or its own if
+    //  stack is NULL, and returns the one it replaces. Each task has a
+    //  stack of its own, which is switched in whenever it runs.
+    static ShadowStack* switchStack(ShadowStack* stack);
+
+    static void start(int intervalUs);
+
+    //  Stops sampling and writes the samples to path, returning how many
+    //  there were.
+    static int stop(const String& path);
+
+    //  A copy of name which lives as long as the process, for samples to
+    //  refer to.
+    static const char* intern(const String& name);
+
+    //  Makes name the entry at depth saved, or at the top of the stack if
+    //  saved is negative, and sets saved to its depth.
+    static void enter(const char* name, int& saved);
+    static void leave(int saved) { current().depth = saved; }
+
+private:
+    static ShadowStack& current() {
+        ShadowStack* stack = s_switched;
+        return stack ? *stack : s_stack;
+    }
+
+    static void sample(int signal);
+
+    static std::atomic<bool> s_isActive;
+    static std::atomic<int> s_trackers;
+    static thread_local ShadowStack s_stack;
+    static __thread ShadowStack* s_switched;
+};
+
+//  A function call on the shadow stack, for as long as it is in scope. A
+//  tail call re-enters the same frame rather than pushing another one.
+class ProfileFrame {
+public:
+    ProfileFrame() : m_saved(-1) { }
+    ~ProfileFrame() {
+        if (m_saved >= 0) {
+            Profiler::leave(m_saved);
+        }
+    }
+
+    void enter(const char* name) {
+        if (Profiler::isTracking()) {
+            Profiler::enter(name, m_saved);
+        }
+    }
+
+private:
+    ProfileFrame(const ProfileFrame&); // no copy ctor
+    ProfileFrame& operator = (const ProfileFrame&); // no assignments
+
+    int m_saved;
+};
+
+#endif // INCLUDE_PROFILER_H
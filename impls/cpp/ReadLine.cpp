@@ -1,18 +1,28 @@
 #include "ReadLine.h"
 #include "String.h"
 
+#include <errno.h>
+#include <ctype.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <unistd.h>
 
+#include <algorithm>
+
 #include <readline/readline.h>
 #include <readline/history.h>
 #include <readline/tilde.h>
 
 ReadLine::ReadLine(const String& historyFile)
-: m_historyPath(copyAndFree(tilde_expand(historyFile.c_str())))
+: m_isInteractive(isatty(STDIN_FILENO))
+, m_pos(0)
+, m_isEof(false)
 {
-    read_history(m_historyPath.c_str());
+    if (m_isInteractive) {
+        m_historyPath = copyAndFree(tilde_expand(historyFile.c_str()));
+        read_history(m_historyPath.c_str());
+    }
 }
 
 ReadLine::~ReadLine()
@@ -21,6 +31,24 @@ ReadLine::~ReadLine()
 
 bool ReadLine::get(const String& prompt, String& out)
 {
+    if (!m_isInteractive) {
+        fputs(prompt.c_str(), stdout);
+        String::size_type end;
+        while ((end = m_buffer.find('\n', m_pos)) == String::npos) {
+            if (!fill()) {
+                if (m_pos == m_buffer.size()) {
+                    return false;
+                }
+                end = m_buffer.size();
+                break;
+            }
+        }
+        out = m_buffer.substr(m_pos, end - m_pos);
+        m_pos = std::min(end + 1, m_buffer.size());
+        echo(out);
+        return true;
+    }
+
     char *line = readline(prompt.c_str());
     if (line == NULL) {
         return false;
@@ -33,3 +61,160 @@ bool ReadLine::get(const String& prompt, String& out)
 
     return true;
 }
+
+static bool isDelimiter(char c)
+{
+    return isspace((unsigned char)c) || (strchr("[]{}()'\"`,;", c) != NULL);
+}
+
+//  Skips whitespace and comments, returning where the next token starts,
+//  or the size of text if there isn't one yet.
+static String::size_type skipBlanks(const String& text, String::size_type i)
+{
+    String::size_type size = text.size();
+    while (i < size) {
+        char c = text[i];
+        if (c == ';') {
+            i = text.find('\n', i);
+            if (i == String::npos) {
+                return size;
+            }
+        }
+        else if (!isspace((unsigned char)c) && (c != ',')) {
+            return i;
+        }
+        i++;
+    }
+    return size;
+}
+
+//  Finds the first form in text after from, returning false if it needs
+//  more input. This only tracks what the reader needs to know where a
+//  form stops: brackets, strings, comments and reader macros. Anything
+//  else wrong with the form is left for the reader to report.
+static bool findForm(const String& text, String::size_type from,
+                     String::size_type& start, String::size_type& end)
+{
+    int depth = 0;
+    int needed = 1; // forms still to come at the top level
+    String::size_type size = text.size();
+    start = skipBlanks(text, from);
+    for (String::size_type i = start; (i = skipBlanks(text, i)) < size; ) {
+        char c = text[i];
+
+        bool isElement = false;
+        if (c == '"') {
+            for (i++; (i < size) && (text[i] != '"'); i++) {
+                if (text[i] == '\\') {
+                    i++;
+                }
+            }
+            if (i >= size) {
+                return false;
+            }
+            i++;
+            isElement = true;
+        }
+        else if ((c == '(') || (c == '[') || (c == '{')) {
+            depth++;
+            i++;
+        }
+        else if ((c == ')') || (c == ']') || (c == '}')) {
+            // An unmatched close is a form for the reader to reject.
+            depth = std::max(depth - 1, 0);
+            i++;
+            isElement = true;
+        }
+        else if ((c == '\'') || (c == '`') || (c == '~') || (c == '@')) {
+            // These wrap the form which follows them.
+            i++;
+        }
+        else if (c == '^') {
+            // This one wraps the two forms which follow it.
+            if (depth == 0) {
+                needed++;
+            }
+            i++;
+        }
+        else {
+            while ((i < size) && !isDelimiter(text[i])) {
+                i++;
+            }
+            if (i >= size) {
+                return false; // the token may go on
+            }
+            isElement = true;
+        }
+
+        if (isElement && (depth == 0) && (--needed == 0)) {
+            end = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool ReadLine::getForm(const String& prompt, String& form)
+{
+    if (m_isInteractive) {
+        return get(prompt, form);
+    }
+
+    fputs(prompt.c_str(), stdout);
+    String::size_type start, end;
+    while (!findForm(m_buffer, m_pos, start, end)) {
+        if (!fill()) {
+            // Whatever is left is incomplete, so let the reader say so.
+            start = skipBlanks(m_buffer, m_pos);
+            if (start == m_buffer.size()) {
+                m_pos = start;
+                return false;
+            }
+            end = m_buffer.size();
+            break;
+        }
+    }
+    form = m_buffer.substr(start, end - start);
+    m_pos = end;
+    // The rest of the line goes with the form if there's nothing else on
+    // it, so that get() then reads the next line, as it would after
+    // readline.
+    String::size_type eol = m_buffer.find('\n', end);
+    if ((eol != String::npos) && (skipBlanks(m_buffer, end) > eol)) {
+        m_pos = eol + 1;
+    }
+    echo(form);
+    return true;
+}
+
+//  Appends what stdin has to the buffer, returning false at the end of
+//  the input. Anything written so far is flushed before waiting, in case
+//  whatever is on the other end of the pipe is waiting for it.
+bool ReadLine::fill()
+{
+    if (m_isEof) {
+        return false;
+    }
+    fflush(stdout);
+    m_buffer.erase(0, m_pos);
+    m_pos = 0;
+    char buffer[65536];
+    for (;;) {
+        ssize_t n = read(STDIN_FILENO, buffer, sizeof(buffer));
+        if ((n < 0) && (errno == EINTR)) {
+            continue;
+        }
+        if (n <= 0) {
+            m_isEof = true;
+            return false;
+        }
+        m_buffer.append(buffer, n);
+        return true;
+    }
+}
+
+void ReadLine::echo(const String& input)
+{
+    fwrite(input.data(), 1, input.size(), stdout);
+    fputc('\n', stdout);
+}
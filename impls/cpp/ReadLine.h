@@ -3,6 +3,11 @@
 
 #include "String.h"
 
+//  Reads input through GNU readline, with history, when stdin is a
+//  terminal. Otherwise, as when a file is piped in, stdin is read a
+//  buffer at a time and history is left alone; the prompt and the input
+//  are still written to stdout, as readline would, so that the transcript
+//  is the same either way.
 class ReadLine {
 public:
     ReadLine(const String& historyFile);
@@ -10,8 +15,20 @@ public:
 
     bool get(const String& prompt, String& line);
 
+    //  Like get(), but reads a whole form, which may span lines, when
+    //  stdin isn't a terminal. Several forms on one line are returned one
+    //  at a time.
+    bool getForm(const String& prompt, String& form);
+
 private:
+    bool fill();
+    void echo(const String& input);
+
     String m_historyPath;
+    bool   m_isInteractive;
+    String m_buffer;    // read from stdin
+    String::size_type m_pos; // where what hasn't been returned starts
+    bool   m_isEof;
 };
 
 #endif // INCLUDE_READLINE_H
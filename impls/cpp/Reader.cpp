@@ -1,4 +1,5 @@
 #include "MAL.h"
+#include "EvalStack.h"
 #include "Types.h"
 
 #include <regex>
@@ -129,6 +130,7 @@ malValuePtr readStr(const String& input)
 
 static malValuePtr readForm(Tokeniser& tokeniser)
 {
+    EvalStack::check();
     MAL_CHECK(!tokeniser.eof(), "expected form, got EOF");
     String token = tokeniser.peek();
 
@@ -2,22 +2,72 @@
 #define INCLUDE_REFCOUNTEDPTR_H
 
 #include "Debug.h"
+#include "Tracer.h"
 
 #include <cstddef>
 
+//  Counts start out as plain integers. A thread which shares objects with
+//  others counts atomically from when it calls shareBetweenThreads(),
+//  which it does before handing any of them over: starting the thread
+//  pool does, and so do the pool's workers and the REPL server's sessions
+//  as they start. Any other thread only ever sees objects of its own, so
+//  it goes on counting plainly. Immortal objects may be seen by any thread
+//  and are never freed, so their counts are never updated.
 class RefCounted {
 public:
     RefCounted() : m_refCount(0) { }
     virtual ~RefCounted() { }
 
-    const RefCounted* acquire() const { m_refCount++; return this; }
-    int release() const { return --m_refCount; }
-    int refCount() const { return m_refCount; }
+    //  Until a thread shares objects, its mortal objects are only seen by
+    //  it, and nothing writes to an immortal one, so its counts are read
+    //  and written plainly. That also lets the compiler cancel out an
+    //  acquire and a release of the same object.
+    const RefCounted* acquire() const {
+        if (!isShared()) {
+            if (m_refCount < Immortal) {
+                m_refCount++;
+            }
+        }
+        else if (refCount() < Immortal) {
+            __atomic_fetch_add(&m_refCount, 1, __ATOMIC_RELAXED);
+        }
+        return this;
+    }
+
+    int release() const {
+        if (!isShared()) {
+            return (m_refCount < Immortal) ? --m_refCount : m_refCount;
+        }
+        int count = refCount();
+        if (count >= Immortal) {
+            return count;
+        }
+        return __atomic_sub_fetch(&m_refCount, 1, __ATOMIC_ACQ_REL);
+    }
+
+    int refCount() const {
+        return __atomic_load_n(&m_refCount, __ATOMIC_RELAXED);
+    }
+
+    bool isImmortal() const { return refCount() >= Immortal; }
+    void markImmortal() const {
+        __atomic_store_n(&m_refCount, 2 * Immortal, __ATOMIC_RELAXED);
+    }
+
+    //  Whether the calling thread counts atomically.
+    static bool isShared() { return s_isShared; }
+    static void shareBetweenThreads() { s_isShared = true; }
 
 private:
     RefCounted(const RefCounted&); // no copy ctor
     RefCounted& operator = (const RefCounted&); // no assignments
 
+    // Far enough from zero that racing updates can't bring it back down.
+    static const int Immortal = 1 << 28;
+    // __thread rather than thread_local, which would check whether it
+    // needs initialising on every read from another file.
+    static __thread bool s_isShared;
+
     mutable int m_refCount;
 };
 
@@ -32,11 +82,25 @@ public:
     RefCountedPtr(const RefCountedPtr& rhs) : m_object(0)
     { acquire(rhs.m_object); }
 
+    //  Moving hands the reference over, so a temporary being returned,
+    //  stored or pushed onto a vector costs no count at all.
+    RefCountedPtr(RefCountedPtr&& rhs) noexcept : m_object(rhs.m_object)
+    { rhs.m_object = 0; }
+
     const RefCountedPtr& operator = (const RefCountedPtr& rhs) {
         acquire(rhs.m_object);
         return *this;
     }
 
+    const RefCountedPtr& operator = (RefCountedPtr&& rhs) noexcept {
+        // Freeing the old object may free whatever held rhs.
+        T* object = rhs.m_object;
+        rhs.m_object = 0;
+        release();
+        m_object = object;
+        return *this;
+    }
+
     bool operator == (const RefCountedPtr& rhs) const {
         return m_object == rhs.m_object;
     }
@@ -67,7 +131,7 @@ private:
 
     void release() {
         if ((m_object != NULL) && (m_object->release() == 0)) {
-            delete m_object;
+            Tracer::destroy(m_object);
         }
     }
 
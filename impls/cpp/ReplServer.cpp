@@ -0,0 +1,544 @@
+#include "ReplServer.h"
+#include "Environment.h"
+#include "EvalStack.h"
+#include "Interpreter.h"
+#include "Socket.h"
+#include "Types.h"
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+static const char* prompt = "user> ";
+
+// A client is dropped once it has sent this much which hasn't been
+// evaluated yet: a line this long, or lines arriving faster than they
+// can be evaluated.
+static const size_t maxInput = 1 << 20;
+
+// A client is dropped once this much of its output is waiting for it to
+// read it.
+static const size_t maxOutput = 16 << 20;
+
+namespace {
+    struct Loop;
+
+    //  A client's session. The event loop reads and writes its socket,
+    //  and its evaluator thread evaluates the lines it sends.
+    struct Session {
+        Session(Loop* loop, int fd, malEnvPtr root)
+        : loop(loop)
+        , fd(fd)
+        , interp(malInterpreter::create(malEnvPtr(new malEnv(root)), NULL))
+        , isClosing(false)
+        , isDead(false)
+        , isWatched(false)
+        , events(0)
+        , isDropped(false)
+        , queued(0)
+        , isEnding(false)
+        , isFinished(false)
+        , isReady(false)
+        , stack(NULL)
+        {
+        }
+
+        ~Session() {
+            close(fd);
+        }
+
+        Loop*             loop;
+        int               fd;
+        malInterpreterPtr interp;   // its futures hold on to it too
+        std::thread       evaluator;
+
+        // Only the event loop uses these.
+        String         input;       // the start of a line not yet queued
+        String         output;      // what the client hasn't read yet
+        bool           isClosing;   // the client has sent everything
+        bool           isDead;      // to be deleted after this batch
+        bool           isWatched;   // epoll has the socket
+        uint32_t       events;      // what epoll is watching for
+
+        // Shared with the evaluator, under lock. Only the loop changes
+        // isDropped, which is set once the client has gone or has broken
+        // a limit, so the loop reads it without the lock.
+        std::mutex              lock;
+        bool                    isDropped;
+        std::condition_variable wakeup;
+        std::deque<String>      lines;      // waiting to be evaluated
+        size_t                  queued;     // the total size of lines
+        String                  results;    // what the loop hasn't taken
+        bool                    isEnding;   // no more lines are coming
+        bool                    isFinished; // the evaluator has returned
+        bool                    isReady;    // guarded by loop->readyLock
+        EvalStack::Thread*      stack;      // the evaluator's, if running
+    };
+
+    //  The event loop, and the list of sessions whose evaluators have
+    //  something for it. An evaluator adds its session to the list and
+    //  writes to wakeFd, which epoll watches.
+    struct Loop {
+        int                    epoll;
+        int                    listener;
+        int                    wakeFd;
+        malEnvPtr              root;
+        ReplServer::Evaluator  evaluate;
+        int                    sessions;    // each with an evaluator
+        int                    maxSessions;
+        bool                   isAccepting; // epoll watches the listener
+
+        std::mutex             readyLock;
+        std::vector<Session*>  ready;
+        std::vector<Session*>  dead;
+    };
+}
+
+//  How many sessions can be open at once, from MAL_SERVER_SESSIONS. Each
+//  has a thread of its own, so once that many are open, the next client
+//  waits in the listen queue until one of them ends.
+static int maxSessions()
+{
+    int count = 64;
+    if (const char* env = getenv("MAL_SERVER_SESSIONS")) {
+        int n = atoi(env);
+        if (n > 0) {
+            count = n;
+        }
+    }
+    return count;
+}
+
+static bool isPort(const String& address)
+{
+    return !address.empty()
+        && (address.find_first_not_of("0123456789") == String::npos);
+}
+
+static int listenOn(const String& address)
+{
+    const int type = SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC;
+    if (!isPort(address)) {
+        return listenOnPath(address, type);
+    }
+
+    int port = atoi(address.c_str());
+    MAL_CHECK((port > 0) && (port < 65536), "%s isn't a port",
+              address.c_str());
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    int listener = socket(AF_INET, type, 0);
+    MAL_CHECK(listener >= 0, "Cannot create a socket: %s", strerror(errno));
+    int on = 1;
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    if ((bind(listener, (struct sockaddr*)&addr, sizeof(addr)) != 0) ||
+        (listen(listener, SOMAXCONN) != 0)) {
+        int error = errno;
+        close(listener);
+        MAL_FAIL("Cannot listen on %s: %s", address.c_str(), strerror(error));
+    }
+    return listener;
+}
+
+//  Hands the session to the event loop, unless it is already waiting.
+static void post(Session* session)
+{
+    Loop* loop = session->loop;
+    {
+        std::lock_guard<std::mutex> guard(loop->readyLock);
+        if (session->isReady) {
+            return;
+        }
+        session->isReady = true;
+        loop->ready.push_back(session);
+    }
+    uint64_t one = 1;
+    ssize_t n = write(loop->wakeFd, &one, sizeof(one));
+    (void)n; // the counter only fails to take it if it is nearly full
+}
+
+//  Evaluates the session's lines as they are queued, and posts what each
+//  one printed, its result and the next prompt back to the event loop.
+static void evaluateLines(Session* session)
+{
+    malInterpreter::Scope scope(session->interp.get());
+    malEnvPtr env = session->interp->env();
+    ReplServer::Evaluator evaluate = session->loop->evaluate;
+    for (;;) {
+        String line;
+        {
+            std::unique_lock<std::mutex> guard(session->lock);
+            session->wakeup.wait(guard, [session]() {
+                return !session->lines.empty() || session->isEnding;
+            });
+            if (session->lines.empty()) {
+                return;
+            }
+            line.swap(session->lines.front());
+            session->lines.pop_front();
+            session->queued -= line.size();
+        }
+
+        String out = evaluate(line, env);
+        String results = session->interp->takeOutput();
+        if (!out.empty()) {
+            results += out + "\n";
+        }
+        results += prompt;
+        {
+            std::lock_guard<std::mutex> guard(session->lock);
+            session->results += results;
+        }
+        post(session);
+    }
+}
+
+//  The evaluator thread. It is interrupted if the session is dropped, so
+//  a client can't leave it looping for ever.
+static void evaluatorMain(Session* session)
+{
+    RefCounted::shareBetweenThreads();
+    EvalStack::Thread stack = EvalStack::Thread::current();
+    {
+        std::lock_guard<std::mutex> guard(session->lock);
+        session->stack = &stack;
+        if (session->isDropped) {
+            stack.interrupt();
+        }
+    }
+    try {
+        EvalStack::run([session]() { evaluateLines(session); });
+    }
+    catch (...) {
+        // Only a failure outside evaluation, such as running out of
+        // memory, ends up here. The session just ends.
+    }
+    {
+        std::lock_guard<std::mutex> guard(session->lock);
+        session->stack = NULL;
+        session->isFinished = true;
+    }
+    post(session);
+}
+
+//  Queues each complete line of input for the evaluator, and the rest as
+//  well once the client has finished sending. Returns false if the
+//  client has more waiting than it is allowed.
+static bool queueLines(Session* session)
+{
+    std::lock_guard<std::mutex> guard(session->lock);
+    String::size_type start = 0;
+    for (;;) {
+        String::size_type end = session->input.find('\n', start);
+        if (end == String::npos) {
+            if (!session->isClosing || (start == session->input.size())) {
+                break;
+            }
+            end = session->input.size();
+        }
+        session->lines.push_back(session->input.substr(start, end - start));
+        session->queued += end - start;
+        start = std::min(end + 1, session->input.size());
+    }
+    session->input.erase(0, start);
+    if (session->isClosing) {
+        session->isEnding = true;
+    }
+    session->wakeup.notify_one();
+    return session->queued + session->input.size() <= maxInput;
+}
+
+//  Reads whatever the client has sent so far, returning false if the
+//  connection has failed or the client has sent too much.
+static bool readInput(Session* session)
+{
+    char buffer[65536];
+    for (;;) {
+        ssize_t n = read(session->fd, buffer, sizeof(buffer));
+        if (n > 0) {
+            session->input.append(buffer, n);
+            if (!queueLines(session)) {
+                return false;
+            }
+        }
+        else if (n == 0) {
+            session->isClosing = true;
+            queueLines(session);
+            return true;
+        }
+        else if (errno == EINTR) {
+            continue;
+        }
+        else {
+            return (errno == EAGAIN) || (errno == EWOULDBLOCK);
+        }
+    }
+}
+
+//  Sends as much output as the socket will take, returning false if the
+//  connection has failed.
+static bool writeOutput(Session* session)
+{
+    while (!session->output.empty()) {
+        ssize_t n = send(session->fd, session->output.data(),
+                         session->output.size(), MSG_NOSIGNAL);
+        if (n > 0) {
+            session->output.erase(0, n);
+        }
+        else if ((n < 0) && (errno == EINTR)) {
+            continue;
+        }
+        else {
+            return (n < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK));
+        }
+    }
+    return true;
+}
+
+//  Watches for input until the client has sent everything, and for the
+//  socket draining only while there is output waiting, so that an idle
+//  session doesn't wake the loop. epoll reports a hangup even when it is
+//  watching for nothing else.
+static void watch(int epoll, Session* session)
+{
+    uint32_t events = (session->isClosing ? 0 : (EPOLLIN | EPOLLRDHUP))
+                    | (session->output.empty() ? 0 : EPOLLOUT);
+    if (session->isWatched && (events == session->events)) {
+        return;
+    }
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = events;
+    event.data.ptr = session;
+    epoll_ctl(epoll, session->isWatched ? EPOLL_CTL_MOD : EPOLL_CTL_ADD,
+              session->fd, &event);
+    session->isWatched = true;
+    session->events = events;
+}
+
+static void unwatch(int epoll, Session* session)
+{
+    if (session->isWatched) {
+        epoll_ctl(epoll, EPOLL_CTL_DEL, session->fd, NULL);
+        session->isWatched = false;
+    }
+}
+
+//  Stops watching the client, and tells the evaluator to stop as soon as
+//  it can. The session is deleted once the evaluator has returned.
+static void drop(Loop& loop, Session* session)
+{
+    unwatch(loop.epoll, session);
+    shutdown(session->fd, SHUT_RDWR);
+    session->output.clear();
+
+    std::lock_guard<std::mutex> guard(session->lock);
+    session->isDropped = true;
+    session->isEnding = true;
+    session->lines.clear();
+    session->queued = 0;
+    if (session->stack) {
+        session->stack->interrupt();
+    }
+    session->wakeup.notify_one();
+}
+
+//  Sends the client whatever the evaluator has posted, and ends the
+//  session once the evaluator has returned and the client has read
+//  everything, or has gone.
+static void update(Loop& loop, Session* session)
+{
+    bool isFinished;
+    {
+        std::lock_guard<std::mutex> guard(session->lock);
+        if (!session->isDropped) {
+            session->output += session->results;
+        }
+        session->results.clear();
+        isFinished = session->isFinished;
+    }
+    if (!session->isDropped) {
+        if ((session->output.size() > maxOutput) || !writeOutput(session)) {
+            drop(loop, session);
+        }
+        else if (!isFinished || !session->output.empty()) {
+            watch(loop.epoll, session);
+            return;
+        }
+        else {
+            unwatch(loop.epoll, session);
+        }
+    }
+    if (isFinished && !session->isDead) {
+        session->isDead = true;
+        loop.dead.push_back(session);
+    }
+}
+
+//  Watches the listener only while there is room for another session.
+static void watchListener(Loop& loop)
+{
+    bool isAccepting = loop.sessions < loop.maxSessions;
+    if (isAccepting == loop.isAccepting) {
+        return;
+    }
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = isAccepting ? EPOLLIN : 0;
+    event.data.ptr = NULL;
+    epoll_ctl(loop.epoll, EPOLL_CTL_MOD, loop.listener, &event);
+    loop.isAccepting = isAccepting;
+}
+
+static void acceptSessions(Loop& loop)
+{
+    malInterpreter* server = malInterpreter::current();
+    while (loop.sessions < loop.maxSessions) {
+        int fd = accept4(loop.listener, NULL, NULL,
+                         SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if ((errno == EINTR) || (errno == ECONNABORTED)) {
+                continue;
+            }
+            return;
+        }
+        std::unique_ptr<Session> session(new Session(&loop, fd, loop.root));
+        if (server) {
+            // Forms folded while loading the prelude stay valid in the
+            // sessions, which can't redefine the root's builtins.
+            malInterpreter::FoldState& from = server->folding();
+            malInterpreter::FoldState& to = session->interp->folding();
+            to.isEnabled = from.isEnabled;
+            for (int i = 0; i < malInterpreter::FoldState::MaxFoldable; i++) {
+                to.epochs[i] = from.epochs[i].load();
+            }
+            to.pristine = from.pristine;
+        }
+
+        session->output = prompt;
+        if (writeOutput(session.get())) {
+            watch(loop.epoll, session.get());
+            Session* s = session.release();
+            s->evaluator = std::thread(evaluatorMain, s);
+            loop.sessions++;
+        }
+    }
+}
+
+void ReplServer::serve(const String& address, malEnvPtr root,
+                       Evaluator evaluate)
+{
+    // Every session's evaluator reads the root, which stays as the
+    // prelude left it.
+    RefCounted::shareBetweenThreads();
+    root->share();
+    malAtom::freezeExisting();
+
+    Loop loop;
+    loop.listener = listenOn(address);
+    loop.root = root;
+    loop.evaluate = evaluate;
+    loop.sessions = 0;
+    loop.maxSessions = maxSessions();
+    loop.isAccepting = true;
+    loop.epoll = epoll_create1(EPOLL_CLOEXEC);
+    loop.wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if ((loop.epoll < 0) || (loop.wakeFd < 0)) {
+        int error = errno;
+        close(loop.listener);
+        MAL_FAIL("Cannot create an epoll instance: %s", strerror(error));
+    }
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.ptr = NULL;
+    epoll_ctl(loop.epoll, EPOLL_CTL_ADD, loop.listener, &event);
+    event.data.ptr = &loop;
+    epoll_ctl(loop.epoll, EPOLL_CTL_ADD, loop.wakeFd, &event);
+
+    const uint32_t inputEvents = EPOLLIN | EPOLLRDHUP;
+    struct epoll_event events[64];
+    for (;;) {
+        int count = epoll_wait(loop.epoll, events, 64, -1);
+        if (count < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            int error = errno;
+            close(loop.epoll);
+            close(loop.listener);
+            MAL_FAIL("Cannot wait on %s: %s", address.c_str(), strerror(error));
+        }
+        for (int i = 0; i < count; i++) {
+            void* ptr = events[i].data.ptr;
+            if (!ptr) {
+                acceptSessions(loop);
+                continue;
+            }
+            if (ptr == &loop) {
+                uint64_t posts;
+                ssize_t n = read(loop.wakeFd, &posts, sizeof(posts));
+                (void)n;
+                std::vector<Session*> ready;
+                {
+                    std::lock_guard<std::mutex> guard(loop.readyLock);
+                    ready.swap(loop.ready);
+                    for (auto it = ready.begin(); it != ready.end(); ++it) {
+                        (*it)->isReady = false;
+                    }
+                }
+                for (auto it = ready.begin(); it != ready.end(); ++it) {
+                    update(loop, *it);
+                }
+                continue;
+            }
+
+            Session* session = static_cast<Session*>(ptr);
+            if (session->isDropped) {
+                continue;
+            }
+            // After a hangup nothing more can be sent to the client.
+            if (((events[i].events & inputEvents) && !readInput(session)) ||
+                (events[i].events & (EPOLLHUP | EPOLLERR))) {
+                drop(loop, session);
+                continue;
+            }
+            update(loop, session);
+        }
+
+        // Only now, as this batch of events may refer to them. The
+        // evaluator's last post may not have been seen yet.
+        for (auto it = loop.dead.begin(); it != loop.dead.end(); ++it) {
+            Session* session = *it;
+            session->evaluator.join();
+            {
+                std::lock_guard<std::mutex> guard(loop.readyLock);
+                if (session->isReady) {
+                    loop.ready.erase(std::find(loop.ready.begin(),
+                                               loop.ready.end(), session));
+                }
+            }
+            delete session;
+            loop.sessions--;
+        }
+        loop.dead.clear();
+        watchListener(loop);
+    }
+}
@@ -0,0 +1,45 @@
+#ifndef INCLUDE_REPLSERVER_H
+#define INCLUDE_REPLSERVER_H
+
+#include "MAL.h"
+
+//  Serves REPL sessions to any number of clients at once from one
+//  long-lived process. Each connection is a session with its own
+//  environment, a frame over the shared root, so whatever the root was
+//  given before serving (a prelude, say) is there for every session, while
+//  a session's own definitions are seen by it alone. eval and load-file
+//  define into the session too. The root is read-only from then on, and
+//  so are the atoms which existed when serving started.
+//
+//  A session works like the REPL: the server sends a prompt, and each line
+//  the client sends is evaluated, and answered with whatever it printed,
+//  its result and the next prompt. A last line without a newline is
+//  evaluated when the client shuts down its side of the connection.
+//
+//  One thread runs an epoll loop over non-blocking sockets, so a client
+//  which is slow to send a line or to read its output holds up no one.
+//  Each session evaluates its lines on a thread of its own, so a long
+//  computation holds up only the session it is in. A client which hangs
+//  up interrupts whatever its session was evaluating: one which closes a
+//  UNIX socket or resets a TCP connection does so at once, while closing
+//  a TCP connection only counts once output to it fails. A client which
+//  sends or leaves unread more than the server will buffer is dropped.
+//  MAL_SERVER_SESSIONS caps how many sessions are open at once (64 by
+//  default); a client connecting beyond that waits until one ends.
+//
+//  A socket left at a UNIX domain path by a server which has exited is
+//  replaced, but the server won't start over a live server's socket or
+//  any other file.
+class ReplServer {
+public:
+    //  Evaluates a line as the REPL does, returning what it prints.
+    typedef String (*Evaluator)(const String& input, malEnvPtr env);
+
+    //  Listens on address, which is a UNIX domain socket path, or a port
+    //  number on the loopback interface. Never returns, unless it can't
+    //  listen.
+    static void serve(const String& address, malEnvPtr root,
+                      Evaluator evaluate);
+};
+
+#endif // INCLUDE_REPLSERVER_H
@@ -0,0 +1,59 @@
+#include "Sink.h"
+
+#include <inttypes.h>
+#include <string.h>
+
+Sink::Sink()
+: m_file(NULL)
+{
+
+}
+
+Sink::Sink(FILE* file)
+: m_file(file)
+{
+    if (file) {
+        m_buffer.reserve(flushThreshold);
+    }
+}
+
+Sink::~Sink()
+{
+    flush();
+}
+
+Sink& Sink::operator << (const char* s)
+{
+    return append(s, strlen(s));
+}
+
+Sink& Sink::operator << (int64_t value)
+{
+    char buffer[24];
+    int length = snprintf(buffer, sizeof(buffer), "%" PRId64, value);
+    return append(buffer, length);
+}
+
+Sink& Sink::appendEscaped(const String& in)
+{
+    // Same rules as escape(), but without the intermediate string.
+    m_buffer += '"';
+    for (auto it = in.begin(), end = in.end(); it != end; ++it) {
+        char c = *it;
+        switch (c) {
+            case '\\': m_buffer += "\\\\"; break;
+            case '\n': m_buffer += "\\n"; break;
+            case '"':  m_buffer += "\\\""; break;
+            default:   m_buffer += c;      break;
+        };
+    }
+    return *this << '"';
+}
+
+void Sink::flush()
+{
+    if (m_file && !m_buffer.empty()) {
+        fwrite(m_buffer.data(), 1, m_buffer.size(), m_file);
+        m_buffer.clear();
+    }
+}
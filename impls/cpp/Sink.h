@@ -0,0 +1,50 @@
+#ifndef INCLUDE_SINK_H
+#define INCLUDE_SINK_H
+
+#include "String.h"
+
+#include <stdint.h>
+#include <stdio.h>
+
+//  An output buffer that values print themselves into. With no file it
+//  simply accumulates; with a file it flushes whenever the buffer fills
+//  and on destruction, so arbitrarily large output is never held in full.
+class Sink {
+public:
+    Sink();
+    Sink(FILE* file);
+    ~Sink();
+
+    Sink& append(const char* s, size_t length) {
+        m_buffer.append(s, length);
+        if (m_file && (m_buffer.size() >= flushThreshold)) {
+            flush();
+        }
+        return *this;
+    }
+
+    Sink& operator << (const String& s) {
+        return append(s.data(), s.size());
+    }
+
+    Sink& operator << (const char* s);
+    Sink& operator << (char c) { return append(&c, 1); }
+    Sink& operator << (int64_t value);
+
+    Sink& appendEscaped(const String& s);
+
+    void flush();
+
+    String& str() { return m_buffer; }
+
+private:
+    Sink(const Sink&); // no copy ctor
+    Sink& operator = (const Sink&); // no assignments
+
+    static const size_t flushThreshold = 64 * 1024;
+
+    String m_buffer;
+    FILE*  m_file;
+};
+
+#endif // INCLUDE_SINK_H
@@ -0,0 +1,50 @@
+#include "Socket.h"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+//  Removes the socket a server which has gone left behind at addr, but not
+//  any other kind of file, or the socket of one which is still listening.
+static void removeStaleSocket(const struct sockaddr_un& addr)
+{
+    struct stat st;
+    if ((lstat(addr.sun_path, &st) != 0) || !S_ISSOCK(st.st_mode)) {
+        return;
+    }
+    int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (probe < 0) {
+        return;
+    }
+    bool isStale = (connect(probe, (const struct sockaddr*)&addr,
+                            sizeof(addr)) != 0)
+                && (errno == ECONNREFUSED);
+    close(probe);
+    if (isStale) {
+        unlink(addr.sun_path);
+    }
+}
+
+int listenOnPath(const String& path, int type)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    MAL_CHECK(path.size() < sizeof(addr.sun_path),
+              "%s is too long for a socket path", path.c_str());
+    strcpy(addr.sun_path, path.c_str());
+
+    int listener = socket(AF_UNIX, type, 0);
+    MAL_CHECK(listener >= 0, "Cannot create a socket: %s", strerror(errno));
+    removeStaleSocket(addr);
+    if ((bind(listener, (struct sockaddr*)&addr, sizeof(addr)) != 0) ||
+        (listen(listener, SOMAXCONN) != 0)) {
+        int error = errno;
+        close(listener);
+        MAL_FAIL("Cannot listen on %s: %s", path.c_str(), strerror(error));
+    }
+    return listener;
+}
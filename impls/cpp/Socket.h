@@ -0,0 +1,13 @@
+#ifndef INCLUDE_SOCKET_H
+#define INCLUDE_SOCKET_H
+
+#include "MAL.h"
+
+//  Listens on a UNIX domain socket at path, returning the listening
+//  socket, made with type (SOCK_STREAM, and any of SOCK_NONBLOCK and
+//  SOCK_CLOEXEC). A socket left at path by a server which has exited is
+//  replaced, but not the socket of one which is still listening, nor any
+//  other kind of file: either is an address in use, and listening fails.
+extern int listenOnPath(const String& path, int type);
+
+#endif // INCLUDE_SOCKET_H
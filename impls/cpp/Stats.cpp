@@ -0,0 +1,159 @@
+#include "Stats.h"
+#include "HeapProfiler.h"
+
+#include <mutex>
+#include <new>
+#include <string.h>
+#include <vector>
+
+__thread Stats::Block* Stats::s_block = NULL;
+
+std::atomic<unsigned> Hooks::s_active(0);
+
+namespace {
+    struct Registry {
+        Registry() : classCount(0) {
+            memset(&baseline, 0, sizeof(baseline));
+        }
+
+        std::mutex                 lock;
+        std::vector<Stats::Block*> blocks;
+        std::vector<Stats::Block*> unowned;
+        const char*                classNames[Stats::MaxClasses];
+        std::atomic<int>           classCount;
+        Stats::Totals              baseline;
+    };
+
+    //  Gives the thread's block back when the thread exits.
+    struct Owner {
+        Owner(Stats::Block* block) : block(block) { }
+        ~Owner();
+
+        Stats::Block* block;
+    };
+}
+
+static Registry& registry()
+{
+    // Never destroyed, as threads may still be counting during exit.
+    static Registry* r = new Registry;
+    return *r;
+}
+
+Owner::~Owner()
+{
+    Registry& r = registry();
+    std::lock_guard<std::mutex> guard(r.lock);
+    r.unowned.push_back(block);
+}
+
+Stats::Block& Stats::attach()
+{
+    Registry& r = registry();
+    Block* b;
+    {
+        std::lock_guard<std::mutex> guard(r.lock);
+        if (!r.unowned.empty()) {
+            b = r.unowned.back();
+            r.unowned.pop_back();
+        }
+        else {
+            b = new Block();
+            r.blocks.push_back(b);
+        }
+    }
+    s_block = b;
+    static thread_local Owner owner(b);
+    return *b;
+}
+
+void* Stats::allocate(int index, size_t size)
+{
+    allocated(index, size);
+    if (void* p = HeapProfiler::allocate(size)) {
+        return p;
+    }
+    return ::operator new(size);
+}
+
+void Stats::release(int index, void* p, size_t size)
+{
+    freed(index, size);
+    if (HeapProfiler::owns(p)) {
+        HeapProfiler::release(p);
+        return;
+    }
+    ::operator delete(p);
+}
+
+int Stats::registerClass(const char* name)
+{
+    Registry& r = registry();
+    std::lock_guard<std::mutex> guard(r.lock);
+    int index = r.classCount.load();
+    if (index >= MaxClasses) {
+        // Lumped in with the last class.
+        return MaxClasses - 1;
+    }
+    r.classNames[index] = name;
+    r.classCount.store(index + 1);
+    return index;
+}
+
+int Stats::classCount()
+{
+    return registry().classCount.load();
+}
+
+const char* Stats::className(int index)
+{
+    return registry().classNames[index];
+}
+
+void Stats::readAll(Totals& totals)
+{
+    Registry& r = registry();
+    std::lock_guard<std::mutex> guard(r.lock);
+    memset(&totals, 0, sizeof(totals));
+    for (auto it = r.blocks.begin(), end = r.blocks.end(); it != end; ++it) {
+        const Block& b = **it;
+        for (int i = 0; i < CounterCount; i++) {
+            totals.counters[i] += b.counters[i].load();
+        }
+        for (int i = 0; i < MaxClasses; i++) {
+            totals.allocated[i] += b.allocated[i].load();
+            totals.freed[i] += b.freed[i].load();
+        }
+        totals.allocatedBytes += b.allocatedBytes.load();
+        totals.freedBytes += b.freedBytes.load();
+    }
+}
+
+void Stats::read(Totals& totals)
+{
+    readAll(totals);
+    Registry& r = registry();
+    std::lock_guard<std::mutex> guard(r.lock);
+    const Totals& base = r.baseline;
+    for (int i = 0; i < CounterCount; i++) {
+        totals.counters[i] -= base.counters[i];
+    }
+    for (int i = 0; i < MaxClasses; i++) {
+        totals.allocated[i] -= base.allocated[i];
+        totals.freed[i] -= base.freed[i];
+    }
+    totals.allocatedBytes -= base.allocatedBytes;
+    totals.freedBytes -= base.freedBytes;
+}
+
+void Stats::reset()
+{
+    // Threads only ever write to their own blocks, so rather than zero
+    // them, remember where they were.
+    Totals totals;
+    readAll(totals);
+    Registry& r = registry();
+    std::lock_guard<std::mutex> guard(r.lock);
+    r.baseline = totals;
+    Hooks::turnOn(Hooks::Counting);
+}
@@ -0,0 +1,116 @@
+#ifndef INCLUDE_STATS_H
+#define INCLUDE_STATS_H
+
+#include "HeapProfiler.h"
+#include "Hooks.h"
+
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+
+//  Interpreter counters. Each thread counts into a block of its own with
+//  plain loads and stores, and reading the stats sums the blocks of every
+//  thread there has been. Blocks outlive their threads, and are handed on
+//  to new ones.
+//
+//  Allocations are always counted. Calls are only counted once reset()
+//  has turned the call counters on, as they sit on the evaluation path.
+class Stats {
+public:
+    enum Counter {
+        EvalCalls,
+        EvalIterations,
+        MacroExpandCalls,
+        MacroExpansions,
+        BuiltinCalls,
+        LambdaCalls,
+        Exceptions,
+        CounterCount
+    };
+
+    static const int MaxClasses = 32;
+
+    struct Totals {
+        uint64_t    counters[CounterCount];
+        uint64_t    allocated[MaxClasses];
+        uint64_t    freed[MaxClasses];
+        uint64_t    allocatedBytes;
+        uint64_t    freedBytes;
+    };
+
+    static void count(Counter counter) {
+        if (Hooks::isOn(Hooks::Counting)) {
+            bump(block().counters[counter]);
+        }
+    }
+
+    //  The index of a class counted by COUNTED().
+    static int registerClass(const char* name);
+    static int classCount();
+    static const char* className(int index);
+
+    static void allocated(int index, size_t size) {
+        Block& b = block();
+        bump(b.allocated[index]);
+        bump(b.allocatedBytes, size);
+    }
+    static void freed(int index, size_t size) {
+        Block& b = block();
+        bump(b.freed[index]);
+        bump(b.freedBytes, size);
+    }
+
+    //  Counting versions of the global operator new and delete. They are
+    //  out of line so that the compiler pairs them with each other.
+    static void* allocate(int index, size_t size);
+    static void release(int index, void* p, size_t size);
+
+    //  Sums the counts of all threads, since the last reset.
+    static void read(Totals& totals);
+    //  The same, but since the process started.
+    static void readAll(Totals& totals);
+    //  Also turns the call counters on, from then on.
+    static void reset();
+
+    typedef std::atomic<uint64_t> Count;
+
+    struct Block {
+        Count counters[CounterCount];
+        Count allocated[MaxClasses];
+        Count freed[MaxClasses];
+        Count allocatedBytes;
+        Count freedBytes;
+    };
+
+private:
+    // Only the owning thread writes to a block.
+    static void bump(Count& count, uint64_t by = 1) {
+        count.store(count.load(std::memory_order_relaxed) + by,
+                    std::memory_order_relaxed);
+    }
+
+    static Block& block() {
+        Block* b = s_block;
+        return b ? *b : attach();
+    }
+    static Block& attach();
+
+    static __thread Block* s_block;
+};
+
+//  Counts the objects of a class as they are allocated and freed.
+#define COUNTED(Type) \
+    static int statsClass() { \
+        static const int index = Stats::registerClass(#Type); \
+        return index; \
+    } \
+    static void* operator new(size_t size) { \
+        static_assert(sizeof(Type) <= HeapProfiler::MaxSampledSize, \
+                      #Type " is too big for the heap profiler"); \
+        return Stats::allocate(statsClass(), size); \
+    } \
+    static void operator delete(void* p, size_t size) { \
+        Stats::release(statsClass(), p, size); \
+    }
+
+#endif // INCLUDE_STATS_H
@@ -0,0 +1,331 @@
+#include "Task.h"
+#include "EvalStack.h"
+#include "Profiler.h"
+#include "Types.h"
+
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+struct Task {
+    ucontext_t            context;
+    char*                 stack;
+    malValuePtr           fn;
+    malValuePtr           result;
+    bool                  isFinished;
+    Profiler::ShadowStack calls;    // what the profiler samples while it
+                                    // runs
+};
+
+// Stacks kept for reuse, rather than unmapped as soon as a task finishes.
+static const size_t MaxFreeStacks = 64;
+
+static size_t pageSize()
+{
+    static const size_t size = sysconf(_SC_PAGESIZE);
+    return size;
+}
+
+static size_t taskStackSize()
+{
+    size_t size = 1024 * 1024;
+    if (const char* env = getenv("MAL_TASK_STACK")) {
+        int kb = atoi(env);
+        if (kb > 0) {
+            size = kb * 1024;
+        }
+    }
+    return (size + pageSize() - 1) & ~(pageSize() - 1);
+}
+
+Channel::Channel(int capacity)
+: m_owner(&Scheduler::instance())
+, m_capacity(capacity)
+, m_isClosed(false)
+{
+}
+
+void Channel::checkOwner() const
+{
+    MAL_CHECK(m_owner == &Scheduler::instance(),
+              "channels can't be used from another thread");
+}
+
+bool Channel::popLive(std::deque<Waiter>& waiters, Waiter& waiter)
+{
+    while (!waiters.empty()) {
+        waiter = waiters.front();
+        waiters.pop_front();
+        if (!waiter.wait->isDone) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool Channel::tryPut(malValuePtr value, bool& isAccepted)
+{
+    isAccepted = !m_isClosed;
+    if (m_isClosed) {
+        return true;
+    }
+    Waiter taker;
+    if (popLive(m_takers, taker)) {
+        m_owner->complete(taker.wait, taker.index, value);
+        return true;
+    }
+    if ((int)m_buffer.size() < m_capacity) {
+        m_buffer.push_back(value);
+        return true;
+    }
+    return false;
+}
+
+bool Channel::tryTake(malValuePtr& value)
+{
+    Waiter putter;
+    if (!m_buffer.empty()) {
+        value = m_buffer.front();
+        m_buffer.pop_front();
+        // There's room for a pending put now.
+        if (popLive(m_putters, putter)) {
+            m_buffer.push_back(putter.value);
+            m_owner->complete(putter.wait, putter.index, mal::trueValue());
+        }
+        return true;
+    }
+    if (popLive(m_putters, putter)) {
+        value = putter.value;
+        m_owner->complete(putter.wait, putter.index, mal::trueValue());
+        return true;
+    }
+    if (m_isClosed) {
+        value = mal::nilValue();
+        return true;
+    }
+    return false;
+}
+
+void Channel::addPutter(const ChannelWaitPtr& wait, int index,
+                        malValuePtr value)
+{
+    Waiter putter = { wait, index, value };
+    m_putters.push_back(putter);
+}
+
+void Channel::addTaker(const ChannelWaitPtr& wait, int index)
+{
+    Waiter taker = { wait, index, NULL };
+    m_takers.push_back(taker);
+}
+
+void Channel::close()
+{
+    m_isClosed = true;
+    Waiter waiter;
+    while (popLive(m_takers, waiter)) {
+        m_owner->complete(waiter.wait, waiter.index, mal::nilValue());
+    }
+    while (popLive(m_putters, waiter)) {
+        m_owner->complete(waiter.wait, waiter.index, mal::falseValue());
+    }
+}
+
+int alts(const std::vector<ChannelOp>& ops, malValuePtr& value)
+{
+    Scheduler& scheduler = Scheduler::instance();
+    for (int i = 0, count = ops.size(); i < count; i++) {
+        const ChannelOp& op = ops[i];
+        op.channel->checkOwner();
+        bool isAccepted;
+        if (op.isPut ? op.channel->tryPut(op.value, isAccepted)
+                     : op.channel->tryTake(value)) {
+            if (op.isPut) {
+                value = mal::boolean(isAccepted);
+            }
+            scheduler.settle();
+            return i;
+        }
+    }
+
+    ChannelWaitPtr wait(new ChannelWait(scheduler.currentTask()));
+    for (int i = 0, count = ops.size(); i < count; i++) {
+        const ChannelOp& op = ops[i];
+        if (op.isPut) {
+            op.channel->addPutter(wait, i, op.value);
+        }
+        else {
+            op.channel->addTaker(wait, i);
+        }
+    }
+    scheduler.park(wait);
+    value = wait->value;
+    return wait->index;
+}
+
+Scheduler& Scheduler::instance()
+{
+    static thread_local Scheduler scheduler;
+    return scheduler;
+}
+
+Scheduler::Scheduler()
+: m_current(NULL)
+, m_stackSize(taskStackSize())
+{
+}
+
+Scheduler::~Scheduler()
+{
+    // Parked tasks can't be unwound, so whatever their stacks refer to
+    // is leaked along with them.
+    for (auto it = m_freeStacks.begin(), end = m_freeStacks.end();
+         it != end; ++it) {
+        munmap(*it - pageSize(), m_stackSize + pageSize());
+    }
+}
+
+char* Scheduler::allocateStack()
+{
+    if (!m_freeStacks.empty()) {
+        char* stack = m_freeStacks.back();
+        m_freeStacks.pop_back();
+        return stack;
+    }
+    const size_t guard = pageSize();
+    void* base = mmap(NULL, m_stackSize + guard, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK,
+                      -1, 0);
+    MAL_CHECK(base != MAP_FAILED, "can't allocate a task stack");
+    mprotect(base, guard, PROT_NONE);
+    return static_cast<char*>(base) + guard;
+}
+
+void Scheduler::freeStack(char* stack)
+{
+    if (m_freeStacks.size() < MaxFreeStacks) {
+        m_freeStacks.push_back(stack);
+    }
+    else {
+        munmap(stack - pageSize(), m_stackSize + pageSize());
+    }
+}
+
+malValuePtr Scheduler::go(malValuePtr fn)
+{
+    Task* task = new Task;
+    task->stack = allocateStack();
+    task->fn = fn;
+    task->result = new malChannel(std::make_shared<Channel>(1));
+    task->isFinished = false;
+
+    getcontext(&task->context);
+    task->context.uc_stack.ss_sp = task->stack;
+    task->context.uc_stack.ss_size = m_stackSize;
+    task->context.uc_link = &m_loop;
+    makecontext(&task->context, &Scheduler::taskMain, 0);
+
+    malValuePtr result = task->result;
+    m_ready.push_back(task);
+    settle();
+    return result;
+}
+
+void Scheduler::taskMain()
+{
+    Scheduler& scheduler = instance();
+    Task* task = scheduler.m_current;
+
+    // Nothing may be thrown past here, as there's no frame to unwind to.
+    malValuePtr value;
+    malValueVec args;
+    try {
+        value = APPLY(task->fn, args.begin(), args.end());
+    }
+    catch (malEmptyInputException&) {
+    }
+    catch (malValuePtr& mv) {
+        fprintf(stderr, "Error in task: %s\n", mv->print(true).c_str());
+    }
+    catch (String& s) {
+        fprintf(stderr, "Error in task: %s\n", s.c_str());
+    }
+    catch (std::exception& e) {
+        fprintf(stderr, "Error in task: %s\n", e.what());
+    }
+    catch (...) {
+        fprintf(stderr, "Error in task\n");
+    }
+
+    Channel* result = STATIC_CAST(malChannel, task->result)->channel().get();
+    bool isAccepted;
+    if (value && (value != mal::nilValue())) {
+        result->tryPut(value, isAccepted);
+    }
+    result->close();
+
+    value = NULL;
+    task->fn = NULL;
+    task->result = NULL;
+    task->isFinished = true;
+    // Returning switches to m_loop.
+}
+
+bool Scheduler::runOne()
+{
+    if (m_ready.empty()) {
+        return false;
+    }
+    Task* task = m_ready.front();
+    m_ready.pop_front();
+
+    m_current = task;
+    uintptr_t limit = EvalStack::setLimit(task->stack, m_stackSize);
+    Profiler::ShadowStack* calls = Profiler::switchStack(&task->calls);
+    swapcontext(&m_loop, &task->context);
+    Profiler::switchStack(calls);
+    EvalStack::restoreLimit(limit);
+    m_current = NULL;
+
+    if (task->isFinished) {
+        freeStack(task->stack);
+        delete task;
+    }
+    return true;
+}
+
+void Scheduler::park(const ChannelWaitPtr& wait)
+{
+    if (Task* task = m_current) {
+        swapcontext(&task->context, &m_loop);
+        return;
+    }
+    while (!wait->isDone) {
+        if (!runOne()) {
+            // Leave it stale in the channels it's waiting on.
+            wait->isDone = true;
+            MAL_FAIL("channel operation would block forever, "
+                     "as no task is ready to run");
+        }
+    }
+    settle();
+}
+
+void Scheduler::complete(const ChannelWaitPtr& wait, int index,
+                         malValuePtr value)
+{
+    wait->isDone = true;
+    wait->index = index;
+    wait->value = value;
+    if (wait->task) {
+        m_ready.push_back(wait->task);
+    }
+}
+
+void Scheduler::settle()
+{
+    if (!m_current) {
+        while (runOne()) {
+        }
+    }
+}
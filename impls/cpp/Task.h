@@ -0,0 +1,134 @@
+#ifndef INCLUDE_TASK_H
+#define INCLUDE_TASK_H
+
+#include "MAL.h"
+
+#include <deque>
+#include <memory>
+#include <ucontext.h>
+
+//  Lightweight tasks, which interleave on the thread that started them.
+//  Each task runs on a stack of its own, so it can block anywhere in EVAL:
+//  a task which takes from an empty channel is parked, and the thread
+//  runs other tasks until a put wakes it up.
+//
+//      (def! c (chan))
+//      (go (put! c (* 6 7)))
+//      (take! c)    ; => 42
+//
+//  Tasks only run while the thread's own code is waiting on them. go
+//  starts the new task straight away, and each channel operation made
+//  outside any task runs ready tasks until it completes and they have all
+//  parked again. If nothing is ready to run, it fails instead of hanging.
+//
+//  Stacks are reserved with MAP_NORESERVE, so a parked task only costs
+//  the pages it has touched. Each one has a guard page below it. The size
+//  is read from MAL_TASK_STACK, in KB, and defaults to 1MB.
+class Channel;
+class Scheduler;
+struct Task;
+
+//  One pending operation, which may be waiting on several channels. The
+//  first channel to complete it sets the result and wakes its task; it is
+//  then stale in the others, which drop it when they come across it.
+struct ChannelWait {
+    ChannelWait(Task* task) : task(task), isDone(false), index(-1) { }
+
+    Task*       task;   // NULL outside any task
+    bool        isDone;
+    int         index;  // which operation completed
+    malValuePtr value;  // what was taken, or whether a put succeeded
+};
+typedef std::shared_ptr<ChannelWait> ChannelWaitPtr;
+
+class Channel {
+public:
+    Channel(int capacity);
+
+    //  Completes a put straight away if it can, setting isAccepted to
+    //  false if the channel is closed. Returns false if it would block.
+    bool tryPut(malValuePtr value, bool& isAccepted);
+
+    //  Completes a take straight away if it can, taking nil if the
+    //  channel is closed and empty. Returns false if it would block.
+    bool tryTake(malValuePtr& value);
+
+    void addPutter(const ChannelWaitPtr& wait, int index, malValuePtr value);
+    void addTaker(const ChannelWaitPtr& wait, int index);
+
+    //  Pending takes get nil, and pending puts are refused.
+    void close();
+
+    //  Fails unless called on the thread which made the channel.
+    void checkOwner() const;
+
+private:
+    Channel(const Channel&); // no copy ctor
+    Channel& operator = (const Channel&); // no assignments
+
+    struct Waiter {
+        ChannelWaitPtr wait;
+        int            index;
+        malValuePtr    value;
+    };
+    static bool popLive(std::deque<Waiter>& waiters, Waiter& waiter);
+
+    Scheduler*              m_owner;
+    const int               m_capacity;
+    bool                    m_isClosed;
+    std::deque<malValuePtr> m_buffer;
+    std::deque<Waiter>      m_takers;
+    std::deque<Waiter>      m_putters;
+};
+
+//  One operation of an alts!: a take, or a put of value.
+struct ChannelOp {
+    Channel*    channel;
+    bool        isPut;
+    malValuePtr value;
+};
+
+//  Waits until the first of ops which can complete has done so, and
+//  returns its index. value is set as for ChannelWait.
+extern int alts(const std::vector<ChannelOp>& ops, malValuePtr& value);
+
+class Scheduler {
+public:
+    //  The calling thread's scheduler.
+    static Scheduler& instance();
+
+    ~Scheduler();
+
+    //  Starts a task which calls fn with no arguments. The returned
+    //  channel gets its result, unless that is nil, and is then closed.
+    malValuePtr go(malValuePtr fn);
+
+    //  Returns once wait is done. A task parks until then; elsewhere, the
+    //  ready tasks are run until one of them completes it.
+    void park(const ChannelWaitPtr& wait);
+
+    //  Marks wait as done, and queues its task to run.
+    void complete(const ChannelWaitPtr& wait, int index, malValuePtr value);
+
+    //  Outside a task, runs ready tasks until every one has parked.
+    void settle();
+
+    Task* currentTask() const { return m_current; }
+
+private:
+    Scheduler();
+
+    bool runOne();
+    char* allocateStack();
+    void freeStack(char* stack);
+
+    static void taskMain();
+
+    std::deque<Task*>  m_ready;
+    Task*              m_current;
+    ucontext_t         m_loop;
+    const size_t       m_stackSize;
+    std::vector<char*> m_freeStacks;
+};
+
+#endif // INCLUDE_TASK_H
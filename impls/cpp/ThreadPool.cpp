@@ -0,0 +1,167 @@
+#include "ThreadPool.h"
+
+#include <stdlib.h>
+
+// The index of the current thread's worker, or -1 for other threads.
+static thread_local int s_workerIndex = -1;
+
+static int poolSize()
+{
+    if (const char* env = getenv("MAL_THREADS")) {
+        int size = atoi(env);
+        if (size > 0) {
+            return size;
+        }
+    }
+    int cores = std::thread::hardware_concurrency();
+    return cores > 0 ? cores : 1;
+}
+
+ThreadPool* ThreadPool::s_instance = NULL;
+
+ThreadPool& ThreadPool::start()
+{
+    // Everything the workers can see from this thread is either counted
+    // atomically from now on, or isn't counted at all. Each thread which
+    // starts futures shares its objects, not just the first.
+    RefCounted::shareBetweenThreads();
+    static std::once_flag started;
+    std::call_once(started, []() {
+        // The pool itself is never destroyed, since futures which were
+        // never waited for may still hold it.
+        s_instance = new ThreadPool(poolSize());
+        atexit(&ThreadPool::stop);
+    });
+    return *s_instance;
+}
+
+ThreadPool::ThreadPool(int size)
+: m_isStopping(false)
+, m_queued(0)
+, m_nextWorker(0)
+{
+    for (int i = 0; i < size; i++) {
+        m_workers.push_back(std::unique_ptr<Worker>(new Worker));
+    }
+    for (int i = 0; i < size; i++) {
+        m_threads.push_back(std::thread(&ThreadPool::workerMain, this, i));
+    }
+}
+
+void ThreadPool::stop()
+{
+    ThreadPool* pool = s_instance;
+    if (!pool || (s_workerIndex >= 0)) {
+        // A worker can't wait for itself.
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> guard(pool->m_idleLock);
+        pool->m_isStopping = true;
+        for (auto it = pool->m_workers.begin(), end = pool->m_workers.end();
+             it != end; ++it) {
+            if ((*it)->stack) {
+                (*it)->stack->interrupt();
+            }
+        }
+        pool->m_idle.notify_all();
+    }
+    for (auto it = pool->m_threads.begin(), end = pool->m_threads.end();
+         it != end; ++it) {
+        if (it->joinable()) {
+            it->join();
+        }
+    }
+}
+
+void ThreadPool::submit(const Task& task)
+{
+    // Workers keep their own tasks, everybody else shares them out.
+    int index = s_workerIndex;
+    if (index < 0) {
+        index = m_nextWorker++ % m_workers.size();
+    }
+    m_queued++;
+    {
+        Worker& worker = *m_workers[index];
+        std::lock_guard<std::mutex> guard(worker.lock);
+        worker.tasks.push_back(task);
+    }
+
+    std::lock_guard<std::mutex> guard(m_idleLock);
+    m_idle.notify_one();
+}
+
+bool ThreadPool::popTask(int index, Task& task)
+{
+    if (m_queued.load() == 0) {
+        return false;
+    }
+
+    const int size = m_workers.size();
+    if (index >= 0) {
+        Worker& own = *m_workers[index];
+        std::lock_guard<std::mutex> guard(own.lock);
+        if (!own.tasks.empty()) {
+            task = own.tasks.back();
+            own.tasks.pop_back();
+            m_queued--;
+            return true;
+        }
+    }
+
+    // Steal the oldest task, starting with the next worker along.
+    for (int i = 1; i <= size; i++) {
+        Worker& victim = *m_workers[(index + i + size) % size];
+        std::lock_guard<std::mutex> guard(victim.lock);
+        if (!victim.tasks.empty()) {
+            task = victim.tasks.front();
+            victim.tasks.pop_front();
+            m_queued--;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool ThreadPool::runPending()
+{
+    Task task;
+    if (!popTask(s_workerIndex, task)) {
+        return false;
+    }
+    task();
+    return true;
+}
+
+void ThreadPool::workerMain(int index)
+{
+    s_workerIndex = index;
+    RefCounted::shareBetweenThreads();
+    EvalStack::Thread stack = EvalStack::Thread::current();
+    Worker& self = *m_workers[index];
+    {
+        std::lock_guard<std::mutex> guard(m_idleLock);
+        self.stack = &stack;
+        if (m_isStopping) {
+            stack.interrupt();
+        }
+    }
+
+    for (;;) {
+        Task task;
+        if (popTask(index, task)) {
+            task();
+            continue;
+        }
+
+        std::unique_lock<std::mutex> guard(m_idleLock);
+        if (m_isStopping) {
+            self.stack = NULL;
+            return;
+        }
+        m_idle.wait(guard, [this]() {
+            return (m_queued.load() > 0) || m_isStopping;
+        });
+    }
+}
@@ -0,0 +1,75 @@
+#ifndef INCLUDE_THREADPOOL_H
+#define INCLUDE_THREADPOOL_H
+
+#include "MAL.h"
+#include "EvalStack.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+//  The worker threads which run futures. Each worker has its own deque of
+//  tasks: it takes the newest task from its own deque, and when that is
+//  empty steals the oldest task from another worker. Threads which wait
+//  for a future run pending tasks in the meantime, so waiting on a future
+//  from inside another one never ties up a worker.
+//
+//  The pool is started by the first call to start(). Its size is read
+//  from MAL_THREADS, and defaults to the number of cores. It is stopped
+//  when the process exits: the workers are interrupted, so that futures
+//  still running or waiting to run fail with "Interrupted", and joined.
+class ThreadPool {
+public:
+    typedef std::function<void()> Task;
+
+    //  Starts the pool if necessary. Reference counts are updated
+    //  atomically from then on, in every thread; the frames a task can
+    //  see are shared with malEnv::share().
+    static ThreadPool& start();
+
+    //  The pool, which must have been started.
+    static ThreadPool& instance() { return *s_instance; }
+
+    int size() const { return m_workers.size(); }
+
+    void submit(const Task& task);
+
+    //  Runs one pending task on the calling thread, returning false if
+    //  there wasn't one.
+    bool runPending();
+
+    //  Interrupts the workers, lets them fail whatever has been submitted
+    //  and joins them. Does nothing if the pool was never started.
+    static void stop();
+
+private:
+    ThreadPool(int size);
+
+    struct Worker {
+        Worker() : stack(NULL) { }
+
+        std::mutex         lock;
+        std::deque<Task>   tasks;
+        EvalStack::Thread* stack;   // guarded by m_idleLock
+    };
+
+    static ThreadPool* s_instance;
+
+    void workerMain(int index);
+    bool popTask(int index, Task& task);
+
+    std::vector<std::unique_ptr<Worker>> m_workers;
+    std::vector<std::thread>             m_threads;
+
+    std::mutex              m_idleLock;
+    std::condition_variable m_idle;
+    bool                    m_isStopping;   // guarded by m_idleLock
+    std::atomic<int>        m_queued;
+    std::atomic<unsigned>   m_nextWorker;
+};
+
+#endif // INCLUDE_THREADPOOL_H
@@ -0,0 +1,258 @@
+#include "Tracer.h"
+#include "MAL.h"
+#include "RefCountedPtr.h"
+
+#include <algorithm>
+#include <mutex>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+namespace {
+    struct Event {
+        uint64_t    ns;
+        const char* category;   // NULL for an end
+        const char* name;
+        uint64_t    count;      // of objects freed, for a burst
+    };
+
+    //  Only the owning thread writes to a buffer, and the events are only
+    //  read once tracing has stopped. A buffer belongs to the run of the
+    //  tracer it was last written in, and its owner empties it when it
+    //  first records in a new one.
+    struct Buffer {
+        static const uint64_t Capacity = 1 << 16;
+
+        Buffer(int tid) : tid(tid), run(0), written(0) { }
+
+        int                   tid;
+        std::atomic<uint64_t> run;
+        std::atomic<uint64_t> written;
+        Event                 events[Capacity];
+    };
+
+    struct Registry {
+        Registry() : run(0), startNs(0) { }
+
+        std::mutex            lock;
+        std::vector<Buffer*>  buffers;
+        std::vector<Buffer*>  unowned;
+        std::atomic<uint64_t> run;
+        uint64_t              startNs;
+    };
+
+    //  Gives the thread's buffer back when the thread exits, for the next
+    //  thread to record into.
+    struct Owner {
+        Owner(Buffer* buffer) : buffer(buffer) { }
+        ~Owner();
+
+        Buffer* buffer;
+    };
+}
+
+//  Fewer objects than this being freed at once isn't worth an event.
+static const uint64_t BurstSize = 64;
+
+static thread_local Buffer* s_buffer = NULL;
+static thread_local bool s_hasExited = false;
+static thread_local int s_destroyDepth = 0;
+static thread_local uint64_t s_destroyed = 0;
+
+static Registry& registry()
+{
+    // Never destroyed, as threads may still be tracing during exit.
+    static Registry* r = new Registry;
+    return *r;
+}
+
+static uint64_t now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+Owner::~Owner()
+{
+    Registry& r = registry();
+    std::lock_guard<std::mutex> guard(r.lock);
+    r.unowned.push_back(buffer);
+    s_buffer = NULL;
+    s_hasExited = true;
+}
+
+//  NULL once the thread has given its buffer back, as it exits.
+static Buffer* buffer()
+{
+    if (!s_buffer && !s_hasExited) {
+        Registry& r = registry();
+        std::lock_guard<std::mutex> guard(r.lock);
+        if (!r.unowned.empty()) {
+            s_buffer = r.unowned.back();
+            r.unowned.pop_back();
+        }
+        else {
+            s_buffer = new Buffer(r.buffers.size() + 1);
+            r.buffers.push_back(s_buffer);
+        }
+        static thread_local Owner owner(s_buffer);
+    }
+    return s_buffer;
+}
+
+static void record(uint64_t ns, const char* category, const char* name,
+                   uint64_t count = 0)
+{
+    Buffer* buffered = buffer();
+    if (!buffered) {
+        return;
+    }
+    Buffer& b = *buffered;
+    const uint64_t run = registry().run.load(std::memory_order_relaxed);
+    uint64_t written = b.written.load(std::memory_order_relaxed);
+    if (b.run.load(std::memory_order_relaxed) != run) {
+        b.run.store(run, std::memory_order_relaxed);
+        written = 0;
+    }
+    Event& event = b.events[written % Buffer::Capacity];
+    event.ns = ns;
+    event.category = category;
+    event.name = name;
+    event.count = count;
+    b.written.store(written + 1, std::memory_order_release);
+}
+
+void Tracer::begin(const char* category, const char* name)
+{
+    record(now(), category, name);
+}
+
+void Tracer::end()
+{
+    if (isEnabled()) {
+        record(now(), NULL, NULL);
+    }
+}
+
+void Tracer::destroy(const RefCounted* object)
+{
+    if (isEnabled() || (s_destroyDepth > 0)) {
+        destroyTraced(object);
+    }
+    else {
+        delete object;
+    }
+}
+
+void Tracer::destroyTraced(const RefCounted* object)
+{
+    if (s_destroyDepth > 0) {
+        s_destroyDepth++;
+        s_destroyed++;
+        delete object;
+        s_destroyDepth--;
+        return;
+    }
+
+    uint64_t startNs = now();
+    s_destroyDepth = 1;
+    s_destroyed = 1;
+    delete object;
+    s_destroyDepth = 0;
+    if ((s_destroyed >= BurstSize) && isEnabled()) {
+        record(startNs, "free", "free");
+        record(now(), NULL, NULL, s_destroyed);
+    }
+}
+
+void Tracer::start()
+{
+    MAL_CHECK(!isEnabled(), "tracing is already on");
+
+    Registry& r = registry();
+    std::lock_guard<std::mutex> guard(r.lock);
+    // Each buffer is emptied by its own thread, so as not to race with it.
+    r.run++;
+    r.startNs = now();
+    Hooks::turnOn(Hooks::Tracing);
+}
+
+static void writeString(FILE* out, const char* s)
+{
+    fputc('"', out);
+    for (; *s; s++) {
+        unsigned char c = *s;
+        if ((c == '"') || (c == '\\')) {
+            fprintf(out, "\\%c", c);
+        }
+        else if (c < 0x20) {
+            fprintf(out, "\\u%04x", c);
+        }
+        else {
+            fputc(c, out);
+        }
+    }
+    fputc('"', out);
+}
+
+int Tracer::stop(const String& path)
+{
+    MAL_CHECK(isEnabled(), "tracing isn't on");
+    Hooks::turnOff(Hooks::Tracing);
+
+    FILE* out = fopen(path.c_str(), "w");
+    MAL_CHECK(out != NULL, "Cannot open %s", path.c_str());
+
+    Registry& r = registry();
+    std::lock_guard<std::mutex> guard(r.lock);
+    const int pid = getpid();
+    int count = 0;
+    fprintf(out, "{\"traceEvents\":[");
+    for (auto it = r.buffers.begin(), end = r.buffers.end(); it != end; ++it) {
+        const Buffer& b = **it;
+        if (b.run.load(std::memory_order_relaxed) != r.run.load()) {
+            continue;
+        }
+        const uint64_t written = b.written.load(std::memory_order_acquire);
+        const uint64_t first = (written > Buffer::Capacity)
+                             ? written - Buffer::Capacity : 0;
+        // An end whose begin was overwritten, or came before the start,
+        // has nothing to match.
+        int depth = 0;
+        for (uint64_t i = first; i < written; i++) {
+            const Event& event = b.events[i % Buffer::Capacity];
+            if (event.category) {
+                depth++;
+            }
+            else if (depth > 0) {
+                depth--;
+            }
+            else {
+                continue;
+            }
+            const uint64_t ns = std::max(event.ns, r.startNs) - r.startNs;
+            fprintf(out, "%s\n{\"ph\":\"%c\",\"ts\":%llu.%03llu,"
+                         "\"pid\":%d,\"tid\":%d",
+                    count ? "," : "", event.category ? 'B' : 'E',
+                    (unsigned long long)(ns / 1000),
+                    (unsigned long long)(ns % 1000), pid, b.tid);
+            if (event.category) {
+                fprintf(out, ",\"cat\":");
+                writeString(out, event.category);
+                fprintf(out, ",\"name\":");
+                writeString(out, event.name);
+            }
+            if (event.count) {
+                fprintf(out, ",\"args\":{\"objects\":%llu}",
+                        (unsigned long long)event.count);
+            }
+            fputc('}', out);
+            count++;
+        }
+    }
+    fprintf(out, "\n],\"displayTimeUnit\":\"ns\"}\n");
+    fclose(out);
+    return count;
+}
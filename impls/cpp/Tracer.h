@@ -0,0 +1,75 @@
+#ifndef INCLUDE_TRACER_H
+#define INCLUDE_TRACER_H
+
+#include "Hooks.h"
+#include "String.h"
+
+#include <atomic>
+#include <stdint.h>
+
+class RefCounted;
+
+//  Records timed begin and end events into a ring buffer per thread, to be
+//  written out as Chrome trace_event JSON, which chrome://tracing and
+//  Perfetto load. The events are calls to lambdas and builtins, macro
+//  expansions, and bursts of objects being freed. Each buffer keeps the
+//  most recent events only, and is handed on to a new thread when the one
+//  recording into it exits.
+//
+//  While tracing is off, each place which could record an event costs a
+//  single test of a flag.
+class Tracer {
+public:
+    static bool isEnabled() { return Hooks::isOn(Hooks::Tracing); }
+
+    static void start();
+
+    //  Stops tracing and writes the events to path, returning how many
+    //  there were.
+    static int stop(const String& path);
+
+    //  category and name must live as long as the process.
+    static void begin(const char* category, const char* name);
+    static void end();
+
+    //  Deletes an object whose count has reached zero, recording a burst
+    //  if it took many others with it. It is out of line so that releasing
+    //  a reference is small enough to inline everywhere.
+    static void destroy(const RefCounted* object);
+
+private:
+    static void destroyTraced(const RefCounted* object);
+};
+
+//  A traced span which lasts as long as it is in scope. Entering it again
+//  ends the previous span, as a tail call does.
+class TraceScope {
+public:
+    explicit TraceScope(const char* category)
+    : m_category(category), m_isOpen(false) { }
+
+    ~TraceScope() {
+        if (m_isOpen) {
+            Tracer::end();
+        }
+    }
+
+    void enter(const char* name) {
+        if (Tracer::isEnabled()) {
+            if (m_isOpen) {
+                Tracer::end();
+            }
+            Tracer::begin(m_category, name);
+            m_isOpen = true;
+        }
+    }
+
+private:
+    TraceScope(const TraceScope&); // no copy ctor
+    TraceScope& operator = (const TraceScope&); // no assignments
+
+    const char* m_category;
+    bool        m_isOpen;
+};
+
+#endif // INCLUDE_TRACER_H
@@ -1,11 +1,25 @@
 #include "Debug.h"
 #include "Environment.h"
+#include "EvalStack.h"
+#include "HeapProfiler.h"
+#include "Hooks.h"
+#include "Profiler.h"
+#include "ThreadPool.h"
+#include "Tracer.h"
 #include "Types.h"
 
 #include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <exception>
 #include <memory>
 #include <typeinfo>
 
+__thread bool RefCounted::s_isShared = false;
+
+std::atomic<uint64_t> malAtom::s_serial(0);
+std::atomic<uint64_t> malAtom::s_frozenBelow(0);
+
 namespace mal {
     malValuePtr atom(malValuePtr value) {
         return malValuePtr(new malAtom(value));
@@ -24,6 +38,10 @@ namespace mal {
         return malValuePtr(c);
     };
 
+    malValuePtr future(malValuePtr fn, const malValueVec& args) {
+        return malValuePtr(new malFuture(fn, args));
+    }
+
 
     malValuePtr hash(const malHash::Map& map) {
         return malValuePtr(new malHash(map));
@@ -46,6 +64,14 @@ namespace mal {
         return malValuePtr(new malKeyword(token));
     };
 
+    malValuePtr lazySeq(malLazySeq::Source* source) {
+        return malValuePtr(new malLazySeq(source));
+    }
+
+    malValuePtr lazySeq(malValuePtr first, malValuePtr more) {
+        return malValuePtr(new malLazySeq(first, more));
+    }
+
     malValuePtr lambda(const StringVec& bindings,
                        malValuePtr body, malEnvPtr env) {
         return malValuePtr(new malLambda(bindings, body, env));
@@ -93,10 +119,25 @@ namespace mal {
         return malValuePtr(new malString(token));
     }
 
+    malValuePtr string(String&& token) {
+        return malValuePtr(new malString(std::move(token)));
+    }
+
     malValuePtr symbol(const String& token) {
         return malValuePtr(new malSymbol(token));
     };
 
+    malValuePtr transducer(const malTransducer::Stages& stages) {
+        return malValuePtr(new malTransducer(stages));
+    }
+
+    malValuePtr transducer(malTransducer::Kind kind,
+                           malValuePtr fn, int64_t count) {
+        malTransducer::Stages stages;
+        stages.push_back(malTransducer::Stage(kind, fn, count));
+        return transducer(stages);
+    }
+
     malValuePtr trueValue() {
         static malValuePtr c(new malConstant("true"));
         return malValuePtr(c);
@@ -111,9 +152,27 @@ namespace mal {
     };
 };
 
+// Builtins are bound in every interpreter's root environment, so like the
+// constants they are never freed.
+malBuiltIn::malBuiltIn(const String& name, ApplyFunc* handler)
+: m_name(name)
+, m_profileName(Profiler::intern(name))
+, m_handler(handler)
+{
+    markImmortal();
+}
+
 malValuePtr malBuiltIn::apply(malValueIter argsBegin,
                               malValueIter argsEnd) const
 {
+    if (!Hooks::any()) {
+        return m_handler(m_name, argsBegin, argsEnd);
+    }
+    Stats::count(Stats::BuiltinCalls);
+    ProfileFrame frame;
+    frame.enter(m_profileName);
+    TraceScope trace("apply");
+    trace.enter(m_profileName);
     return m_handler(m_name, argsBegin, argsEnd);
 }
 
@@ -234,20 +293,29 @@ malValuePtr malHash::values() const
     return mal::list(keys);
 }
 
-String malHash::print(bool readably) const
+void malHash::doPrint(Sink& out, bool readably) const
 {
-    String s = "{";
+    out << '{';
 
     auto it = m_map.begin(), end = m_map.end();
     if (it != end) {
-        s += it->first + " " + it->second->print(readably);
+        out << it->first << ' ';
+        it->second->print(out, readably);
         ++it;
     }
     for ( ; it != end; ++it) {
-        s += " " + it->first + " " + it->second->print(readably);
+        out << ' ' << it->first << ' ';
+        it->second->print(out, readably);
     }
 
-    return s + "}";
+    out << '}';
+}
+
+void malHash::doMakeImmortal() const
+{
+    for (auto it = m_map.begin(), end = m_map.end(); it != end; ++it) {
+        it->second->makeImmortal();
+    }
 }
 
 bool malHash::doIsEqualTo(const malValue* rhs) const
@@ -270,12 +338,39 @@ bool malHash::doIsEqualTo(const malValue* rhs) const
     return true;
 }
 
+//  Conservatively decides whether evaluating ast could keep a reference
+//  to the environment it runs in, by creating a closure or handing forms
+//  to eval. Macros are not expanded here, so a macro that expands into
+//  fn* is missed; makeEnv() guards against that with the frame's
+//  reference count.
+static bool mayCaptureEnv(malValuePtr ast)
+{
+    if (const malSymbol* sym = DYNAMIC_CAST(malSymbol, ast)) {
+        const String& name = sym->value();
+        return (name == "fn*") || (name == "eval");
+    }
+    if (const malSequence* seq = DYNAMIC_CAST(malSequence, ast)) {
+        for (auto it = seq->begin(), end = seq->end(); it != end; ++it) {
+            if (mayCaptureEnv(*it)) {
+                return true;
+            }
+        }
+        return false;
+    }
+    if (const malHash* hash = DYNAMIC_CAST(malHash, ast)) {
+        return mayCaptureEnv(hash->values());
+    }
+    return false;
+}
+
 malLambda::malLambda(const StringVec& bindings,
                      malValuePtr body, malEnvPtr env)
 : m_bindings(bindings)
 , m_body(body)
 , m_env(env)
 , m_isMacro(false)
+, m_capturesEnv(mayCaptureEnv(body))
+, m_name(NULL)
 {
 
 }
@@ -286,6 +381,8 @@ malLambda::malLambda(const malLambda& that, malValuePtr meta)
 , m_body(that.m_body)
 , m_env(that.m_env)
 , m_isMacro(that.m_isMacro)
+, m_capturesEnv(that.m_capturesEnv)
+, m_name(that.m_name.load())
 {
 
 }
@@ -296,6 +393,8 @@ malLambda::malLambda(const malLambda& that, bool isMacro)
 , m_body(that.m_body)
 , m_env(that.m_env)
 , m_isMacro(isMacro)
+, m_capturesEnv(that.m_capturesEnv)
+, m_name(that.m_name.load())
 {
 
 }
@@ -303,9 +402,37 @@ malLambda::malLambda(const malLambda& that, bool isMacro)
 malValuePtr malLambda::apply(malValueIter argsBegin,
                              malValueIter argsEnd) const
 {
+    if (!Hooks::any()) {
+        return EVAL(m_body, makeEnv(argsBegin, argsEnd));
+    }
+    Stats::count(Stats::LambdaCalls);
+    ProfileFrame frame;
+    frame.enter(name());
+    TraceScope trace("eval");
+    trace.enter(name());
     return EVAL(m_body, makeEnv(argsBegin, argsEnd));
 }
 
+malEnvPtr malLambda::getEnv() const
+{
+    return m_env;
+}
+
+void malLambda::setName(const String& name) const
+{
+    // The first name sticks.
+    if (!m_name.load(std::memory_order_relaxed)) {
+        const char* unnamed = NULL;
+        m_name.compare_exchange_strong(unnamed, Profiler::intern(name));
+    }
+}
+
+void malLambda::doMakeImmortal() const
+{
+    m_body->makeImmortal();
+    m_env->makeImmortal();
+}
+
 malValuePtr malLambda::doWithMeta(malValuePtr meta) const
 {
     return new malLambda(*this, meta);
@@ -316,6 +443,333 @@ malEnvPtr malLambda::makeEnv(malValueIter argsBegin, malValueIter argsEnd) const
     return malEnvPtr(new malEnv(m_env, m_bindings, argsBegin, argsEnd));
 }
 
+malEnvPtr malLambda::makeEnv(malValueIter argsBegin, malValueIter argsEnd,
+                             const malEnvPtr& frame) const
+{
+    // On a tail call the caller's frame is dead once the arguments have
+    // been evaluated. If nothing else holds it, bind into it in place.
+    if (!m_capturesEnv && frame && (frame->refCount() == 1)) {
+        frame->rebind(m_env, m_bindings, argsBegin, argsEnd);
+        return frame;
+    }
+    return makeEnv(argsBegin, argsEnd);
+}
+
+void malTransducer::doMakeImmortal() const
+{
+    for (auto it = m_stages.begin(), end = m_stages.end(); it != end; ++it) {
+        if (it->fn) {
+            it->fn->makeImmortal();
+        }
+    }
+}
+
+void malFolded::doMakeImmortal() const
+{
+    m_form->makeImmortal();
+    m_original->makeImmortal();
+}
+
+malValuePtr malFolded::eval(malEnvPtr env)
+{
+    return EVAL(form(), env);
+}
+
+struct malFuture::State : public RefCounted {
+    State(malValuePtr fn, const malValueVec& args)
+        : fn(fn), args(args), isDone(false) { }
+
+    malValuePtr             fn;
+    malValueVec             args;
+    std::mutex              lock;
+    std::condition_variable done;
+    std::atomic<bool>       isDone;
+    malValuePtr             value;
+    std::exception_ptr      error;
+};
+
+malFuture::malFuture(malValuePtr fn, const malValueVec& args)
+: m_state(new State(fn, args))
+{
+}
+
+malFuture::malFuture(const malFuture& that, malValuePtr meta)
+: malValue(meta), m_state(that.m_state)
+{
+}
+
+malFuture::~malFuture()
+{
+}
+
+void malFuture::run() const
+{
+    State& state = *m_state.ptr();
+    malValuePtr value;
+    std::exception_ptr error;
+    try {
+        value = APPLY(state.fn, state.args.begin(), state.args.end());
+    }
+    catch (...) {
+        error = std::current_exception();
+    }
+
+    std::lock_guard<std::mutex> guard(state.lock);
+    state.fn = NULL;
+    state.args.clear();
+    state.value = value;
+    state.error = error;
+    state.isDone.store(true, std::memory_order_release);
+    state.done.notify_all();
+}
+
+bool malFuture::isDone() const
+{
+    return m_state->isDone.load(std::memory_order_acquire);
+}
+
+malValuePtr malFuture::deref() const
+{
+    State& state = *m_state.ptr();
+    while (!isDone()) {
+        // An isolate waiting here as the process exits must still stop.
+        EvalStack::check();
+        // Make ourselves useful, in case nobody else is free to run it.
+        if (ThreadPool::instance().runPending()) {
+            continue;
+        }
+        std::unique_lock<std::mutex> guard(state.lock);
+        state.done.wait_for(guard, std::chrono::milliseconds(1),
+                            [this]() { return isDone(); });
+    }
+
+    if (state.error) {
+        std::rethrow_exception(state.error);
+    }
+    return state.value;
+}
+
+malLazySeq::malLazySeq(malValuePtr first, malValuePtr more)
+: m_isRealised(true), m_realiser(std::thread::id()), m_chunk(new Chunk)
+, m_offset(0), m_more(more)
+{
+    m_chunk->items.push_back(first);
+}
+
+malLazySeq::malLazySeq(const malLazySeq& that, malValuePtr meta)
+: malValue(meta), m_isRealised(true), m_realiser(std::thread::id())
+{
+    that.realise();
+    m_chunk  = that.m_chunk;
+    m_offset = that.m_offset;
+    m_more   = that.m_more;
+}
+
+malLazySeq::~malLazySeq()
+{
+    // Unlink the realised tail one node at a time, rather than letting
+    // each node's destructor release the next one recursively.
+    malValuePtr more = m_more;
+    m_more = NULL;
+    while (more && (more->refCount() == 1)) {
+        malLazySeq* next = DYNAMIC_CAST(malLazySeq, more);
+        if (!next) {
+            break;
+        }
+        malValuePtr after = next->m_more;
+        next->m_more = NULL;
+        more = after;
+    }
+}
+
+namespace {
+    //  Marks the calling thread as the one realising a node, until the
+    //  source returns or throws.
+    class Realiser {
+    public:
+        Realiser(std::atomic<std::thread::id>& id) : m_id(id) {
+            m_id.store(std::this_thread::get_id());
+        }
+        ~Realiser() {
+            m_id.store(std::thread::id());
+        }
+
+    private:
+        std::atomic<std::thread::id>& m_id;
+    };
+}
+
+void malLazySeq::realise() const
+{
+    if (m_isRealised.load(std::memory_order_acquire)) {
+        return;
+    }
+    MAL_CHECK(m_realiser.load() != std::this_thread::get_id(),
+              "lazy seq needs its own elements to realise them");
+    std::lock_guard<std::mutex> guard(m_lock);
+    if (m_isRealised.load(std::memory_order_relaxed)) {
+        return;
+    }
+    Realiser realiser(m_realiser);
+
+    ChunkPtr chunk(new Chunk);
+    malValuePtr more = m_source->realise(chunk->items);
+
+    if (!chunk->items.empty()) {
+        m_chunk = chunk;
+        m_more = more;
+    }
+    else if (const malLazySeq* lazy = DYNAMIC_CAST(malLazySeq, more)) {
+        // Nothing here, so this node is the same as the next one.
+        lazy->realise();
+        m_chunk  = lazy->m_chunk;
+        m_offset = lazy->m_offset;
+        m_more   = lazy->m_more;
+    }
+    else if (const malSequence* seq = DYNAMIC_CAST(malSequence, more)) {
+        if (!seq->isEmpty()) {
+            chunk->items.assign(seq->begin(), seq->end());
+            m_chunk = chunk;
+            m_more = mal::nilValue();
+        }
+    }
+    else {
+        MAL_CHECK(more == mal::nilValue(),
+                  "%s is not a sequence", more->print(true).c_str());
+    }
+    m_source = NULL;
+    m_isRealised.store(true, std::memory_order_release);
+}
+
+bool malLazySeq::isEmpty() const
+{
+    realise();
+    return !m_chunk;
+}
+
+malValuePtr malLazySeq::first() const
+{
+    return isEmpty() ? mal::nilValue() : m_chunk->items[m_offset];
+}
+
+malValuePtr malLazySeq::rest() const
+{
+    if (isEmpty()) {
+        return mal::list(new malValueVec(0));
+    }
+    if (m_offset + 1 < (int)m_chunk->items.size()) {
+        return malValuePtr(new malLazySeq(m_chunk, m_offset + 1, m_more));
+    }
+    return (m_more == mal::nilValue()) ? mal::list(new malValueVec(0))
+                                       : m_more;
+}
+
+bool malLazySeq::isFullyRealised() const
+{
+    const malLazySeq* node = this;
+    while (node->m_isRealised.load(std::memory_order_acquire)) {
+        node = DYNAMIC_CAST(malLazySeq, node->m_more);
+        if (!node) {
+            return true;
+        }
+    }
+    return false;
+}
+
+int malLazySeq::count() const
+{
+    int count = 0;
+    malValuePtr item;
+    for (Cursor it(malValuePtr(const_cast<malLazySeq*>(this)));
+         it.next(item); ) {
+        count++;
+    }
+    return count;
+}
+
+void malLazySeq::doPrint(Sink& out, bool readably) const
+{
+    out << '(';
+    Cursor it(malValuePtr(const_cast<malLazySeq*>(this)));
+    malValuePtr item;
+    if (it.next(item)) {
+        item->print(out, readably);
+        while (it.next(item)) {
+            out << ' ';
+            item->print(out, readably);
+        }
+    }
+    out << ')';
+}
+
+bool malLazySeq::doIsEqualTo(const malValue* rhs) const
+{
+    Cursor lhsIt(malValuePtr(const_cast<malLazySeq*>(this)));
+    Cursor rhsIt(malValuePtr(const_cast<malValue*>(rhs)));
+    malValuePtr lhsItem, rhsItem;
+    for (;;) {
+        bool lhsMore = lhsIt.next(lhsItem);
+        bool rhsMore = rhsIt.next(rhsItem);
+        if (!lhsMore || !rhsMore) {
+            return lhsMore == rhsMore;
+        }
+        if (!lhsItem->isEqualTo(rhsItem.ptr())) {
+            return false;
+        }
+    }
+}
+
+bool malLazySeq::Cursor::next(malValuePtr& item)
+{
+    for (;;) {
+        if (const malLazySeq* lazy = DYNAMIC_CAST(malLazySeq, m_seq)) {
+            if (m_index < 0) {
+                if (lazy->isEmpty()) {
+                    return false;
+                }
+                m_index = lazy->m_offset;
+            }
+            const malValueVec& items = lazy->m_chunk->items;
+            if (m_index < (int)items.size()) {
+                item = items[m_index++];
+                return true;
+            }
+            m_seq = lazy->m_more;
+            m_index = -1;
+            continue;
+        }
+
+        if (m_seq == mal::nilValue()) {
+            return false;
+        }
+        const malSequence* seq = VALUE_CAST(malSequence, m_seq);
+        if (m_index < 0) {
+            m_index = 0;
+        }
+        if (m_index < seq->count()) {
+            item = seq->item(m_index++);
+            return true;
+        }
+        return false;
+    }
+}
+
+malValuePtr malLazySeq::Cursor::rest() const
+{
+    if (m_index < 0) {
+        return m_seq;
+    }
+    if (const malLazySeq* lazy = DYNAMIC_CAST(malLazySeq, m_seq)) {
+        if (m_index < (int)lazy->m_chunk->items.size()) {
+            return malValuePtr(new malLazySeq(lazy->m_chunk, m_index,
+                                              lazy->m_more));
+        }
+        return lazy->m_more;
+    }
+    const malSequence* seq = STATIC_CAST(malSequence, m_seq);
+    return mal::list(seq->begin() + m_index, seq->end());
+}
+
 malValuePtr malList::conj(malValueIter argsBegin,
                           malValueIter argsEnd) const
 {
@@ -343,9 +797,11 @@ malValuePtr malList::eval(malEnvPtr env)
     return APPLY(op, ++it, items->end());
 }
 
-String malList::print(bool readably) const
+void malList::doPrint(Sink& out, bool readably) const
 {
-    return '(' + malSequence::print(readably) + ')';
+    out << '(';
+    printItems(out, readably);
+    out << ')';
 }
 
 malValuePtr malValue::eval(malEnvPtr env)
@@ -356,6 +812,20 @@ malValuePtr malValue::eval(malEnvPtr env)
 
 bool malValue::isEqualTo(const malValue* rhs) const
 {
+    EvalStack::check();
+
+    // Lazy seqs can be compared with any sequence, and do the walking.
+    const malLazySeq* lazy = dynamic_cast<const malLazySeq*>(rhs);
+    if (lazy || dynamic_cast<const malLazySeq*>(this)) {
+        const malValue* other = lazy ? this : rhs;
+        if (!lazy) {
+            lazy = static_cast<const malLazySeq*>(this);
+        }
+        return (dynamic_cast<const malSequence*>(other) ||
+                dynamic_cast<const malLazySeq*>(other))
+            && lazy->doIsEqualTo(other);
+    }
+
     // Special-case. Vectors and Lists can be compared.
     bool matchingTypes = (typeid(*this) == typeid(*rhs)) ||
         (dynamic_cast<const malSequence*>(this) &&
@@ -364,12 +834,38 @@ bool malValue::isEqualTo(const malValue* rhs) const
     return matchingTypes && doIsEqualTo(rhs);
 }
 
+void malValue::makeImmortal() const
+{
+    if (isImmortal()) {
+        return;
+    }
+    EvalStack::check();
+    markImmortal();
+    if (m_meta) {
+        m_meta->makeImmortal();
+    }
+    doMakeImmortal();
+}
+
 bool malValue::isTrue() const
 {
     return (this != mal::falseValue().ptr())
         && (this != mal::nilValue().ptr());
 }
 
+String malValue::print(bool readably) const
+{
+    Sink out;
+    print(out, readably);
+    return out.str();
+}
+
+void malValue::print(Sink& out, bool readably) const
+{
+    EvalStack::check();
+    doPrint(out, readably);
+}
+
 malValuePtr malValue::meta() const
 {
     return m_meta.ptr() == NULL ? mal::nilValue() : m_meta;
@@ -383,20 +879,30 @@ malValuePtr malValue::withMeta(malValuePtr meta) const
 malSequence::malSequence(malValueVec* items)
 : m_items(items)
 {
-
+    chargeItems();
 }
 
 malSequence::malSequence(malValueIter begin, malValueIter end)
 : m_items(new malValueVec(begin, end))
 {
-
+    chargeItems();
 }
 
 malSequence::malSequence(const malSequence& that, malValuePtr meta)
 : malValue(meta)
 , m_items(new malValueVec(*(that.m_items)))
 {
+    chargeItems();
+}
 
+//  The items are never added to once the sequence is made, so their
+//  buffer is charged to a sampled sequence once, by its capacity.
+void malSequence::chargeItems()
+{
+    if (HeapProfiler::owns(this)) {
+        HeapProfiler::addBytes(this, sizeof(malValueVec) +
+                               m_items->capacity() * sizeof(malValuePtr));
+    }
 }
 
 malSequence::~malSequence()
@@ -422,6 +928,13 @@ bool malSequence::doIsEqualTo(const malValue* rhs) const
     return true;
 }
 
+void malSequence::doMakeImmortal() const
+{
+    for (auto it = m_items->begin(), end = m_items->end(); it != end; ++it) {
+        (*it)->makeImmortal();
+    }
+}
+
 malValueVec* malSequence::evalItems(malEnvPtr env) const
 {
     malValueVec* items = new malValueVec;;
@@ -437,20 +950,18 @@ malValuePtr malSequence::first() const
     return count() == 0 ? mal::nilValue() : item(0);
 }
 
-String malSequence::print(bool readably) const
+void malSequence::printItems(Sink& out, bool readably) const
 {
-    String str;
     auto end = m_items->cend();
     auto it = m_items->cbegin();
     if (it != end) {
-        str += (*it)->print(readably);
+        (*it)->print(out, readably);
         ++it;
     }
     for ( ; it != end; ++it) {
-        str += " ";
-        str += (*it)->print(readably);
+        out << ' ';
+        (*it)->print(out, readably);
     }
-    return str;
 }
 
 malValuePtr malSequence::rest() const
@@ -464,9 +975,14 @@ String malString::escapedValue() const
     return escape(value());
 }
 
-String malString::print(bool readably) const
+void malString::doPrint(Sink& out, bool readably) const
 {
-    return readably ? escapedValue() : value();
+    if (readably) {
+        out.appendEscaped(value());
+    }
+    else {
+        out << value();
+    }
 }
 
 malValuePtr malSymbol::eval(malEnvPtr env)
@@ -492,7 +1008,9 @@ malValuePtr malVector::eval(malEnvPtr env)
     return mal::vector(evalItems(env));
 }
 
-String malVector::print(bool readably) const
+void malVector::doPrint(Sink& out, bool readably) const
 {
-    return '[' + malSequence::print(readably) + ']';
+    out << '[';
+    printItems(out, readably);
+    out << ']';
 }
@@ -2,9 +2,16 @@
 #define INCLUDE_TYPES_H
 
 #include "MAL.h"
+#include "Sink.h"
+#include "Stats.h"
 
+#include <atomic>
 #include <exception>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
 
 class malEmptyInputException : public std::exception { };
 
@@ -26,14 +33,27 @@ public:
 
     bool isTrue() const;
 
+    //  Comparing, printing and making immortal all walk the whole of a
+    //  value, and throw "Stack overflow" like EVAL if it's nested too
+    //  deeply to walk.
     bool isEqualTo(const malValue* rhs) const;
 
     virtual malValuePtr eval(malEnvPtr env);
 
-    virtual String print(bool readably) const = 0;
+    String print(bool readably) const;
+    void print(Sink& out, bool readably) const;
+    virtual void doPrint(Sink& out, bool readably) const = 0;
+
+    //  Stops counting references to this value and everything it refers
+    //  to, so that threads sharing it don't contend on the counts. Only
+    //  used for code and global definitions. If it throws, part of the
+    //  value is left counted, which is safe since every thread sharing
+    //  it counts atomically.
+    void makeImmortal() const;
 
 protected:
     virtual bool doIsEqualTo(const malValue* rhs) const = 0;
+    virtual void doMakeImmortal() const { }
 
     malValuePtr m_meta;
 };
@@ -55,19 +75,22 @@ T* value_cast(malValuePtr obj, const char* typeName) {
         return new Type(*this, meta); \
     } \
 
+//  Constants are singletons shared by every thread, so they are never
+//  freed.
 class malConstant : public malValue {
 public:
-    malConstant(String name) : m_name(name) { }
+    malConstant(String name) : m_name(name) { markImmortal(); }
     malConstant(const malConstant& that, malValuePtr meta)
         : malValue(meta), m_name(that.m_name) { }
 
-    virtual String print(bool readably) const { return m_name; }
+    virtual void doPrint(Sink& out, bool readably) const { out << m_name; }
 
     virtual bool doIsEqualTo(const malValue* rhs) const {
         return this == rhs; // these are singletons
     }
 
     WITH_META(malConstant);
+    COUNTED(malConstant);
 
 private:
     const String m_name;
@@ -79,8 +102,8 @@ public:
     malInteger(const malInteger& that, malValuePtr meta)
         : malValue(meta), m_value(that.m_value) { }
 
-    virtual String print(bool readably) const {
-        return std::to_string(m_value);
+    virtual void doPrint(Sink& out, bool readably) const {
+        out << m_value;
     }
 
     int64_t value() const { return m_value; }
@@ -90,6 +113,7 @@ public:
     }
 
     WITH_META(malInteger);
+    COUNTED(malInteger);
 
 private:
     const int64_t m_value;
@@ -99,12 +123,14 @@ class malStringBase : public malValue {
 public:
     malStringBase(const String& token)
         : m_value(token) { }
+    malStringBase(String&& token)
+        : m_value(std::move(token)) { }
     malStringBase(const malStringBase& that, malValuePtr meta)
         : malValue(meta), m_value(that.value()) { }
 
-    virtual String print(bool readably) const { return m_value; }
+    virtual void doPrint(Sink& out, bool readably) const { out << m_value; }
 
-    String value() const { return m_value; }
+    const String& value() const { return m_value; }
 
 private:
     const String m_value;
@@ -114,10 +140,12 @@ class malString : public malStringBase {
 public:
     malString(const String& token)
         : malStringBase(token) { }
+    malString(String&& token)
+        : malStringBase(std::move(token)) { }
     malString(const malString& that, malValuePtr meta)
         : malStringBase(that, meta) { }
 
-    virtual String print(bool readably) const;
+    virtual void doPrint(Sink& out, bool readably) const;
 
     String escapedValue() const;
 
@@ -126,6 +154,7 @@ public:
     }
 
     WITH_META(malString);
+    COUNTED(malString);
 };
 
 class malKeyword : public malStringBase {
@@ -140,6 +169,7 @@ public:
     }
 
     WITH_META(malKeyword);
+    COUNTED(malKeyword);
 };
 
 class malSymbol : public malStringBase {
@@ -156,6 +186,7 @@ public:
     }
 
     WITH_META(malSymbol);
+    COUNTED(malSymbol);
 };
 
 class malSequence : public malValue {
@@ -165,7 +196,7 @@ public:
     malSequence(const malSequence& that, malValuePtr meta);
     virtual ~malSequence();
 
-    virtual String print(bool readably) const;
+    void printItems(Sink& out, bool readably) const;
 
     malValueVec* evalItems(malEnvPtr env) const;
     int count() const { return m_items->size(); }
@@ -183,7 +214,12 @@ public:
     malValuePtr first() const;
     virtual malValuePtr rest() const;
 
+protected:
+    virtual void doMakeImmortal() const;
+
 private:
+    void chargeItems();
+
     malValueVec* const m_items;
 };
 
@@ -195,13 +231,14 @@ public:
     malList(const malList& that, malValuePtr meta)
         : malSequence(that, meta) { }
 
-    virtual String print(bool readably) const;
+    virtual void doPrint(Sink& out, bool readably) const;
     virtual malValuePtr eval(malEnvPtr env);
 
     virtual malValuePtr conj(malValueIter argsBegin,
                              malValueIter argsEnd) const;
 
     WITH_META(malList);
+    COUNTED(malList);
 };
 
 class malVector : public malSequence {
@@ -213,12 +250,100 @@ public:
         : malSequence(that, meta) { }
 
     virtual malValuePtr eval(malEnvPtr env);
-    virtual String print(bool readably) const;
+    virtual void doPrint(Sink& out, bool readably) const;
 
     virtual malValuePtr conj(malValueIter argsBegin,
                              malValueIter argsEnd) const;
 
     WITH_META(malVector);
+    COUNTED(malVector);
+};
+
+//  A sequence whose elements are computed on demand. Each node holds a
+//  chunk of up to ChunkSize realised elements, followed by the rest of the
+//  sequence, which is usually another unrealised malLazySeq. Realised
+//  chunks are cached, so walking a lazy seq twice only computes it once,
+//  and anything which keeps hold of the head keeps every element alive.
+class malLazySeq : public malValue {
+public:
+    static const int ChunkSize = 32;
+
+    //  Computes the next chunk of a lazy seq. realise() appends at most
+    //  ChunkSize elements to chunk, and returns what follows them: nil, a
+    //  sequence or another malLazySeq. Sources are never modified once
+    //  they have been created.
+    class Source : public RefCounted {
+    public:
+        virtual malValuePtr realise(malValueVec& chunk) const = 0;
+    };
+    typedef RefCountedPtr<Source> SourcePtr;
+
+    //  Walks a lazy seq, a sequence or nil one element at a time without
+    //  allocating a node for each element.
+    class Cursor {
+    public:
+        Cursor(malValuePtr seq) : m_seq(seq), m_index(-1) { }
+
+        bool next(malValuePtr& item);
+
+        // The elements which next() hasn't returned yet.
+        malValuePtr rest() const;
+
+    private:
+        malValuePtr m_seq;
+        int         m_index;
+    };
+
+    malLazySeq(SourcePtr source)
+        : m_isRealised(false), m_realiser(std::thread::id())
+        , m_source(source), m_offset(0) { }
+    malLazySeq(malValuePtr first, malValuePtr more);
+    malLazySeq(const malLazySeq& that, malValuePtr meta);
+    virtual ~malLazySeq();
+
+    malValuePtr first() const;
+    malValuePtr rest() const;
+    bool isEmpty() const;
+
+    // Whether the whole sequence has been realised already, so that
+    // walking it computes nothing more.
+    bool isFullyRealised() const;
+
+    // These realise the whole sequence.
+    int count() const;
+    virtual void doPrint(Sink& out, bool readably) const;
+    virtual bool doIsEqualTo(const malValue* rhs) const;
+
+    WITH_META(malLazySeq);
+    COUNTED(malLazySeq);
+
+private:
+    struct Chunk : public RefCounted {
+        malValueVec items;
+    };
+    typedef RefCountedPtr<Chunk> ChunkPtr;
+
+    malLazySeq(ChunkPtr chunk, int offset, malValuePtr more)
+        : m_isRealised(true), m_realiser(std::thread::id())
+        , m_chunk(chunk), m_offset(offset)
+        , m_more(more) { }
+
+    void realise() const;
+
+    // Another thread may be realising the same node, so m_source is only
+    // used with m_lock held, and the other fields only once m_isRealised
+    // has been set. m_realiser is the thread holding m_lock, so that a
+    // source which needs its own node fails instead of deadlocking.
+    mutable std::mutex                   m_lock;
+    mutable std::atomic<bool>            m_isRealised;
+    mutable std::atomic<std::thread::id> m_realiser;
+
+    // Once realised, the node is empty if m_chunk is NULL, otherwise its
+    // elements are m_chunk->items from m_offset onwards, then m_more.
+    mutable SourcePtr   m_source;
+    mutable ChunkPtr    m_chunk;
+    mutable int         m_offset;
+    mutable malValuePtr m_more;
 };
 
 class malApplicable : public malValue {
@@ -247,11 +372,19 @@ public:
     malValuePtr keys() const;
     malValuePtr values() const;
 
-    virtual String print(bool readably) const;
+    //  False for hash-maps read as code, whose values are still to be
+    //  evaluated.
+    bool isEvaluated() const { return m_isEvaluated; }
+
+    virtual void doPrint(Sink& out, bool readably) const;
 
     virtual bool doIsEqualTo(const malValue* rhs) const;
 
     WITH_META(malHash);
+    COUNTED(malHash);
+
+protected:
+    virtual void doMakeImmortal() const;
 
 private:
     const Map m_map;
@@ -264,17 +397,19 @@ public:
                                     malValueIter argsBegin,
                                     malValueIter argsEnd);
 
-    malBuiltIn(const String& name, ApplyFunc* handler)
-    : m_name(name), m_handler(handler) { }
+    // Builtins are bound in every interpreter's root environment, so like
+    // the constants they are never freed.
+    malBuiltIn(const String& name, ApplyFunc* handler);
 
     malBuiltIn(const malBuiltIn& that, malValuePtr meta)
-    : malApplicable(meta), m_name(that.m_name), m_handler(that.m_handler) { }
+    : malApplicable(meta), m_name(that.m_name)
+    , m_profileName(that.m_profileName), m_handler(that.m_handler) { }
 
     virtual malValuePtr apply(malValueIter argsBegin,
                               malValueIter argsEnd) const;
 
-    virtual String print(bool readably) const {
-        return STRF("#builtin-function(%s)", m_name.c_str());
+    virtual void doPrint(Sink& out, bool readably) const {
+        out << "#builtin-function(" << m_name << ')';
     }
 
     virtual bool doIsEqualTo(const malValue* rhs) const {
@@ -284,9 +419,11 @@ public:
     String name() const { return m_name; }
 
     WITH_META(malBuiltIn);
+    COUNTED(malBuiltIn);
 
 private:
     const String m_name;
+    const char*  m_profileName;
     ApplyFunc* m_handler;
 };
 
@@ -300,49 +437,273 @@ public:
                               malValueIter argsEnd) const;
 
     malValuePtr getBody() const { return m_body; }
+    const StringVec& getBindings() const { return m_bindings; }
+    malEnvPtr getEnv() const;
+
+    //  The name the profiler knows the lambda by.
+    const char* name() const {
+        const char* name = m_name.load(std::memory_order_relaxed);
+        return name ? name : "anonymous";
+    }
+    void setName(const String& name) const;
+
     malEnvPtr makeEnv(malValueIter argsBegin, malValueIter argsEnd) const;
+    malEnvPtr makeEnv(malValueIter argsBegin, malValueIter argsEnd,
+                      const malEnvPtr& frame) const;
 
     virtual bool doIsEqualTo(const malValue* rhs) const {
         return this == rhs; // do we need to do a deep inspection?
     }
 
-    virtual String print(bool readably) const {
-        return STRF("#user-%s(%p)", m_isMacro ? "macro" : "function", this);
+    virtual void doPrint(Sink& out, bool readably) const {
+        out << STRF("#user-%s(%p)", m_isMacro ? "macro" : "function", this);
     }
 
     bool isMacro() const { return m_isMacro; }
 
     virtual malValuePtr doWithMeta(malValuePtr meta) const;
+    COUNTED(malLambda);
+
+protected:
+    virtual void doMakeImmortal() const;
 
 private:
     const StringVec   m_bindings;
     const malValuePtr m_body;
     const malEnvPtr   m_env;
     const bool        m_isMacro;
+    const bool        m_capturesEnv;
+    mutable std::atomic<const char*> m_name;
 };
 
 class malAtom : public malValue {
 public:
-    malAtom(malValuePtr value) : m_value(value) { }
+    malAtom(malValuePtr value) : m_value(value), m_serial(s_serial++) { }
     malAtom(const malAtom& that, malValuePtr meta)
-        : malValue(meta), m_value(that.m_value) { }
+        : malValue(meta), m_value(that.deref()), m_serial(s_serial++) { }
+
+    //  Makes every atom which exists now read-only, so that a prelude
+    //  shared by several sessions stays as it was loaded. Atoms made
+    //  afterwards can be changed as usual.
+    static void freezeExisting() { s_frozenBelow.store(s_serial.load()); }
 
     virtual bool doIsEqualTo(const malValue* rhs) const {
-        return this->m_value->isEqualTo(rhs);
+        return deref()->isEqualTo(rhs);
     }
 
-    virtual String print(bool readably) const {
-        return "(atom " + m_value->print(readably) + ")";
+    virtual void doPrint(Sink& out, bool readably) const {
+        out << "(atom ";
+        deref()->print(out, readably);
+        out << ')';
     };
 
-    malValuePtr deref() const { return m_value; }
+    malValuePtr deref() const {
+        std::lock_guard<std::mutex> guard(m_lock);
+        return m_value;
+    }
+
+    malValuePtr reset(malValuePtr value) {
+        checkWritable();
+        std::lock_guard<std::mutex> guard(m_lock);
+        return m_value = value;
+    }
 
-    malValuePtr reset(malValuePtr value) { return m_value = value; }
+    //  Stores value only if the atom still holds expected.
+    bool compareAndSet(malValuePtr expected, malValuePtr value) {
+        checkWritable();
+        std::lock_guard<std::mutex> guard(m_lock);
+        if (m_value != expected) {
+            return false;
+        }
+        m_value = value;
+        return true;
+    }
 
     WITH_META(malAtom);
+    COUNTED(malAtom);
+
+private:
+    void checkWritable() const {
+        MAL_CHECK(m_serial >= s_frozenBelow.load(std::memory_order_relaxed),
+                  "atoms from the prelude are read-only");
+    }
+
+    static std::atomic<uint64_t> s_serial;
+    static std::atomic<uint64_t> s_frozenBelow;
+
+    mutable std::mutex m_lock;
+    malValuePtr        m_value;
+    const uint64_t     m_serial;    // the order the atoms were made in
+};
+
+class Mailbox;
+
+//  A handle on an isolate's mailbox. Every isolate that knows about a
+//  mailbox has a malIsolate of its own which refers to it.
+class malIsolate : public malValue {
+public:
+    malIsolate(const std::shared_ptr<Mailbox>& mailbox)
+        : m_mailbox(mailbox) { }
+    malIsolate(const malIsolate& that, malValuePtr meta)
+        : malValue(meta), m_mailbox(that.m_mailbox) { }
+
+    const std::shared_ptr<Mailbox>& mailbox() const { return m_mailbox; }
+
+    virtual void doPrint(Sink& out, bool readably) const {
+        out << STRF("#isolate(%p)", m_mailbox.get());
+    }
+
+    virtual bool doIsEqualTo(const malValue* rhs) const {
+        return m_mailbox == static_cast<const malIsolate*>(rhs)->m_mailbox;
+    }
+
+    WITH_META(malIsolate);
+    COUNTED(malIsolate);
+
+private:
+    const std::shared_ptr<Mailbox> m_mailbox;
+};
+
+class Channel;
+
+//  A handle on a channel between the tasks of one thread (see Task.h).
+class malChannel : public malValue {
+public:
+    malChannel(const std::shared_ptr<Channel>& channel)
+        : m_channel(channel) { }
+    malChannel(const malChannel& that, malValuePtr meta)
+        : malValue(meta), m_channel(that.m_channel) { }
+
+    const std::shared_ptr<Channel>& channel() const { return m_channel; }
+
+    virtual void doPrint(Sink& out, bool readably) const {
+        out << STRF("#channel(%p)", m_channel.get());
+    }
+
+    virtual bool doIsEqualTo(const malValue* rhs) const {
+        return m_channel == static_cast<const malChannel*>(rhs)->m_channel;
+    }
+
+    WITH_META(malChannel);
+    COUNTED(malChannel);
+
+private:
+    const std::shared_ptr<Channel> m_channel;
+};
+
+//  The result of calling a function on the thread pool. Dereferencing a
+//  future waits for the call to finish, and rethrows anything it threw.
+class malFuture : public malValue {
+public:
+    malFuture(malValuePtr fn, const malValueVec& args);
+    malFuture(const malFuture& that, malValuePtr meta);
+    virtual ~malFuture();
+
+    //  Makes the call. The pool does this exactly once.
+    void run() const;
+
+    malValuePtr deref() const;
+    bool isDone() const;
+
+    virtual void doPrint(Sink& out, bool readably) const {
+        out << STRF("#future(%p)", this);
+    }
+
+    virtual bool doIsEqualTo(const malValue* rhs) const {
+        return m_state == static_cast<const malFuture*>(rhs)->m_state;
+    }
+
+    WITH_META(malFuture);
+    COUNTED(malFuture);
+
+private:
+    struct State;
+    RefCountedPtr<State> m_state;
+};
+
+//  A composition of map/filter/remove/take/drop steps, built by calling
+//  those functions without a collection and combined with comp. Running a
+//  transducer pushes each element through every stage in turn, so no
+//  intermediate sequences are built.
+class malTransducer : public malValue {
+public:
+    enum Kind { Map, Filter, Remove, Take, Drop };
+
+    struct Stage {
+        Stage(Kind kind, malValuePtr fn, int64_t count)
+            : kind(kind), fn(fn), count(count) { }
+
+        Kind        kind;
+        malValuePtr fn;
+        int64_t     count;
+    };
+    typedef std::vector<Stage> Stages;
+
+    malTransducer(const Stages& stages) : m_stages(stages) { }
+    malTransducer(const malTransducer& that, malValuePtr meta)
+        : malValue(meta), m_stages(that.m_stages) { }
+
+    const Stages& stages() const { return m_stages; }
+
+    virtual void doPrint(Sink& out, bool readably) const {
+        out << STRF("#transducer(%p)", this);
+    }
+
+    virtual bool doIsEqualTo(const malValue* rhs) const {
+        return this == rhs;
+    }
+
+    WITH_META(malTransducer);
+    COUNTED(malTransducer);
+
+protected:
+    virtual void doMakeImmortal() const;
+
+private:
+    const Stages m_stages;
+};
+
+//  A form rewritten by the constant folder. The rewrite only holds while
+//  the builtins it was computed with are still bound, so once any of them
+//  has been redefined the original form is evaluated instead.
+class malFolded : public malValue {
+public:
+    //  uses has a bit for each foldable builtin the rewrite relied on,
+    //  and epoch is foldEpoch(uses) when it was made.
+    malFolded(malValuePtr form, malValuePtr original,
+              unsigned uses, int epoch)
+        : m_form(form), m_original(original), m_uses(uses), m_epoch(epoch) { }
+    malFolded(const malFolded& that, malValuePtr meta)
+        : malValue(meta), m_form(that.m_form), m_original(that.m_original)
+        , m_uses(that.m_uses), m_epoch(that.m_epoch) { }
+
+    malValuePtr form() const {
+        return m_epoch == foldEpoch(m_uses) ? m_form : m_original;
+    }
+    malValuePtr original() const { return m_original; }
+    unsigned uses() const { return m_uses; }
+
+    virtual malValuePtr eval(malEnvPtr env);
+
+    virtual void doPrint(Sink& out, bool readably) const {
+        m_original->print(out, readably);
+    }
+
+    virtual bool doIsEqualTo(const malValue* rhs) const {
+        return this == rhs;
+    }
+
+    WITH_META(malFolded);
+    COUNTED(malFolded);
+
+protected:
+    virtual void doMakeImmortal() const;
 
 private:
-    malValuePtr m_value;
+    const malValuePtr m_form;
+    const malValuePtr m_original;
+    const unsigned    m_uses;
+    const int         m_epoch;
 };
 
 namespace mal {
@@ -350,12 +711,15 @@ namespace mal {
     malValuePtr boolean(bool value);
     malValuePtr builtin(const String& name, malBuiltIn::ApplyFunc handler);
     malValuePtr falseValue();
+    malValuePtr future(malValuePtr fn, const malValueVec& args);
     malValuePtr hash(malValueIter argsBegin, malValueIter argsEnd,
                      bool isEvaluated);
     malValuePtr hash(const malHash::Map& map);
     malValuePtr integer(int64_t value);
     malValuePtr integer(const String& token);
     malValuePtr keyword(const String& token);
+    malValuePtr lazySeq(malLazySeq::Source* source);
+    malValuePtr lazySeq(malValuePtr first, malValuePtr more);
     malValuePtr lambda(const StringVec&, malValuePtr, malEnvPtr);
     malValuePtr list(malValueVec* items);
     malValuePtr list(malValueIter begin, malValueIter end);
@@ -365,7 +729,12 @@ namespace mal {
     malValuePtr macro(const malLambda& lambda);
     malValuePtr nilValue();
     malValuePtr string(const String& token);
+    //  Takes over token's storage rather than copying it.
+    malValuePtr string(String&& token);
     malValuePtr symbol(const String& token);
+    malValuePtr transducer(const malTransducer::Stages& stages);
+    malValuePtr transducer(malTransducer::Kind kind,
+                           malValuePtr fn, int64_t count);
     malValuePtr trueValue();
     malValuePtr vector(malValueVec* items);
     malValuePtr vector(malValueIter begin, malValueIter end);
@@ -1,10 +1,14 @@
 #ifndef INCLUDE_VALIDATION_H
 #define INCLUDE_VALIDATION_H
 
+#include "Stats.h"
 #include "String.h"
 
 #define MAL_CHECK(condition, ...)  \
-    if (!(condition)) { throw STRF(__VA_ARGS__); } else { }
+    if (!(condition)) { \
+        Stats::count(Stats::Exceptions); \
+        throw STRF(__VA_ARGS__); \
+    } else { }
 
 #define MAL_FAIL(...) MAL_CHECK(false, __VA_ARGS__)
 
@@ -0,0 +1,162 @@
+#include "Zygote.h"
+#include "Environment.h"
+#include "Socket.h"
+#include "Types.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+//  How long a child waits for more of the script before giving up on the
+//  client.
+static const int ReadTimeoutSeconds = 30;
+
+//  How many requests can run at once, from MAL_ZYGOTE_CHILDREN. Once that
+//  many children are running, the next connection waits in the listen
+//  queue until one of them exits.
+static int maxChildren()
+{
+    int count = 64;
+    if (const char* env = getenv("MAL_ZYGOTE_CHILDREN")) {
+        int n = atoi(env);
+        if (n > 0) {
+            count = n;
+        }
+    }
+    return count;
+}
+
+//  How many threads the process has, from /proc.
+static int threadCount()
+{
+    DIR* dir = opendir("/proc/self/task");
+    if (!dir) {
+        return -1;
+    }
+    int count = 0;
+    while (struct dirent* entry = readdir(dir)) {
+        if (entry->d_name[0] != '.') {
+            count++;
+        }
+    }
+    closedir(dir);
+    return count;
+}
+
+//  Reads until the client shuts down its side. False if the read fails or
+//  times out, in which case what was read is only part of the script.
+static bool readAll(int fd, String& data)
+{
+    char buffer[65536];
+    for (;;) {
+        ssize_t n = read(fd, buffer, sizeof(buffer));
+        if ((n < 0) && (errno == EINTR)) {
+            continue;
+        }
+        if (n <= 0) {
+            return n == 0;
+        }
+        data.append(buffer, n);
+    }
+}
+
+static void sendError(int fd, const char* error)
+{
+    ssize_t ignored = write(fd, error, strlen(error));
+    (void)ignored;
+}
+
+//  Reaps the children which have exited, waiting for one to if there are
+//  still limit of them running. Returns how many are left.
+static int reapChildren(int running, int limit)
+{
+    while (running > 0) {
+        pid_t pid = waitpid(-1, NULL, (running < limit) ? WNOHANG : 0);
+        if ((pid < 0) && (errno == EINTR)) {
+            continue;
+        }
+        if (pid <= 0) {
+            break;
+        }
+        running--;
+    }
+    return running;
+}
+
+//  Runs in the child, with its output going to the client.
+static void runRequest(const String& script, malEnvPtr env)
+{
+    try {
+        EVAL(readStr("(do " + script + "\nnil)"), env);
+    }
+    catch (malEmptyInputException&) {
+    }
+    catch (malValuePtr& mv) {
+        printf("Error: %s\n", mv->print(true).c_str());
+    }
+    catch (String& s) {
+        printf("Error: %s\n", s.c_str());
+    }
+}
+
+void Zygote::serve(const String& path, malEnvPtr env)
+{
+    MAL_CHECK(threadCount() == 1,
+              "the zygote can't fork once other threads have started");
+
+    int listener = listenOnPath(path, SOCK_STREAM | SOCK_CLOEXEC);
+
+    const int limit = maxChildren();
+    int running = 0;
+    for (;;) {
+        running = reapChildren(running, limit);
+        int conn = accept(listener, NULL, NULL);
+        if (conn < 0) {
+            if ((errno == EINTR) || (errno == ECONNABORTED)) {
+                continue;
+            }
+            int error = errno;
+            close(listener);
+            MAL_FAIL("Cannot accept on %s: %s", path.c_str(), strerror(error));
+        }
+
+        // Anything still buffered would be printed by the child as well.
+        fflush(stdout);
+        fflush(stderr);
+        pid_t pid = fork();
+        if (pid == 0) {
+            close(listener);
+            // A client which never shuts down its side mustn't hold on to
+            // the child for ever.
+            struct timeval timeout = { ReadTimeoutSeconds, 0 };
+            setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO,
+                       &timeout, sizeof(timeout));
+            String script;
+            if (!readAll(conn, script)) {
+                sendError(conn, "Error: couldn't read the whole script\n");
+                _exit(1);
+            }
+            dup2(conn, STDOUT_FILENO);
+            dup2(conn, STDERR_FILENO);
+            close(conn);
+            // Stream the output back a line at a time.
+            setvbuf(stdout, NULL, _IOLBF, 0);
+            runRequest(script, env);
+            fflush(stdout);
+            _exit(0);
+        }
+        if (pid < 0) {
+            sendError(conn, "Error: the zygote couldn't fork\n");
+        }
+        else {
+            running++;
+        }
+        close(conn);
+    }
+}
@@ -0,0 +1,28 @@
+#ifndef INCLUDE_ZYGOTE_H
+#define INCLUDE_ZYGOTE_H
+
+#include "MAL.h"
+
+//  Serves requests to run scripts from a process which has already loaded
+//  everything they need. It listens on a UNIX domain socket, and forks a
+//  child for each connection, which starts with a copy-on-write copy of
+//  the parent's environment. The child reads the script until the client
+//  shuts down its side of the connection, evaluates it, and sends back
+//  whatever it prints as it goes, along with any error. Then it exits, so
+//  nothing a script does outlives its request. A client has 30 seconds
+//  between reads to send its script, and MAL_ZYGOTE_CHILDREN caps how
+//  many requests run at once (64 by default).
+//
+//  A socket left at path by a zygote which has exited is replaced, but
+//  the server won't start over a live zygote's socket or any other file.
+//
+//  Only the thread which calls serve() is copied into the children, so the
+//  server refuses to start once other threads have been: evaluating
+//  futures or spawning isolates while loading is out.
+class Zygote {
+public:
+    //  Never returns, unless it can't listen on path.
+    static void serve(const String& path, malEnvPtr env);
+};
+
+#endif // INCLUDE_ZYGOTE_H
@@ -0,0 +1,201 @@
+//  Microbenchmarks for the interpreter's internals, reporting the time and
+//  the number of heap allocations each operation takes.
+//
+//  Run from impls/cpp with: make bench [BENCH_FILTER=substring]
+
+#include "MAL.h"
+#include "Environment.h"
+#include "Interpreter.h"
+#include "Types.h"
+
+#include <chrono>
+#include <new>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// stepA_mal.cpp, when it's built with MAL_NO_MAIN.
+extern void installReplRoot(malEnvPtr env);
+
+//  Every allocation goes through here, including those of std::vectors
+//  and Strings, which the interpreter's own stats don't see.
+static uint64_t s_allocations = 0;
+
+void* operator new(size_t size)
+{
+    s_allocations++;
+    if (void* p = malloc(size ? size : 1)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept
+{
+    free(p);
+}
+
+void operator delete(void* p, size_t) noexcept
+{
+    free(p);
+}
+
+static const char* s_filter = NULL;
+
+//  Keeps the compiler from throwing results away.
+static malValuePtr s_result;
+static volatile size_t s_length;
+
+//  Runs op for long enough to time it, doubling the number of iterations
+//  until they take at least a tenth of a second.
+template <class Op>
+static void bench(const char* name, Op op)
+{
+    if (s_filter && !strstr(name, s_filter)) {
+        return;
+    }
+    using namespace std::chrono;
+    op();
+
+    uint64_t iterations = 1;
+    for (;;) {
+        uint64_t allocations = s_allocations;
+        steady_clock::time_point start = steady_clock::now();
+        for (uint64_t i = 0; i < iterations; i++) {
+            op();
+        }
+        double ns = duration_cast<nanoseconds>(
+            steady_clock::now() - start).count();
+        allocations = s_allocations - allocations;
+        if ((ns >= 1e8) || (iterations >= (1ull << 32))) {
+            printf("%-24s %12.1f %12.2f\n", name, ns / iterations,
+                   double(allocations) / iterations);
+            return;
+        }
+        iterations *= 2;
+    }
+}
+
+static malEnvPtr nestedEnv(malEnvPtr root, int depth)
+{
+    malEnvPtr env = root;
+    for (int i = 0; i < depth; i++) {
+        env = malEnvPtr(new malEnv(env));
+    }
+    return env;
+}
+
+static void benchReader()
+{
+    const String atoms = "(a 1 :b \"c\" d 2 :e \"f\" g 3 :h \"i\" j 4)";
+    const String nested =
+        "(def! f (fn* [xs] (let* [a {:k [1 2 3]} b \"s\\n\"] "
+        "(if (empty? xs) a (cons (first xs) (f (rest xs)))))))";
+
+    bench("read-atoms", [&]() { s_result = readStr(atoms); });
+    bench("read-nested", [&]() { s_result = readStr(nested); });
+
+    malValuePtr form = readStr(nested);
+    bench("print-readably", [&]() { s_length = form->print(true).size(); });
+    bench("print", [&]() { s_length = form->print(false).size(); });
+
+    const String raw = "a \"quoted\" string\nwith\\escapes\tand tabs";
+    const String escaped = escape(raw);
+    bench("escape", [&]() { s_length = escape(raw).size(); });
+    bench("unescape", [&]() { s_length = unescape(escaped).size(); });
+}
+
+static void benchEnv(malEnvPtr root)
+{
+    root->set("bench-root", mal::integer(1));
+    const int depths[] = { 1, 4, 16 };
+    for (int i = 0; i < 3; i++) {
+        malEnvPtr env = nestedEnv(root, depths[i]);
+        String name = STRF("env-get-depth-%d", depths[i]);
+        bench(name.c_str(), [&]() { s_result = env->get("bench-root"); });
+    }
+
+    malEnvPtr local = nestedEnv(root, 1);
+    malValuePtr value = mal::integer(2);
+    bench("env-set", [&]() { s_result = local->set("bench-local", value); });
+    bench("env-new", [&]() { malEnvPtr env(new malEnv(root)); });
+}
+
+static void benchCollections()
+{
+    malValueVec items;
+    for (int i = 0; i < 100; i++) {
+        items.push_back(mal::keyword(STRF(":k%d", i)));
+        items.push_back(mal::integer(i));
+    }
+    malValuePtr hash = mal::hash(items.begin(), items.end(), true);
+    const malHash* h = STATIC_CAST(malHash, hash);
+    malValueVec pair(2);
+    pair[0] = mal::keyword(":new");
+    pair[1] = mal::integer(-1);
+    malValuePtr key = mal::keyword(":k50");
+    bench("hash-get", [&]() { s_result = h->get(key); });
+    bench("hash-assoc", [&]() {
+        s_result = h->assoc(pair.begin(), pair.end());
+    });
+
+    malValuePtr list = mal::list(items.begin(), items.begin() + 10);
+    malValuePtr vector = mal::vector(items.begin(), items.begin() + 10);
+    const malSequence* l = STATIC_CAST(malSequence, list);
+    const malSequence* v = STATIC_CAST(malSequence, vector);
+    malValueVec one(1, mal::integer(0));
+    bench("list-conj", [&]() { s_result = l->conj(one.begin(), one.end()); });
+    bench("vector-conj", [&]() { s_result = v->conj(one.begin(), one.end()); });
+    bench("list-rest", [&]() { s_result = l->rest(); });
+}
+
+static void benchEval(malEnvPtr env)
+{
+    rep("(def! bench-add (fn* [a b] (+ a b)))", env);
+    rep("(def! bench-fib (fn* [n] "
+        "(if (< n 2) n (+ (bench-fib (- n 1)) (bench-fib (- n 2))))))", env);
+
+    struct { const char* name; const char* form; } cases[] = {
+        { "eval-number",      "42" },
+        { "eval-symbol",      "bench-add" },
+        { "eval-builtin",     "(+ 1 2)" },
+        { "eval-if",          "(if true 1 2)" },
+        { "eval-let",         "(let* [a 1 b 2] (+ a b))" },
+        { "eval-vector",      "[1 2 (+ 1 2)]" },
+        { "eval-lambda-call", "(bench-add 1 2)" },
+        { "eval-fn",          "(fn* [x] x)" },
+        { "eval-macro",       "(cond false 1 :else 2)" },
+        { "eval-fib-10",      "(bench-fib 10)" },
+    };
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        malValuePtr ast = readStr(cases[i].form);
+        bench(cases[i].name, [&]() { s_result = EVAL(ast, env); });
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc > 1) {
+        s_filter = argv[1];
+    }
+    malInterpreter::setInstaller(installReplRoot);
+    malInterpreterPtr interp = malInterpreter::create();
+    malInterpreter::Scope scope(interp.get());
+
+    printf("%-24s %12s %12s\n", "benchmark", "ns/op", "allocs/op");
+    try {
+        benchReader();
+        benchEnv(interp->env());
+        benchCollections();
+        benchEval(interp->env());
+    }
+    catch (String& s) {
+        fprintf(stderr, "Error: %s\n", s.c_str());
+        return 1;
+    }
+    catch (malValuePtr& mv) {
+        fprintf(stderr, "Error: %s\n", mv->print(true).c_str());
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,49 @@
+#!/bin/sh
+#
+# Times piping a file of forms into the REPL: one form per line, several
+# on a line, and forms spread over several lines. FORMS is how many forms
+# the file has, and RUNS how many times it's piped in.
+#
+# Run from impls/cpp with: make bench-pipe [FORMS=n] [RUNS=n]
+
+forms=${FORMS:-20000}
+runs=${RUNS:-5}
+tmp=$(mktemp -d "${TMPDIR:-/tmp}/mal-pipe.XXXXXX")
+trap 'rm -rf "$tmp"' EXIT
+
+awk -v forms="$forms" 'BEGIN {
+    for (i = 0; i < forms; i++) {
+        if (i % 4 == 0)
+            printf "(def! x%d (+ %d 1))\n", i % 100, i
+        else if (i % 4 == 1)
+            printf "(str \"line \" %d) ", i
+        else if (i % 4 == 2)
+            printf "[%d :k]\n", i
+        else
+            printf "(let* [a %d\n      b (* a 2)]\n  ; a comment\n  (- b a))\n", i
+    }
+}' > "$tmp/forms.mal"
+
+# The history file is left alone when stdin isn't a terminal, but in case
+# it isn't, keep it away from the real one.
+start=$(date +%s%N)
+i=0
+while [ $i -lt "$runs" ]; do
+    HOME=$tmp ./stepA_mal < "$tmp/forms.mal" > "$tmp/out" || exit 1
+    i=$((i + 1))
+done
+end=$(date +%s%N)
+
+if grep -q "^Error" "$tmp/out"; then
+    grep -m 1 "^Error" "$tmp/out" >&2
+    exit 1
+fi
+results=$(grep -c '^user> ' "$tmp/out")
+if [ "$results" -ne $((forms + 1)) ]; then
+    echo "Expected $((forms + 1)) prompts, got $results" >&2
+    exit 1
+fi
+awk "BEGIN {
+    ms = ($end - $start) / $runs / 1e6
+    printf \"%d forms in %.1f ms: %.0f forms/s\n\", $forms, ms, $forms / ms * 1000
+}"
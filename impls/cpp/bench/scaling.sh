@@ -0,0 +1,13 @@
+#!/bin/sh
+# Runs bench/pmap.mal with 1, 2, 4, ... worker threads, up to the number
+# of cores or the first argument.
+#
+# Run from impls/cpp with: bench/scaling.sh [max-threads]
+
+max=${1:-$(nproc)}
+threads=1
+while [ "$threads" -le "$max" ]; do
+    echo "MAL_THREADS=$threads"
+    MAL_THREADS=$threads ./run bench/pmap.mal
+    threads=$((threads * 2))
+done
@@ -0,0 +1,42 @@
+#!/bin/sh
+#
+# Times starting the interpreter and loading bench/startup.mal, or the
+# file given: parsing it, with the form cache warm, and from an image
+# saved after loading it. Starting on an empty file gives the time it
+# takes before loading anything.
+#
+# Run from impls/cpp with: make bench-startup [RUNS=n]
+
+runs=${RUNS:-50}
+workload=${1:-bench/startup.mal}
+tmp=$(mktemp -d "${TMPDIR:-/tmp}/mal-startup.XXXXXX")
+trap 'rm -rf "$tmp"' EXIT
+echo nil > "$tmp/empty.mal"
+
+# The mean milliseconds per run, with the cache setting and the arguments
+# given.
+time_runs() {
+    cache=$1
+    shift
+    start=$(date +%s%N)
+    i=0
+    while [ $i -lt "$runs" ]; do
+        MAL_FORM_CACHE=$cache ./stepA_mal "$@" > /dev/null || exit 1
+        i=$((i + 1))
+    done
+    end=$(date +%s%N)
+    awk "BEGIN { printf \"%.2f\", ($end - $start) / $runs / 1e6 }"
+}
+
+printf "%-16s %8s ms\n" "empty file" "$(time_runs 0 "$tmp/empty.mal")"
+printf "%-16s %8s ms\n" "without cache" "$(time_runs 0 "$workload")"
+MAL_FORM_CACHE=1 ./stepA_mal "$workload" > /dev/null
+printf "%-16s %8s ms\n" "with cache" "$(time_runs 1 "$workload")"
+
+cat > "$tmp/save.mal" <<END
+(load-file "$workload")
+(save-image "$tmp/startup.img")
+END
+./stepA_mal "$tmp/save.mal" > /dev/null
+printf "%-16s %8s ms\n" "from image" \
+    "$(time_runs 0 --image "$tmp/startup.img" "$tmp/empty.mal")"
@@ -0,0 +1,116 @@
+#!/usr/bin/env python3
+
+# Load-tests the zygote server against starting a process per job. Each
+# job loads the same prelude and then runs the same script: in the exec
+# model the prelude is loaded by every process, and in the zygote model
+# once, by the server, which forks a child per request.
+#
+# Run from impls/cpp with: make bench-zygote [ZYGOTE_OPTS="--requests 500"]
+
+from __future__ import print_function
+import os, sys
+import argparse, math, shutil, socket, subprocess, tempfile, time
+from concurrent.futures import ThreadPoolExecutor
+
+parser = argparse.ArgumentParser(
+        description="Compare the zygote server with a process per job")
+parser.add_argument('--requests', default=200, type=int,
+        help="jobs to run in each model (default: 200)")
+parser.add_argument('--concurrency', default=4, type=int,
+        help="jobs in flight at once (default: 4)")
+parser.add_argument('--prelude', default='bench/startup.mal',
+        help="file every job needs loaded (default: bench/startup.mal)")
+parser.add_argument('--script',
+        default='(def! fib (fn* [n] (if (< n 2) n '
+                '(+ (fib (- n 1)) (fib (- n 2))))))\n(prn (fib 12))',
+        help="what each job runs once the prelude is loaded")
+
+def percentile(values, p):
+    ordered = sorted(values)
+    rank = int(math.ceil(p / 100.0 * len(ordered)))
+    return ordered[min(max(rank, 1), len(ordered)) - 1]
+
+def exec_job(job_file):
+    return subprocess.run(['./stepA_mal', job_file], stdin=subprocess.DEVNULL,
+                          stdout=subprocess.PIPE, stderr=subprocess.STDOUT,
+                          check=True).stdout
+
+def zygote_job(path, script):
+    with socket.socket(socket.AF_UNIX, socket.SOCK_STREAM) as s:
+        s.connect(path)
+        s.sendall(script)
+        s.shutdown(socket.SHUT_WR)
+        chunks = []
+        while True:
+            chunk = s.recv(65536)
+            if not chunk:
+                return b''.join(chunks)
+            chunks.append(chunk)
+
+def run(name, job, args):
+    """Runs job args.requests times, returning its outputs and printing
+    its throughput and latency."""
+    def timed(_):
+        start = time.time()
+        output = job()
+        return time.time() - start, output
+
+    start = time.time()
+    with ThreadPoolExecutor(args.concurrency) as pool:
+        results = list(pool.map(timed, range(args.requests)))
+    elapsed = time.time() - start
+
+    latencies = [r[0] * 1000 for r in results]
+    print("%-8s %10.1f %10.2f %10.2f" % (
+        name, args.requests / elapsed, sum(latencies) / len(latencies),
+        percentile(latencies, 95)))
+    return set(r[1] for r in results)
+
+def wait_for_socket(path, server):
+    for _ in range(500):
+        if server.poll() is not None:
+            sys.exit("The zygote server exited with %d" % server.returncode)
+        try:
+            with socket.socket(socket.AF_UNIX, socket.SOCK_STREAM) as s:
+                s.connect(path)
+                # A request which does nothing.
+                s.shutdown(socket.SHUT_WR)
+                s.recv(1)
+                return
+        except (FileNotFoundError, ConnectionRefusedError):
+            time.sleep(0.01)
+    sys.exit("The zygote server didn't start")
+
+def main():
+    args = parser.parse_args()
+    if args.requests < 1 or args.concurrency < 1:
+        parser.error("--requests and --concurrency must be at least 1")
+
+    tmp = tempfile.mkdtemp(prefix='mal-zygote.')
+    server = None
+    try:
+        job_file = os.path.join(tmp, 'job.mal')
+        with open(job_file, 'w') as f:
+            f.write('(load-file "%s")\n%s\n' % (args.prelude, args.script))
+        script = args.script.encode('utf-8')
+
+        print("%-8s %10s %10s %10s" % ("model", "req/s", "mean ms", "p95 ms"))
+        exec_outputs = run("exec", lambda: exec_job(job_file), args)
+
+        path = os.path.join(tmp, 'zygote.sock')
+        server = subprocess.Popen(['./stepA_mal', '--zygote', path,
+                                   args.prelude], stdin=subprocess.DEVNULL)
+        wait_for_socket(path, server)
+        zygote_outputs = run("zygote", lambda: zygote_job(path, script), args)
+
+        if exec_outputs != zygote_outputs:
+            sys.exit("The models' outputs differ: %r and %r"
+                     % (exec_outputs, zygote_outputs))
+    finally:
+        if server:
+            server.terminate()
+            server.wait()
+        shutil.rmtree(tmp)
+
+if __name__ == '__main__':
+    main()
@@ -151,7 +151,7 @@ malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
         malValuePtr op = items->at(0);
         if (const malLambda* lambda = DYNAMIC_CAST(malLambda, op)) {
             ast = lambda->getBody();
-            env = lambda->makeEnv(items->begin()+1, items->end());
+            env = lambda->makeEnv(items->begin()+1, items->end(), env);
             continue; // TCO
         }
         else {
@@ -191,7 +191,7 @@ malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
                 malValuePtr tryBody = list->item(1);
 
                 if (argCount == 1) {
-                    ast = EVAL(tryBody, env);
+                    ast = tryBody;
                     continue; // TCO
                 }
                 checkArgsIs("try*", 2, argCount);
@@ -210,26 +210,26 @@ malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
 
                 malValuePtr excVal;
 
+                // The body's value is returned as it is, rather than
+                // evaluated again.
                 try {
-                    ast = EVAL(tryBody, env);
+                    return EVAL(tryBody, env);
                 }
                 catch(String& s) {
                     excVal = mal::string(s);
                 }
                 catch (malEmptyInputException&) {
                     // Not an error, continue as if we got nil
-                    ast = mal::nilValue();
+                    return mal::nilValue();
                 }
                 catch(malValuePtr& o) {
                     excVal = o;
                 };
 
-                if (excVal) {
-                    // we got some exception
-                    env = malEnvPtr(new malEnv(env));
-                    env->set(excSym->value(), excVal);
-                    ast = catchBlock->item(2);
-                }
+                // we got some exception
+                env = malEnvPtr(new malEnv(env));
+                env->set(excSym->value(), excVal);
+                ast = catchBlock->item(2);
                 continue; // TCO
             }
         }
@@ -239,7 +239,7 @@ malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
         malValuePtr op = items->at(0);
         if (const malLambda* lambda = DYNAMIC_CAST(malLambda, op)) {
             ast = lambda->getBody();
-            env = lambda->makeEnv(items->begin()+1, items->end());
+            env = lambda->makeEnv(items->begin()+1, items->end(), env);
             continue; // TCO
         }
         else {
@@ -1,45 +1,130 @@
 #include "MAL.h"
 
 #include "Environment.h"
+#include "EvalStack.h"
+#include "Hooks.h"
+#include "Image.h"
+#include "Interpreter.h"
+#include "Isolate.h"
+#include "Profiler.h"
 #include "ReadLine.h"
+#include "ReplServer.h"
+#include "ThreadPool.h"
+#include "Tracer.h"
 #include "Types.h"
+#include "Zygote.h"
 
 #include <iostream>
 #include <memory>
+#include <string.h>
 
 malValuePtr READ(const String& input);
 String PRINT(malValuePtr ast);
 static void installFunctions(malEnvPtr env);
 //  Installs functions, macros and constants implemented in MAL.
 
+static void installRoot(malEnvPtr env);
+
 static void makeArgv(malEnvPtr env, int argc, char* argv[]);
+static void runRepl(int argc, char* argv[]);
 static String safeRep(const String& input, malEnvPtr env);
 static malValuePtr quasiquote(malValuePtr obj);
 static malValuePtr macroExpand(malValuePtr obj, malEnvPtr env);
 
 static ReadLine s_readLine("~/.mal-history");
 
-static malEnvPtr replEnv(new malEnv);
-
+#ifndef MAL_NO_MAIN
 int main(int argc, char* argv[])
+{
+    EvalStack::run([=]() { runRepl(argc, argv); });
+    return 0;
+}
+#else
+//  Programs which link the interpreter in, such as the benchmarks, give
+//  their interpreters the same root environment as the REPL.
+void installReplRoot(malEnvPtr env)
+{
+    installRoot(env);
+}
+#endif
+
+static void runRepl(int argc, char* argv[])
 {
     String prompt = "user> ";
     String input;
-    installCore(replEnv);
-    installFunctions(replEnv);
-    makeArgv(replEnv, argc - 2, argv + 2);
-    if (argc > 1) {
-        String filename = escape(argv[1]);
+    malInterpreter::setInstaller(installRoot);
+    malInterpreterPtr interp = malInterpreter::create();
+    malInterpreter::Scope scope(interp.get());
+    malEnvPtr replEnv = interp->env();
+    enableIsolates();
+    String zygotePath;
+    String serveAddress;
+    int argi = 1;
+    for (; argi < argc; argi++) {
+        if (strcmp(argv[argi], "--optimize") == 0) {
+            enableFolding();
+        }
+        else if ((strcmp(argv[argi], "--image") == 0) && (argi + 1 < argc)) {
+            // The image's definitions replace the standard ones.
+            String image = argv[++argi];
+            try {
+                Image::load(image, replEnv);
+            }
+            catch (String& s) {
+                std::cerr << "Error: " << s << "\n";
+                exit(1);
+            }
+        }
+        else if ((strcmp(argv[argi], "--zygote") == 0) && (argi + 1 < argc)) {
+            zygotePath = argv[++argi];
+        }
+        else if ((strcmp(argv[argi], "--serve") == 0) && (argi + 1 < argc)) {
+            serveAddress = argv[++argi];
+        }
+        else {
+            break;
+        }
+    }
+    makeArgv(replEnv, argc - argi - 1, argv + argi + 1);
+    if (!zygotePath.empty() || !serveAddress.empty()) {
+        // The file, if there is one, is what every request or session
+        // needs loaded.
+        try {
+            if (argi < argc) {
+                String filename = escape(argv[argi]);
+                rep(STRF("(load-file %s)", filename.c_str()), replEnv);
+            }
+            if (!zygotePath.empty()) {
+                Zygote::serve(zygotePath, replEnv);
+            }
+            else {
+                ReplServer::serve(serveAddress, replEnv, safeRep);
+            }
+        }
+        catch (malValuePtr& mv) {
+            std::cerr << "Error: " << mv->print(true) << "\n";
+        }
+        catch (String& s) {
+            std::cerr << "Error: " << s << "\n";
+        }
+        exit(1);
+    }
+    if (argi < argc) {
+        String filename = escape(argv[argi]);
         safeRep(STRF("(load-file %s)", filename.c_str()), replEnv);
-        return 0;
     }
-    rep("(println (str \"Mal [\" *host-language* \"]\"))", replEnv);
-    while (s_readLine.get(prompt, input)) {
-        String out = safeRep(input, replEnv);
-        if (out.length() > 0)
-            std::cout << out << "\n";
+    else {
+        rep("(println (str \"Mal [\" *host-language* \"]\"))", replEnv);
+        while (s_readLine.getForm(prompt, input)) {
+            String out = safeRep(input, replEnv);
+            if (out.length() > 0)
+                std::cout << out << "\n";
+        }
     }
-    return 0;
+    // Futures still running use the interpreter, so they are interrupted
+    // and joined while it is still here, as are the isolates.
+    stopIsolates();
+    ThreadPool::stop();
 }
 
 static String safeRep(const String& input, malEnvPtr env)
@@ -77,14 +162,68 @@ malValuePtr READ(const String& input)
     return readStr(input);
 }
 
+namespace {
+    //  What EVAL does for whatever is watching it (see Hooks.h). EVAL
+    //  picks one of these once per call, so that while nothing is on, its
+    //  loop has no hooks in it at all.
+    struct Unhooked {
+        bool isFolding() const { return false; }
+        void iterate() { }
+        void call(const char*) { }
+    };
+
+    struct Hooked {
+        Hooked() : trace("eval") {
+            Stats::count(Stats::EvalCalls);
+        }
+
+        bool isFolding() const { return foldingEnabled(); }
+
+        void iterate() {
+            Stats::count(Stats::EvalIterations);
+            Stats::count(Stats::MacroExpandCalls);
+        }
+
+        void call(const char* name) {
+            Stats::count(Stats::LambdaCalls);
+            frame.enter(name);
+            trace.enter(name);
+        }
+
+        ProfileFrame frame;
+        TraceScope   trace;
+    };
+}
+
+template<class EvalHooks>
+static malValuePtr evalLoop(malValuePtr& ast, malEnvPtr& env);
+
 malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
 {
+    EvalStack::check();
     if (!env) {
-        env = replEnv;
+        malInterpreter* interp = malInterpreter::current();
+        MAL_CHECK(interp != NULL, "no interpreter to evaluate in");
+        env = interp->env();
     }
+    return Hooks::any() ? evalLoop<Hooked>(ast, env)
+                        : evalLoop<Unhooked>(ast, env);
+}
+
+template<class EvalHooks>
+static malValuePtr evalLoop(malValuePtr& ast, malEnvPtr& env)
+{
+    EvalHooks hooks;
     while (1) {
+        hooks.iterate();
         const malList* list = DYNAMIC_CAST(malList, ast);
         if (!list || (list->count() == 0)) {
+            if (hooks.isFolding()) {
+                if (const malFolded* folded = DYNAMIC_CAST(malFolded, ast)) {
+                    ast = folded->form();
+                    continue; // TCO
+                }
+            }
             return ast->eval(env);
         }
 
@@ -103,7 +242,12 @@ malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
             if (special == "def!") {
                 checkArgsIs("def!", 2, argCount);
                 const malSymbol* id = VALUE_CAST(malSymbol, list->item(1));
-                return env->set(id->value(), EVAL(list->item(2), env));
+                malValuePtr value = EVAL(list->item(2), env);
+                if (const malLambda* lambda = DYNAMIC_CAST(malLambda, value)) {
+                    lambda->setName(id->value());
+                }
+                noteDefinition(id->value());
+                return env->set(id->value(), value);
             }
 
             if (special == "defmacro!") {
@@ -112,6 +256,8 @@ malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
                 const malSymbol* id = VALUE_CAST(malSymbol, list->item(1));
                 malValuePtr body = EVAL(list->item(2), env);
                 const malLambda* lambda = VALUE_CAST(malLambda, body);
+                lambda->setName(id->value());
+                noteDefinition(id->value());
                 return env->set(id->value(), mal::macro(*lambda));
             }
 
@@ -137,7 +283,8 @@ malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
                     params.push_back(sym->value());
                 }
 
-                return mal::lambda(params, list->item(2), env);
+                return mal::lambda(params,
+                                   foldLambdaBody(ast, params, env), env);
             }
 
             if (special == "if") {
@@ -169,6 +316,7 @@ malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
 
             if (special == "macroexpand") {
                 checkArgsIs("macroexpand", 1, argCount);
+                Stats::count(Stats::MacroExpandCalls);
                 return macroExpand(list->item(1), env);
             }
 
@@ -192,7 +340,7 @@ malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
                 malValuePtr tryBody = list->item(1);
 
                 if (argCount == 1) {
-                    ast = EVAL(tryBody, env);
+                    ast = tryBody;
                     continue; // TCO
                 }
                 checkArgsIs("try*", 2, argCount);
@@ -211,26 +359,26 @@ malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
 
                 malValuePtr excVal;
 
+                // The body's value is returned as it is, rather than
+                // evaluated again.
                 try {
-                    ast = EVAL(tryBody, env);
+                    return EVAL(tryBody, env);
                 }
                 catch(String& s) {
                     excVal = mal::string(s);
                 }
                 catch (malEmptyInputException&) {
                     // Not an error, continue as if we got nil
-                    ast = mal::nilValue();
+                    return mal::nilValue();
                 }
                 catch(malValuePtr& o) {
                     excVal = o;
                 };
 
-                if (excVal) {
-                    // we got some exception
-                    env = malEnvPtr(new malEnv(env));
-                    env->set(excSym->value(), excVal);
-                    ast = catchBlock->item(2);
-                }
+                // we got some exception
+                env = malEnvPtr(new malEnv(env));
+                env->set(excSym->value(), excVal);
+                ast = catchBlock->item(2);
                 continue; // TCO
             }
         }
@@ -239,8 +387,12 @@ malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
         std::unique_ptr<malValueVec> items(list->evalItems(env));
         malValuePtr op = items->at(0);
         if (const malLambda* lambda = DYNAMIC_CAST(malLambda, op)) {
+            hooks.call(lambda->name());
             ast = lambda->getBody();
-            env = lambda->makeEnv(items->begin()+1, items->end());
+            env = lambda->makeEnv(items->begin()+1, items->end(), env);
+            // A loop is a chain of tail calls, so that it can be
+            // interrupted, each one is checked as a call would be.
+            EvalStack::check();
             continue; // TCO
         }
         else {
@@ -251,9 +403,15 @@ malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
 
 String PRINT(malValuePtr ast)
 {
-    return ast->print(true);
+    Sink out;
+    ast->print(out, true);
+    return out.str();
 }
 
+//  The arguments are handed over rather than lent: a builtin may clear
+//  the slot of an argument it has finished with, so that a lazy seq it is
+//  walking can be freed as it goes (see forEachItem() in Core.cpp). A
+//  caller which needs its arguments afterwards must apply a copy.
 malValuePtr APPLY(malValuePtr op, malValueIter argsBegin, malValueIter argsEnd)
 {
     const malApplicable* handler = DYNAMIC_CAST(malApplicable, op);
@@ -311,11 +469,9 @@ static const malLambda* isMacroApplication(malValuePtr obj, malEnvPtr env)
     const malList* seq = DYNAMIC_CAST(malList, obj);
     if (seq && !seq->isEmpty()) {
         if (malSymbol* sym = DYNAMIC_CAST(malSymbol, seq->item(0))) {
-            if (malEnvPtr symEnv = env->find(sym->value())) {
-                malValuePtr value = sym->eval(symEnv);
-                if (malLambda* lambda = DYNAMIC_CAST(malLambda, value)) {
-                    return lambda->isMacro() ? lambda : NULL;
-                }
+            malValuePtr value = env->findValue(sym->value());
+            if (malLambda* lambda = DYNAMIC_CAST(malLambda, value)) {
+                return lambda->isMacro() ? lambda : NULL;
             }
         }
     }
@@ -325,8 +481,24 @@ static const malLambda* isMacroApplication(malValuePtr obj, malEnvPtr env)
 static malValuePtr macroExpand(malValuePtr obj, malEnvPtr env)
 {
     while (const malLambda* macro = isMacroApplication(obj, env)) {
+        Stats::count(Stats::MacroExpansions);
+        TraceScope trace("macro");
+        trace.enter(macro->name());
         const malSequence* seq = STATIC_CAST(malSequence, obj);
-        obj = macro->apply(seq->begin() + 1, seq->end());
+        if (foldingEnabled()) {
+            // A macro is given its arguments as they were written, not
+            // as the optimiser rewrote them.
+            malValueVec args(seq->begin() + 1, seq->end());
+            for (auto& arg : args) {
+                if (const malFolded* folded = DYNAMIC_CAST(malFolded, arg)) {
+                    arg = folded->original();
+                }
+            }
+            obj = macro->apply(args.begin(), args.end());
+        }
+        else {
+            obj = macro->apply(seq->begin() + 1, seq->end());
+        }
     }
     return obj;
 }
@@ -334,11 +506,19 @@ static malValuePtr macroExpand(malValuePtr obj, malEnvPtr env)
 static const char* malFunctionTable[] = {
     "(defmacro! cond (fn* (& xs) (if (> (count xs) 0) (list 'if (first xs) (if (> (count xs) 1) (nth xs 1) (throw \"odd number of forms to cond\")) (cons 'cond (rest (rest xs)))))))",
     "(def! not (fn* (cond) (if cond false true)))",
-    "(def! load-file (fn* (filename) \
-        (eval (read-string (str \"(do \" (slurp filename) \"\nnil)\")))))",
+    "(defmacro! future (fn* (& body) (list 'future-call (list 'fn* '() (cons 'do body)))))",
+    "(defmacro! go (fn* (& body) (list 'go* (list 'fn* '() (cons 'do body)))))",
+    "(defmacro! lazy-seq (fn* (& body) (list 'lazy-seq* (list 'fn* '() (cons 'do body)))))",
+    "(def! load-file (fn* (filename) (eval (read-file filename))))",
     "(def! *host-language* \"C++\")",
 };
 
+static void installRoot(malEnvPtr env)
+{
+    installCore(env);
+    installFunctions(env);
+}
+
 static void installFunctions(malEnvPtr env) {
     for (auto &function : malFunctionTable) {
         rep(function, env);
@@ -0,0 +1,76 @@
+#!/usr/bin/env python3
+
+# Tests the form cache (MAL_FORM_CACHE): that loading a file writes a .malc
+# beside it, that a later load reads the forms back from it, and that a
+# cache file which no longer matches its source is ignored and rewritten.
+#
+# Run from impls/cpp with: make test-form-cache
+
+from __future__ import print_function
+import os, sys
+import shutil, subprocess, tempfile
+
+failures = 0
+
+def check(name, got, expected):
+    global failures
+    if got == expected:
+        print("PASS: %s" % name)
+    else:
+        failures += 1
+        print("FAIL: %s: expected %r, got %r" % (name, expected, got))
+
+def run(path):
+    env = dict(os.environ, MAL_FORM_CACHE='1')
+    return subprocess.check_output(['./stepA_mal', path], env=env,
+                                   stdin=subprocess.DEVNULL).decode('utf-8')
+
+def write(path, text):
+    with open(path, 'w') as f:
+        f.write(text)
+
+FORMS = ('(def! x (quote {:a [1 "two ]" three] "b" (nil true false)}))\n'
+         '; a comment\n'
+         '(prn x (get x :a))\n')
+PRINTED = ('{"b" (nil true false) :a [1 "two ]" three]} '
+           '[1 "two ]" three]\n')
+
+def main():
+    tmp = tempfile.mkdtemp(prefix='mal-form-cache.')
+    try:
+        source = os.path.join(tmp, 'forms.mal')
+        cache = source + 'c'
+        write(source, FORMS)
+
+        check("read from source", run(source), PRINTED)
+        check("cache written", os.path.exists(cache), True)
+        written = os.stat(cache)
+
+        check("read from cache", run(source), PRINTED)
+        check("fresh cache kept", os.stat(cache).st_ino, written.st_ino)
+
+        # Same size, so only the modification time gives the change away.
+        write(source, FORMS.replace('two', 'TWO'))
+        os.utime(source, ns=(written.st_mtime_ns + 10**9,) * 2)
+        check("stale cache ignored", run(source), PRINTED.replace('two', 'TWO'))
+        check("stale cache rewritten",
+              os.stat(cache).st_ino != written.st_ino, True)
+
+        with open(cache, 'r+b') as f:
+            f.truncate(os.path.getsize(cache) // 2)
+        check("truncated cache ignored", run(source),
+              PRINTED.replace('two', 'TWO'))
+
+        depth = 2000
+        write(source, '(prn (count (quote %s%s)))\n' %
+                      ('[' * depth, ']' * depth))
+        check("deep forms loaded", run(source), '1\n')
+        check("deep forms loaded again", run(source), '1\n')
+    finally:
+        shutil.rmtree(tmp)
+
+    if failures:
+        sys.exit("%d failed" % failures)
+
+if __name__ == '__main__':
+    main()
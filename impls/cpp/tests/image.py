@@ -0,0 +1,79 @@
+#!/usr/bin/env python3
+
+# Tests images (save-image and --image): that closures, atoms, macros and
+# metadata come back from an image as they were saved, and that values
+# nested too deeply to recurse over can be saved and loaded.
+#
+# Run from impls/cpp with: make test-image
+
+from __future__ import print_function
+import os, sys
+import shutil, subprocess, tempfile
+
+failures = 0
+
+def check(name, got, expected):
+    global failures
+    if got == expected:
+        print("PASS: %s" % name)
+    else:
+        failures += 1
+        print("FAIL: %s: expected %r, got %r" % (name, expected, got))
+
+def run(tmp, forms, *args):
+    path = os.path.join(tmp, 'forms.mal')
+    with open(path, 'w') as f:
+        f.write(forms)
+    return subprocess.check_output(['./stepA_mal'] + list(args) + [path],
+                                   stdin=subprocess.DEVNULL).decode('utf-8')
+
+SAVED = '''
+(def! counter (atom 10))
+(def! make-adder (fn* [n] (fn* [x] (+ x n))))
+(def! add5 (make-adder 5))
+(def! pair (let* [a (atom 0)]
+             [(fn* [] (swap! a (fn* [n] (+ n 1)))) (fn* [] @a)]))
+(defmacro! unless (fn* [c a b] `(if ~c ~b ~a)))
+(def! tagged (with-meta [1 {:k "v"}] {:tag "vec"}))
+(def! tagged-fn (with-meta (fn* [] :called) {:doc "a fn"}))
+(def! deep (reduce (fn* [acc _] (list acc)) nil (range %d)))
+(def! depth (fn* [l n] (if (nil? l) n (depth (first l) (+ n 1)))))
+(save-image "%s")
+'''
+
+DEPTH = 200000
+
+CHECKS = [
+    ('atom', '@counter', '10'),
+    ('closure', '(add5 1)', '6'),
+    ('closures sharing an atom',
+     '(do ((nth pair 0)) ((nth pair 0)) ((nth pair 1)))', '2'),
+    ('atoms stay mutable', '(do (swap! counter (fn* [n] (* n 2))) @counter)',
+     '20'),
+    ('macro', '(unless false :yes :no)', ':yes'),
+    ('macro is still a macro', '(macro? unless)', 'true'),
+    ('metadata on a vector', '[(meta tagged) tagged]',
+     '[{:tag "vec"} [1 {:k "v"}]]'),
+    ('metadata on a closure', '[(meta tagged-fn) (tagged-fn)]',
+     '[{:doc "a fn"} :called]'),
+    ('deeply nested value', '(depth deep 0)', str(DEPTH)),
+]
+
+def main():
+    tmp = tempfile.mkdtemp(prefix='mal-image.')
+    try:
+        image = os.path.join(tmp, 'saved.img')
+        run(tmp, SAVED % (DEPTH, image))
+        forms = ''.join('(prn %s)\n' % form for _, form, _ in CHECKS)
+        lines = run(tmp, forms, '--image', image).splitlines()
+        for (name, _, expected), got in zip(CHECKS, lines):
+            check(name, got, expected)
+        check("every check ran", len(lines), len(CHECKS))
+    finally:
+        shutil.rmtree(tmp)
+
+    if failures:
+        sys.exit("%d failed" % failures)
+
+if __name__ == '__main__':
+    main()
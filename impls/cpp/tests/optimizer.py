@@ -0,0 +1,78 @@
+#!/usr/bin/env python3
+
+# Tests constant folding (stepA_mal --optimize): each case is run with and
+# without it, and must print the same either way. Most are about forms the
+# optimiser must leave alone, because a name it saw as a function, or
+# didn't see at all, is a macro by the time the code runs.
+#
+# Run from impls/cpp with: make test-optimize
+
+from __future__ import print_function
+import os, sys
+import shutil, subprocess, tempfile
+
+failures = 0
+
+def check(name, got, expected):
+    global failures
+    if got == expected:
+        print("PASS: %s" % name)
+    else:
+        failures += 1
+        print("FAIL: %s: expected %r, got %r" % (name, expected, got))
+
+def run(tmp, forms, *args):
+    path = os.path.join(tmp, 'forms.mal')
+    with open(path, 'w') as f:
+        f.write(forms)
+    return subprocess.run(['./stepA_mal'] + list(args) + [path],
+                          stdin=subprocess.DEVNULL, stdout=subprocess.PIPE,
+                          stderr=subprocess.STDOUT).stdout.decode('utf-8')
+
+CASES = [
+    ("folded arithmetic",
+     '(def! f (fn* [x] (+ x (* 2 (- 10 4)))))\n'
+     '(prn (f 1))\n',
+     '13\n'),
+    ("let* constants",
+     '(def! f (fn* [] (let* [a 2 b (+ a 1)] (if (> b 2) (list a b) :no))))\n'
+     '(prn (f))\n',
+     '(2 3)\n'),
+    ("redefining a builtin",
+     '(def! f (fn* [] (+ 1 2)))\n'
+     '(prn (f))\n'
+     '(def! + -)\n'
+     '(prn (f))\n',
+     '3\n-1\n'),
+    ("macro defined after the call",
+     '(def! f (fn* [] (m (+ 1 2))))\n'
+     '(defmacro! m (fn* [x] (list \'quote (list (count x) x))))\n'
+     '(prn (f))\n',
+     '(3 (+ 1 2))\n'),
+    ("macro defining a let* name",
+     '(def! g (fn* [] (let* [x 1] (do (mm) x))))\n'
+     '(defmacro! mm (fn* [] \'(def! x 2)))\n'
+     '(prn (g))\n',
+     '2\n'),
+    ("builtin redefined as a macro",
+     '(def! h (fn* [] (list (* (- 5 3) 3))))\n'
+     '(prn (h))\n'
+     '(defmacro! * (fn* [a b] (list \'quote a)))\n'
+     '(prn (h))\n',
+     '(6)\n((- 5 3))\n'),
+]
+
+def main():
+    tmp = tempfile.mkdtemp(prefix='mal-optimize.')
+    try:
+        for name, forms, expected in CASES:
+            check(name, run(tmp, forms), expected)
+            check(name + " (folded)", run(tmp, forms, '--optimize'), expected)
+    finally:
+        shutil.rmtree(tmp)
+
+    if failures:
+        sys.exit("%d failed" % failures)
+
+if __name__ == '__main__':
+    main()
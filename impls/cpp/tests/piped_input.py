@@ -0,0 +1,81 @@
+#!/usr/bin/env python3
+
+# Tests the REPL reading forms from a pipe rather than a terminal: forms
+# may span lines, several may share a line, and brackets inside strings
+# and comments don't count. The REPL still writes the prompt and echoes
+# each form before its output, as it does under readline.
+#
+# Run from impls/cpp with: make test-pipe
+
+from __future__ import print_function
+import subprocess, sys
+
+BANNER = 'Mal [C++]\n'
+PROMPT = 'user> '
+
+failures = 0
+
+def check(name, got, expected):
+    global failures
+    if got == expected:
+        print("PASS: %s" % name)
+    else:
+        failures += 1
+        print("FAIL: %s: expected %r, got %r" % (name, expected, got))
+
+def pipe(text):
+    """Pipes text into the REPL, returning the forms it echoed and what
+    each of them printed, split at the prompts."""
+    output = subprocess.run(['./stepA_mal'], input=text.encode('utf-8'),
+                            stdout=subprocess.PIPE, check=True).stdout
+    transcript = output.decode('utf-8')
+    if not transcript.startswith(BANNER) or \
+       not transcript.endswith(PROMPT):
+        return transcript
+    replies = transcript[len(BANNER):-len(PROMPT)].split(PROMPT)
+    return [tuple(reply.split('\n', 1)) for reply in replies if reply]
+
+CASES = [
+    ("form spanning lines",
+     '(+ 1\n   2)\n',
+     [('(+ 1', '   2)\n3\n')]),
+    ("several forms on a line",
+     '(prn 1) (prn 2)   3\n',
+     [('(prn 1)', '1\nnil\n'), ('(prn 2)', '2\nnil\n'), ('3', '3\n')]),
+    ("brackets in strings",
+     '(str "(" "]" "\\"{")\n',
+     [('(str "(" "]" "\\"{")', '"(]\\"{"\n')]),
+    ("semicolons in strings",
+     '"x;y" (count (seq "a;)"))\n',
+     [('"x;y"', '"x;y"\n'), ('(count (seq "a;)"))', '3\n')]),
+    ("comment lines",
+     '; (not a form\n(+ 2 3)\n',
+     [('(+ 2 3)', '5\n')]),
+    ("comments after a form",
+     '(+ 2 3) ; (prn :skipped)\n',
+     [('(+ 2 3)', '5\n')]),
+    ("comments inside a form",
+     '(+ 1 ; ) not the end\n   2)\n',
+     [('(+ 1 ; ) not the end', '   2)\n3\n')]),
+    ("metadata prefix",
+     '(meta ^{:k 1} [1])\n(meta ^{:k 2}\n[2])\n',
+     [('(meta ^{:k 1} [1])', '{:k 1}\n'),
+      ('(meta ^{:k 2}', '[2])\n{:k 2}\n')]),
+    ("deref prefix",
+     '(def! a (atom 5)) @a\n@\na\n',
+     [('(def! a (atom 5))', '(atom 5)\n'), ('@a', '5\n'),
+      ('@', 'a\n5\n')]),
+    ("unfinished form at the end",
+     '(prn 1)\n(+ 1',
+     [('(prn 1)', '1\nnil\n'), ('(+ 1', "Error: expected ')', got EOF\n")]),
+]
+
+def main():
+    for name, text, expected in CASES:
+        check(name, pipe(text), expected)
+
+    if failures:
+        sys.exit("%d failed" % failures)
+
+if __name__ == '__main__':
+    main()
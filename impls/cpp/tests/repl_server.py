@@ -0,0 +1,286 @@
+#!/usr/bin/env python3
+
+# Tests the REPL server (stepA_mal --serve) as a client would use it: over
+# a UNIX domain socket and over a loopback TCP port, with several sessions
+# open at once.
+#
+# Run from impls/cpp with: make test-server
+
+from __future__ import print_function
+import os, sys
+import shutil, socket, struct, subprocess, tempfile, time
+
+PROMPT = b'user> '
+
+class Session(object):
+    def __init__(self, family, address):
+        self.sock = socket.socket(family, socket.SOCK_STREAM)
+        self.sock.settimeout(10)
+        self.sock.connect(address)
+        self.pending = b''
+        self.read_prompt()
+
+    def read_prompt(self):
+        """Returns everything the server sends before its next prompt."""
+        while PROMPT not in self.pending:
+            chunk = self.sock.recv(65536)
+            if not chunk:
+                raise EOFError("the server closed the session")
+            self.pending += chunk
+        reply, self.pending = self.pending.split(PROMPT, 1)
+        return reply.decode('utf-8')
+
+    def send(self, text):
+        self.sock.sendall(text.encode('utf-8'))
+
+    def eval(self, line):
+        self.send(line + '\n')
+        return self.read_prompt()
+
+    def close(self):
+        self.sock.close()
+
+failures = 0
+
+def check(name, got, expected):
+    global failures
+    if got == expected:
+        print("PASS: %s" % name)
+    else:
+        failures += 1
+        print("FAIL: %s: expected %r, got %r" % (name, expected, got))
+
+def start_server(tmp, address, **env):
+    prelude = os.path.join(tmp, 'prelude.mal')
+    with open(prelude, 'w') as f:
+        f.write('(def! greeting "hello")\n'
+                '(def! counter (atom 0))\n'
+                '(defmacro! unless (fn* [c a b] `(if ~c ~b ~a)))\n')
+    return subprocess.Popen(['./stepA_mal', '--serve', address, prelude],
+                            stdin=subprocess.DEVNULL,
+                            env=dict(os.environ, **env))
+
+def connect(server, family, address):
+    for _ in range(500):
+        if server.poll() is not None:
+            sys.exit("The server exited with %d" % server.returncode)
+        try:
+            return Session(family, address)
+        except (FileNotFoundError, ConnectionRefusedError):
+            time.sleep(0.01)
+    sys.exit("The server didn't start")
+
+def test_sessions(server, family, address, kind):
+    a = connect(server, family, address)
+    b = Session(family, address)
+
+    check("%s: prelude" % kind, a.eval('greeting'), '"hello"\n')
+    check("%s: prelude macro" % kind, b.eval('(unless false 1 2)'), '1\n')
+    check("%s: output, then result" % kind,
+          a.eval('(do (prn :printed) 7)'), ':printed\n7\n')
+    check("%s: errors" % kind, a.eval('(throw "oops")'), 'Error: "oops"\n')
+    check("%s: blank line" % kind, a.eval(''), '')
+
+    a.eval('(def! mine 1)')
+    check("%s: own definitions" % kind, a.eval('mine'), '1\n')
+    check("%s: others' definitions" % kind, b.eval('mine'),
+          "Error: 'mine' not found\n")
+    b.eval('(def! greeting "shadowed")')
+    check("%s: shadowing the prelude" % kind, b.eval('greeting'),
+          '"shadowed"\n')
+    check("%s: prelude unchanged" % kind, a.eval('greeting'), '"hello"\n')
+    b.eval('(eval (read-string "(def! evaled 2)"))')
+    check("%s: eval defines in the session" % kind, a.eval('evaled'),
+          "Error: 'evaled' not found\n")
+
+    # Half a line from one client holds up no one else.
+    a.send('(+ 1 ')
+    check("%s: while another waits" % kind, b.eval('(* 6 7)'), '42\n')
+    a.send('2)\n')
+    check("%s: finishing the line" % kind, a.read_prompt(), '3\n')
+
+    # A last line without a newline is evaluated at shutdown.
+    a.send('(prn "bye")')
+    a.sock.shutdown(socket.SHUT_WR)
+    check("%s: last line" % kind, a.read_prompt(), '"bye"\nnil\n')
+    check("%s: closed" % kind, a.sock.recv(1), b'')
+    a.close()
+
+    many = [Session(family, address) for _ in range(20)]
+    for i, s in enumerate(many):
+        s.send('(def! n %d)\n' % i)
+    for s in many:
+        s.read_prompt()
+    check("%s: many sessions" % kind,
+          [s.eval('n') for s in many], ['%d\n' % i for i in range(20)])
+    for s in many:
+        s.close()
+    b.close()
+
+def cpu_seconds(server):
+    with open('/proc/%d/stat' % server.pid) as f:
+        fields = f.read().rsplit(')', 1)[1].split()
+    return (int(fields[11]) + int(fields[12])) / os.sysconf('SC_CLK_TCK')
+
+def is_dropped(session, data=b''):
+    """Whether the server closes the session, after sending it data."""
+    try:
+        if data:
+            session.sock.sendall(data)
+        while session.sock.recv(65536):
+            pass
+        return True
+    except (ConnectionResetError, BrokenPipeError):
+        return True
+    except socket.timeout:
+        return False
+
+def test_limits(server, family, address, kind):
+    a = connect(server, family, address)
+    b = Session(family, address)
+
+    # One session's evaluation holds up no one else's.
+    a.send('(let* [spin (fn* [] (spin))] (spin))\n')
+    start = time.monotonic()
+    check("%s: while another evaluates" % kind, b.eval('(+ 1 2)'), '3\n')
+    check("%s: without waiting for it" % kind,
+          time.monotonic() - start < 1, True)
+
+    # A client hanging up stops whatever its session was evaluating. Over
+    # TCP, closing looks like shutting down one side until something is
+    # written, so the client resets the connection instead.
+    a.sock.setsockopt(socket.SOL_SOCKET, socket.SO_LINGER,
+                      struct.pack('ii', 1, 0))
+    a.close()
+    time.sleep(0.2)
+    before = cpu_seconds(server)
+    time.sleep(0.5)
+    check("%s: interrupted when the client goes" % kind,
+          cpu_seconds(server) - before < 0.25, True)
+
+    # A future may outlive the session which started it, and goes on with
+    # the session's interpreter: eval uses it, and so does printing.
+    done = os.path.join(os.path.dirname(server.args[-1]), 'future.%s' % kind)
+    e = Session(family, address)
+    e.eval('(def! spin-down (fn* [n] (if (> n 0) (spin-down (- n 1)) n)))')
+    check("%s: future started" % kind,
+          e.eval('(do (future (do (spin-down 100000) (println "done")'
+                 ' (spit "%s" (str (eval (quote (+ 1 2))))))) nil)' % done),
+          'nil\n')
+    e.close()
+    for _ in range(500):
+        if os.path.exists(done) or server.poll() is not None:
+            break
+        time.sleep(0.01)
+    time.sleep(0.1)
+    check("%s: future finished after its session" % kind,
+          open(done).read() if os.path.exists(done) else None, '3')
+    check("%s: server outlives the future" % kind, server.poll(), None)
+
+    read_only = 'Error: atoms from the prelude are read-only\n'
+    check("%s: reset! of the prelude" % kind,
+          b.eval('(reset! counter 5)'), read_only)
+    check("%s: swap! of the prelude" % kind,
+          b.eval('(swap! counter (fn* [n] (+ n 1)))'), read_only)
+    check("%s: prelude atom unchanged" % kind, b.eval('@counter'), '0\n')
+    check("%s: own atoms" % kind,
+          b.eval('(let* [x (atom 1)] (swap! x + 1))'), '2\n')
+
+    c = Session(family, address)
+    check("%s: dropped for a line too long" % kind,
+          is_dropped(c, b'x' * (2 << 20)), True)
+    c.close()
+    d = Session(family, address)
+    d.send('(apply str (repeat 300000 (apply str (repeat 64 "x"))))\n')
+    check("%s: dropped for too much output" % kind, is_dropped(d), True)
+    d.close()
+    check("%s: others unaffected" % kind, b.eval('greeting'), '"hello"\n')
+    b.close()
+
+def test_socket_path(tmp, path):
+    """The server only replaces a socket left by one which has gone."""
+    other = start_server(tmp, path)
+    check("unix: not over a live server", other.wait(timeout=10), 1)
+    session = Session(socket.AF_UNIX, path)
+    check("unix: live server kept", session.eval('greeting'), '"hello"\n')
+    session.close()
+
+    plain = os.path.join(tmp, 'plain')
+    with open(plain, 'w') as f:
+        f.write('keep')
+    other = start_server(tmp, plain)
+    check("unix: not over a file", other.wait(timeout=10), 1)
+    with open(plain) as f:
+        check("unix: file kept", f.read(), 'keep')
+
+    stale = os.path.join(tmp, 'stale.sock')
+    left = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+    left.bind(stale)
+    left.close()
+    other = start_server(tmp, stale)
+    try:
+        check("unix: over a stale socket",
+              connect(other, socket.AF_UNIX, stale).eval('greeting'),
+              '"hello"\n')
+    finally:
+        other.terminate()
+        other.wait()
+
+def test_session_limit(tmp):
+    """Past MAL_SERVER_SESSIONS, a client waits for a session to end."""
+    path = os.path.join(tmp, 'limited.sock')
+    server = start_server(tmp, path, MAL_SERVER_SESSIONS='2')
+    try:
+        a = connect(server, socket.AF_UNIX, path)
+        b = Session(socket.AF_UNIX, path)
+        waiting = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        waiting.connect(path)
+        waiting.settimeout(0.5)
+        try:
+            early = waiting.recv(len(PROMPT))
+        except socket.timeout:
+            early = b''
+        check("limit: no session past the limit", early, b'')
+        a.close()
+        waiting.settimeout(10)
+        check("limit: a session once one ends",
+              waiting.recv(len(PROMPT)), PROMPT)
+        check("limit: others unaffected", b.eval('(+ 1 2)'), '3\n')
+        waiting.close()
+        b.close()
+    finally:
+        server.terminate()
+        server.wait()
+
+def free_port():
+    with socket.socket(socket.AF_INET, socket.SOCK_STREAM) as s:
+        s.bind(('127.0.0.1', 0))
+        return s.getsockname()[1]
+
+def main():
+    tmp = tempfile.mkdtemp(prefix='mal-server.')
+    servers = []
+    try:
+        path = os.path.join(tmp, 'repl.sock')
+        servers.append(start_server(tmp, path))
+        test_sessions(servers[-1], socket.AF_UNIX, path, "unix")
+        test_limits(servers[-1], socket.AF_UNIX, path, "unix")
+        test_socket_path(tmp, path)
+        test_session_limit(tmp)
+
+        port = free_port()
+        tcp = ('127.0.0.1', port)
+        servers.append(start_server(tmp, str(port)))
+        test_sessions(servers[-1], socket.AF_INET, tcp, "tcp")
+        test_limits(servers[-1], socket.AF_INET, tcp, "tcp")
+    finally:
+        for server in servers:
+            server.terminate()
+            server.wait()
+        shutil.rmtree(tmp)
+
+    if failures:
+        sys.exit("%d failed" % failures)
+
+if __name__ == '__main__':
+    main()
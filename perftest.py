@@ -0,0 +1,303 @@
+#!/usr/bin/env python3
+
+# Runs the performance tests against several Mal implementations, many
+# times each, and reports the median and 95th percentile wall time, peak
+# memory and startup time of each. perf3 runs for a fixed time, so for it
+# the median number of iterations it managed is what counts. The results
+# can be saved as JSON and compared against a saved baseline, to catch
+# regressions.
+#
+# Build the implementations first, e.g. make "cpp^stepA", or pass --build.
+
+from __future__ import print_function
+import os, sys, re
+import argparse, ctypes, json, math, platform, time
+import signal, subprocess, tempfile
+
+parser = argparse.ArgumentParser(
+        description="Compare the performance of Mal implementations")
+parser.add_argument('--impls', nargs='+', default=['cpp', 'c', 'c.2', 'c.3'],
+        help="implementations to run (default: cpp c c.2 c.3)")
+parser.add_argument('--workloads', nargs='+',
+        default=['tests/perf1.mal', 'tests/perf2.mal', 'tests/perf3.mal'],
+        help="mal files to run (default: tests/perf1.mal tests/perf2.mal "
+             "tests/perf3.mal)")
+parser.add_argument('--runs', default=10, type=int,
+        help="measured runs of each workload (default: 10)")
+parser.add_argument('--warmup', default=2, type=int,
+        help="runs to discard before measuring (default: 2)")
+parser.add_argument('--timeout', default=120, type=int,
+        help="seconds to allow each run (default: 120)")
+parser.add_argument('--build', action='store_true',
+        help="build stepA of each implementation first")
+parser.add_argument('--json', type=str,
+        help="write the results to this file, or - for stdout")
+parser.add_argument('--baseline', type=str,
+        help="compare against results saved with --json")
+parser.add_argument('--threshold', default=10.0, type=float,
+        help="percentage slowdown or growth counted as a regression "
+             "(default: 10)")
+
+PR_SET_CHILD_SUBREAPER = 36
+
+IS_SUBREAPER = False
+
+class RunError(Exception):
+    pass
+
+def percentile(values, p):
+    """The nearest-rank percentile of values."""
+    ordered = sorted(values)
+    rank = int(math.ceil(p / 100.0 * len(ordered)))
+    return ordered[min(max(rank, 1), len(ordered)) - 1]
+
+def median(values):
+    ordered = sorted(values)
+    middle = len(ordered) // 2
+    if len(ordered) % 2:
+        return ordered[middle]
+    return (ordered[middle - 1] + ordered[middle]) / 2.0
+
+def become_subreaper():
+    """Has orphaned descendants reparented to us rather than to init, so
+    that we can wait for them."""
+    try:
+        libc = ctypes.CDLL(None, use_errno=True)
+        return libc.prctl(PR_SET_CHILD_SUBREAPER, 1, 0, 0, 0) == 0
+    except (AttributeError, OSError):
+        return False
+
+def spawn(argv, cwd, output):
+    """Starts argv, returning its pid and that of any process which must be
+    reaped before it."""
+    if not IS_SUBREAPER:
+        proc = subprocess.Popen(argv, cwd=cwd, stdin=subprocess.DEVNULL,
+                                stdout=output, stderr=output,
+                                start_new_session=True)
+        proc.returncode = 0     # we reap it ourselves
+        return proc.pid, None
+
+    # A process's peak RSS starts at that of whatever forked it, which for
+    # us would be Python's, so have a small shell fork it. The shell then
+    # becomes echo, which never reaps it, and it's reparented to us.
+    r, w = os.pipe()
+    shell = subprocess.Popen(
+        ['/bin/sh', '-c', '"$@" %d>&- & exec echo $! >&%d' % (w, w), 'sh']
+        + argv,
+        cwd=cwd, stdin=subprocess.DEVNULL, stdout=output, stderr=output,
+        pass_fds=(w,), start_new_session=True)
+    shell.returncode = 0
+    os.close(w)
+    with os.fdopen(r) as f:
+        pid = int(f.read())
+    return pid, shell.pid
+
+def run_once(impl_dir, workload, timeout):
+    """Runs workload once, returning its wall time in seconds, peak RSS in
+    KB and output."""
+    # Workloads load their libraries relative to the implementation's
+    # directory, as they do under make "perf^IMPL". Each implementation's
+    # run script just execs stepA_mal, but the shell would add to its RSS.
+    r, w = os.pipe()
+    start = time.perf_counter()
+    pid, shell = spawn([os.path.join(impl_dir, 'stepA_mal'), workload],
+                       impl_dir, w)
+    os.close(w)
+
+    def kill(signum, frame):
+        os.killpg(shell or pid, signal.SIGKILL)
+    old_handler = signal.signal(signal.SIGALRM, kill)
+    signal.alarm(timeout)
+    try:
+        with os.fdopen(r, 'rb') as f:
+            output = f.read()
+        if shell:
+            os.waitpid(shell, 0)
+        # Only wait4 gives us its resource usage.
+        _, status, rusage = os.wait4(pid, 0)
+    finally:
+        signal.alarm(0)
+        signal.signal(signal.SIGALRM, old_handler)
+    elapsed = time.perf_counter() - start
+
+    output = output.decode('utf-8', 'replace')
+    if os.WIFSIGNALED(status):
+        raise RunError("killed by signal %d%s" % (os.WTERMSIG(status),
+                       " (timed out)" if elapsed >= timeout else ""))
+    if os.WEXITSTATUS(status) != 0:
+        raise RunError("exited with %d: %s" % (os.WEXITSTATUS(status),
+                       output.strip()[-200:]))
+    return elapsed, rusage.ru_maxrss, output
+
+def summarise(times, rss, outputs):
+    result = {
+        'runs': len(times),
+        'median_ms': median(times) * 1000,
+        'p95_ms': percentile(times, 95) * 1000,
+        'min_ms': min(times) * 1000,
+        'max_ms': max(times) * 1000,
+        'peak_rss_kb': max(rss),
+    }
+    # What the workloads report about themselves, where they do.
+    reported = [float(m) for o in outputs
+                for m in re.findall(r'Elapsed time: (\d+) msecs', o)]
+    if reported:
+        result['reported_median_ms'] = median(reported)
+    iterations = [int(m) for o in outputs
+                  for m in re.findall(r'iters over \d+ seconds: (\d+)', o)]
+    if iterations:
+        result['reported_iterations'] = median(iterations)
+    return result
+
+def measure(impl_dir, workload, args):
+    times, rss, outputs = [], [], []
+    for i in range(args.warmup + args.runs):
+        elapsed, maxrss, output = run_once(impl_dir, workload, args.timeout)
+        if i >= args.warmup:
+            times.append(elapsed)
+            rss.append(maxrss)
+            outputs.append(output)
+    return summarise(times, rss, outputs)
+
+def build(impl):
+    print("Building %s" % impl, file=sys.stderr)
+    return subprocess.call(['make', '-s', 'build^%s^stepA' % impl],
+                           stdout=sys.stderr) == 0
+
+def run_impl(impl, workloads, startup_file, args):
+    impl_dir = os.path.abspath(os.path.join('impls', impl))
+    if not os.path.isdir(impl_dir):
+        return {'error': "no such implementation"}
+    if args.build and not build(impl):
+        return {'error': "build failed"}
+    if not os.path.exists(os.path.join(impl_dir, 'stepA_mal')):
+        return {'error': "stepA_mal isn't built"}
+
+    result = {'workloads': {}, 'errors': {}}
+    for name, path in [('startup', startup_file)] + \
+                      [(w, os.path.abspath(w)) for w in workloads]:
+        print("%s: %s" % (impl, name), file=sys.stderr)
+        try:
+            stats = measure(impl_dir, path, args)
+        except RunError as e:
+            result['errors'][name] = str(e)
+            continue
+        if name == 'startup':
+            result['startup'] = stats
+        else:
+            result['workloads'][name] = stats
+    return result
+
+def rows(results):
+    """(impl, name, stats) for every measurement, startup first."""
+    for impl, result in results['impls'].items():
+        if 'startup' in result:
+            yield impl, 'startup', result['startup']
+        for workload, stats in result.get('workloads', {}).items():
+            yield impl, workload, stats
+
+def print_table(results, baseline):
+    header = "%-6s %-18s %10s %10s %10s %10s" % (
+        "impl", "workload", "median ms", "p95 ms", "peak MB", "iters")
+    if baseline:
+        header += " %9s %9s %9s" % ("time", "memory", "iters")
+    print(header)
+    print("-" * len(header))
+    for impl, name, stats in rows(results):
+        iterations = stats.get('reported_iterations')
+        line = "%-6s %-18s %10.1f %10.1f %10.1f %10s" % (
+            impl, os.path.basename(name), stats['median_ms'],
+            stats['p95_ms'], stats['peak_rss_kb'] / 1024.0,
+            iterations if iterations is not None else "-")
+        before = lookup(baseline, impl, name)
+        if before:
+            line += " %+8.1f%% %+8.1f%%" % (
+                change(before['median_ms'], stats['median_ms']),
+                change(before['peak_rss_kb'], stats['peak_rss_kb']))
+            if iterations is not None and 'reported_iterations' in before:
+                line += " %+8.1f%%" % change(before['reported_iterations'],
+                                             iterations)
+        print(line)
+    for impl, result in results['impls'].items():
+        if 'error' in result:
+            print("%-6s %s" % (impl, result['error']))
+        for name, error in result.get('errors', {}).items():
+            print("%-6s %-18s %s" % (impl, os.path.basename(name), error))
+
+def lookup(baseline, impl, name):
+    if not baseline:
+        return None
+    result = baseline['impls'].get(impl, {})
+    if name == 'startup':
+        return result.get('startup')
+    return result.get('workloads', {}).get(name)
+
+def change(before, after):
+    return (after - before) * 100.0 / before if before else 0.0
+
+def regressions(results, baseline, threshold):
+    found = []
+    for impl, name, stats in rows(results):
+        before = lookup(baseline, impl, name)
+        if not before:
+            continue
+        for key, what in (('median_ms', "median time"),
+                          ('peak_rss_kb', "peak RSS")):
+            growth = change(before[key], stats[key])
+            if growth > threshold:
+                found.append("%s %s: %s up %.1f%%" % (
+                    impl, os.path.basename(name), what, growth))
+        # Fewer iterations in the same time is the slowdown here.
+        if 'reported_iterations' in stats and \
+           'reported_iterations' in before:
+            drop = -change(before['reported_iterations'],
+                           stats['reported_iterations'])
+            if drop > threshold:
+                found.append("%s %s: iterations down %.1f%%" % (
+                    impl, os.path.basename(name), drop))
+    return found
+
+def main():
+    global IS_SUBREAPER
+    args = parser.parse_args()
+    IS_SUBREAPER = become_subreaper()
+    os.chdir(os.path.dirname(os.path.abspath(__file__)))
+    if args.runs < 1:
+        parser.error("--runs must be at least 1")
+
+    baseline = None
+    if args.baseline:
+        with open(args.baseline) as f:
+            baseline = json.load(f)
+
+    with tempfile.NamedTemporaryFile('w', suffix='.mal') as startup:
+        startup.write("nil\n")
+        startup.flush()
+        results = {
+            'host': platform.node(),
+            'date': time.strftime('%Y-%m-%dT%H:%M:%S'),
+            'runs': args.runs,
+            'warmup': args.warmup,
+            'impls': {},
+        }
+        for impl in args.impls:
+            results['impls'][impl] = run_impl(impl, args.workloads,
+                                              startup.name, args)
+
+    if args.json == '-':
+        json.dump(results, sys.stdout, indent=2)
+        print()
+    else:
+        if args.json:
+            with open(args.json, 'w') as f:
+                json.dump(results, f, indent=2)
+                f.write('\n')
+        print_table(results, baseline)
+
+    found = regressions(results, baseline, args.threshold)
+    for regression in found:
+        print("REGRESSION: %s" % regression, file=sys.stderr)
+    sys.exit(1 if found else 0)
+
+if __name__ == '__main__':
+    main()